@@ -1,17 +1,374 @@
-// g++ -std=c++14 -o output game.cpp
-// ./output
+// g++ -std=c++14 -pthread -o output game.cpp
+// ./output [--seed seed]   (the 7 battles; the seed is printed to stderr so a run can be repeated)
+// ./output ... --profile path   (any mode: counters and simulation/formatting/output time as JSON, build with -DPROFILE)
+// ./output --bench-suite [json_path] [scale]   (micro and macro benchmarks as JSON, "-" for stdout; also make bench)
+// ./output --bench-sinks [n_battles]   (headless throughput benchmark)
+// ./output --tournament n_battles [n_threads] [csv_path] [seed] [store_path]   (multi-threaded random 4 vs 4 runs)
+// ./output --job path <random|grid> seed n_battles shard n_shards [n_threads] [checkpoint_seconds]   (one shard of a long tournament, checkpointed; rerun to resume)
+// ./output --merge-jobs <csv_path|-> path...   (add up the checkpoints of the shards of a job)
+// ./output --query store_path [min_battles]   (aggregates over a result store written by --tournament)
+// ./output --replay seed battle_index   (one battle of a tournament with that seed, with the full text)
+// ./output --bench-soa [n_battles] [seed]   (class hierarchy vs structure-of-arrays engine)
+// ./output --bench-kernels [n_battles] [seed]   (structure-of-arrays engine vs compile-time matchup kernels)
+// ./output --bench-lanes [n_battles] [seed] [catalog]   (lockstep lane engine vs the flat tables, short and long battles; build with -mavx2 for AVX2)
+// ./output --analyze <lineup1> <lineup2>   (exact outcome probabilities, lineups as letters e.g. GTO)
+// ./output --analyze-random n1 n2   (exact outcome probabilities over monsterPicker lineups)
+// ./output --optimize <pool> <opponents>   (best order of a pool of monsters, e.g. GGTTO GTO,OOT or random:4)
+// ./output --catalog <path|builtin> [n_battles] [team_size] [fast_forward]   (sweep the archetypes of a monster catalog file)
+// ./output --bench-fast-forward [catalog] [n_battles] [seed]   (turn by turn vs skipping deterministic stretches of turns)
+// ./output --league path <lineup_file|random:n:team_size> [n_games] [n_threads] [csv_path]   (round robin with Glicko ratings; rerun with more lineups to add teams)
+// ./output --balance [step] [top_k] [csv_path]   (search stats that satisfy the balancing rules)
+// ./output --bench-cache [n_pairs] [n_battles] [seed]   (replayed matchups with and without the outcome cache)
+// ./output --check-allocs [n_battles]   (fails if makeBattle allocates after warm-up)
+// ./output --bench-render [n_battles] [seed]   (buffered text renderer vs simple renderer, output must match)
+// ./output --bench-async [n_battles] [seed]   (rendering on the simulation thread vs a formatter thread)
+// ./output --audit n_battles [log_path]   (full verbose log of random battles, formatted in the background)
+// ./output --bench-record [n_battles] [seed]   (binary recording vs text: size, scan speed, replay must match)
+// ./output --record n_battles path [keyframe_interval]   (record random battles in the binary format)
+// ./output --play path [battle_index] [from_turn] [to_turn]   (replay a recording as coloured text)
+// ./output --serve [port] [n_threads] [max_active]   (battle host on 127.0.0.1, protocol above BattleHost)
+// ./output --bench-host [n_matches] [n_threads] [max_active] [seed]   (interleaved matches: throughput and turn latency)
+// ./output --massive n1 n2 [max_turns] [log_path]   (one battle of huge random teams, no turn limit by default)
 
 #include <iostream>
 #include <vector>
 #include <string>
 #include <random>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <streambuf>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <fstream>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <new>
+#include <limits>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <cerrno>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+#if defined(__AVX2__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#endif
 using namespace std;
 
+// heap allocation counter, used to check that repeated battles do not allocate (--check-allocs and
+// the bench suite's allocations per battle); built with -DCOUNT_ALLOCS (make bench, make check) every
+// operator new in the program goes through here, otherwise the standard allocator is left alone and
+// the counter stays at 0
+atomic<long long> n_heap_allocations(0);
+
+#ifdef COUNT_ALLOCS
+#if defined(__GNUC__)
+// not inlined into callers, where gcc would see free() on memory from operator new (-Wmismatched-new-delete)
+#define ALLOC_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define ALLOC_NOINLINE __declspec(noinline)
+#else
+#define ALLOC_NOINLINE
+#endif
+
+ALLOC_NOINLINE void* operator new(size_t size) {
+    n_heap_allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) {throw bad_alloc();}
+    return p;
+}
+ALLOC_NOINLINE void* operator new[](size_t size) {return operator new(size);}
+ALLOC_NOINLINE void* operator new(size_t size, const nothrow_t&) noexcept {
+    try {return operator new(size);} catch (const bad_alloc&) {return nullptr;}
+}
+ALLOC_NOINLINE void* operator new[](size_t size, const nothrow_t&) noexcept {
+    try {return operator new(size);} catch (const bad_alloc&) {return nullptr;}
+}
+ALLOC_NOINLINE void operator delete(void* p) noexcept {free(p);}
+ALLOC_NOINLINE void operator delete[](void* p) noexcept {free(p);}
+ALLOC_NOINLINE void operator delete(void* p, size_t) noexcept {free(p);}
+ALLOC_NOINLINE void operator delete[](void* p, size_t) noexcept {free(p);}
+ALLOC_NOINLINE void operator delete(void* p, const nothrow_t&) noexcept {free(p);}
+ALLOC_NOINLINE void operator delete[](void* p, const nothrow_t&) noexcept {free(p);}
+#endif
+
+// profiling
+// built with -DPROFILE, the battle loop (battle() and the Monster classes) counts what happens and
+// scoped timers split the time of every thread between simulation, formatting and output; a timer
+// pauses the one it is nested in, so each phase only gets its own time (e.g. a TextSink formatting
+// inside battle() is not simulation). --profile path writes the totals as JSON at the end of any run.
+// without -DPROFILE the macros expand to nothing.
+
+enum ProfileCounter {prof_battles, prof_turns, prof_attacks, prof_reflects, prof_regens, prof_deaths, prof_coin_flips};
+constexpr int N_PROFILE_COUNTERS = prof_coin_flips + 1;
+enum ProfilePhase {phase_simulation, phase_formatting, phase_output};
+constexpr int N_PROFILE_PHASES = phase_output + 1;
+
+struct ProfileData {
+    // counters and phase times of one thread
+    long long counts[N_PROFILE_COUNTERS] = {};
+    long long phase_ns[N_PROFILE_PHASES] = {};
+    long long phase_scopes[N_PROFILE_PHASES] = {}; // number of timed scopes
+    int current_phase = -1; // phase of the innermost running timer
+    chrono::steady_clock::time_point since; // when the current phase last started or resumed
+};
+
+class ProfileRegistry {
+    // the data of every thread that counted anything, kept after the thread ends
+    public:
+        ProfileData& add() {
+            lock_guard<mutex> lock(m);
+            threads.emplace_back();
+            return threads.back();
+        }
+
+        // sum over all threads (exact once the other threads are done)
+        ProfileData total(size_t& n_threads) {
+            lock_guard<mutex> lock(m);
+            ProfileData sum;
+            for (auto& data : threads) {
+                for (int i = 0; i < N_PROFILE_COUNTERS; i++) {sum.counts[i] += data.counts[i];}
+                for (int i = 0; i < N_PROFILE_PHASES; i++) {
+                    sum.phase_ns[i] += data.phase_ns[i];
+                    sum.phase_scopes[i] += data.phase_scopes[i];
+                }
+            }
+            n_threads = threads.size();
+            return sum;
+        }
+
+    private:
+        mutex m;
+        deque<ProfileData> threads; // deque: references stay valid as threads are added
+};
+
+ProfileRegistry& profileRegistry() {
+    static ProfileRegistry registry;
+    return registry;
+}
+
+inline ProfileData& profileData() {
+    thread_local ProfileData* data = &profileRegistry().add();
+    return *data;
+}
+
+class ProfileTimer {
+    // times its scope as the given phase
+    public:
+        explicit ProfileTimer(ProfilePhase phase): data(profileData()), outer(data.current_phase) {
+            auto now = chrono::steady_clock::now();
+            if (outer >= 0) {data.phase_ns[outer] += chrono::duration_cast<chrono::nanoseconds>(now - data.since).count();}
+            data.current_phase = phase;
+            data.phase_scopes[phase]++;
+            data.since = now;
+        }
+
+        ~ProfileTimer() {
+            auto now = chrono::steady_clock::now();
+            data.phase_ns[data.current_phase] += chrono::duration_cast<chrono::nanoseconds>(now - data.since).count();
+            data.current_phase = outer;
+            data.since = now;
+        }
+
+    private:
+        ProfileData& data;
+        int outer;
+};
+
+#ifdef PROFILE
+#define PROFILE_COUNT(counter) (profileData().counts[counter]++)
+#define PROFILE_ADD(counter, n) (profileData().counts[counter] += (n))
+#define PROFILE_PHASE(phase) ProfileTimer profile_timer(phase)
+#else
+#define PROFILE_COUNT(counter) ((void)0)
+#define PROFILE_ADD(counter, n) ((void)0)
+#define PROFILE_PHASE(phase) ((void)0)
+#endif
+
+void writeProfileJson(ostream& out, double wall_seconds) {
+    static const char* counter_names[N_PROFILE_COUNTERS] = {"battles", "turns", "attacks", "reflects", "regens", "deaths", "coin_flips"};
+    static const char* phase_names[N_PROFILE_PHASES] = {"simulation", "formatting", "output"};
+#ifdef PROFILE
+    size_t n_threads;
+    ProfileData total = profileRegistry().total(n_threads);
+    out << "{\n  \"enabled\": true,\n  \"wall_seconds\": " << wall_seconds << ",\n  \"threads\": " << n_threads << ",\n  \"counters\": {";
+    for (int i = 0; i < N_PROFILE_COUNTERS; i++) {
+        out << (i ? ", " : "") << "\"" << counter_names[i] << "\": " << total.counts[i];
+    }
+    out << "},\n  \"turns_per_battle\": " << 
+        (total.counts[prof_battles] ? static_cast<double>(total.counts[prof_turns]) / total.counts[prof_battles] : 0.0) << 
+        ",\n  \"phases\": {";
+    for (int i = 0; i < N_PROFILE_PHASES; i++) {
+        out << (i ? "," : "") << "\n    \"" << phase_names[i] << "\": {\"seconds\": " << total.phase_ns[i] / 1e9 << 
+            ", \"scopes\": " << total.phase_scopes[i] << "}";
+    }
+    out << "\n  }\n}\n";
+#else
+    (void)counter_names;
+    (void)phase_names;
+    out << "{\n  \"enabled\": false,\n  \"wall_seconds\": " << wall_seconds << "\n}\n";
+#endif
+}
+
+class ProfileReport {
+    // writes the profile to path ("-": stdout) when it goes out of scope; does nothing for an empty path
+    public:
+        explicit ProfileReport(const string& report_path): path(report_path), start(chrono::steady_clock::now()) {}
+
+        ~ProfileReport() {
+            if (path.empty()) {return;}
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+#ifndef PROFILE
+            cerr << "built without -DPROFILE, the profile only has the wall time\n";
+#endif
+            if (path == "-") {
+                writeProfileJson(cout, elapsed.count());
+                return;
+            }
+            ofstream file(path);
+            if (!file) {
+                cerr << "Cannot open " << path << "\n";
+                return;
+            }
+            writeProfileJson(file, elapsed.count());
+        }
+
+    private:
+        string path;
+        chrono::steady_clock::time_point start;
+};
+
 // set rng
+// random_device only picks seeds (printed, so runs can be repeated); everything that needs
+// randomness takes its rng as an argument so that every thread can have its own stream
 random_device rd;          
-mt19937 gen(rd()); 
+
+class CounterRng {
+    // counter-based generator (Philox4x32-10): every output is a pure function of
+    // (seed, battle index, stream, position), so the draws of any battle can be regenerated
+    // on their own, without replaying anything before them and whatever thread plays it
+    // stream 0 sets a battle up (lineups), stream t holds the coin flips of turn t
+    public:
+        typedef uint32_t result_type;
+        static constexpr result_type min() {return 0;}
+        static constexpr result_type max() {return numeric_limits<uint32_t>::max();}
+
+        CounterRng(uint64_t seed, uint64_t battle_idx, uint32_t stream = 0): 
+            key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)}, 
+            counter{static_cast<uint32_t>(battle_idx), static_cast<uint32_t>(battle_idx >> 32), stream, 0}, 
+            n_left(0) {}
+
+        // jump to the start of another stream of the same battle
+        void seek(uint32_t stream) {
+            counter[2] = stream;
+            counter[3] = 0;
+            n_left = 0;
+        }
+
+        result_type operator()() {
+            if (n_left == 0) {
+                philox(counter, key, block);
+                counter[3]++;
+                n_left = 4;
+            }
+            return block[4 - n_left--];
+        }
+
+        // one block of the Philox4x32-10 bijection
+        static void philox(const uint32_t in[4], const uint32_t in_key[2], uint32_t out[4]) {
+            uint32_t c[4] = {in[0], in[1], in[2], in[3]};
+            uint32_t k[2] = {in_key[0], in_key[1]};
+            for (int round = 0; round < 10; round++) {
+                uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c[0];
+                uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c[2];
+                uint32_t next[4] = {
+                    static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1),
+                    static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0)};
+                copy(next, next + 4, c);
+                k[0] += 0x9E3779B9u;
+                k[1] += 0xBB67AE85u;
+            }
+            copy(c, c + 4, out);
+        }
+
+    private:
+        uint32_t key[2];
+        uint32_t counter[4]; // battle index (low, high), stream, block within the stream
+        uint32_t block[4];
+        int n_left; // outputs of block not handed out yet
+};
+
+// move a generator to the draws of a turn: counter-based generators jump to the turn's stream,
+// sequential ones simply keep going
+inline void rngAtTurn(mt19937&, int) {}
+inline void rngAtTurn(CounterRng& rng, int turn_idx) {rng.seek(turn_idx);}
 
 enum MonsterType {goblin, troll, orc};
+constexpr int N_MONSTER_TYPES = orc + 1;
+enum BattleOutcome {team1_wins, team2_wins, tied, unfinished, stalemate}; 
+// unfinished: stopped by the turn limit; stalemate: neither team can ever lose a monster
+constexpr int N_OUTCOMES = stalemate + 1;
+
+constexpr int MAX_TURNS = 100; // battles are stopped after this many turns (by default)
+
+// stats of each monster type, known at compile time
+// (the Goblin/Troll/Orc constructors and the matchup kernels both read them from here)
+template <MonsterType T> struct MonsterStats;
+
+template <> struct MonsterStats<goblin> {
+    static constexpr int max_health = 50;
+    static constexpr int damage = 30;
+    static constexpr int speed = 50;
+    static constexpr int num_attack = 2;
+    static constexpr int regen_amount = 0;
+    static constexpr int block_amount = 0;
+    static constexpr int reflect_amount = 0;
+};
+
+template <> struct MonsterStats<troll> {
+    static constexpr int max_health = 100;
+    static constexpr int damage = 40;
+    static constexpr int speed = 20;
+    static constexpr int num_attack = 1;
+    static constexpr int regen_amount = 20;
+    static constexpr int block_amount = 0;
+    static constexpr int reflect_amount = 0;
+};
+
+template <> struct MonsterStats<orc> {
+    static constexpr int max_health = 70;
+    static constexpr int damage = 30;
+    static constexpr int speed = 30;
+    static constexpr int num_attack = 1;
+    static constexpr int regen_amount = 0;
+    static constexpr int block_amount = 10;
+    static constexpr int reflect_amount = 10;
+};
 enum OperatingSystem {windows, linux};
 
 // detect current os
@@ -48,17 +405,79 @@ vector<string> getNamePool() {
 }
 
 
-string popName(vector<string>& vec) {
-    // function that mimics "pop" in other language
-    // get the last element and delete it to avoid getting the same names in one run
-    if (vec.empty()) {
-        throw out_of_range("Cannot pop from an empty vector.");
-    }
-    string value = vec.back(); // Get the last element
-    vec.pop_back();         // Remove the last element
-    return value;           // Return the popped value
+// names as small integer ids
+// monsters only carry ids; strings are made when something is rendered
+// - monster name ids index an endless generated sequence: id % pool size picks the name
+//   from getNamePool(), later rounds get a number ("Zaku", ..., "Zaku 2", ...)
+// - team names are interned once per distinct name
+
+string monsterName(int name_id) {
+    static const vector<string> base_names = getNamePool();
+    int n_base = base_names.size();
+    const string& base = base_names[name_id % n_base];
+    return name_id < n_base ? base : base + " " + to_string(name_id / n_base + 1);
+}
+
+class NamePool {
+    // hands out monster name ids: every round of getNamePool() names in shuffled order,
+    // taken from the back (no name repeats within a round), and it never runs out
+    public:
+        NamePool(): n_base(getNamePool().size()), round(0), n_in_round(0) {
+            for (int i = 0; i < n_base; i++) {order.push_back(i);}
+        }
+
+        template <class Rng>
+        void shuffle_names(Rng& rng) {shuffle(order.begin(), order.end(), rng);}
+
+        int pop() {
+            int id = round * n_base + order[n_base - 1 - n_in_round];
+            if (++n_in_round == n_base) {
+                n_in_round = 0;
+                round = (round + 1) % (numeric_limits<int>::max() / n_base); // wrap instead of overflowing
+            }
+            return id;
+        }
+
+    private:
+        int n_base;
+        int round; // how many times every name has been handed out
+        int n_in_round;
+        vector<int> order;
+};
+
+class TeamNameTable {
+    // interned team names; ids are stable and strings are never moved, so resolved
+    // references stay valid while other threads intern new names
+    public:
+        int intern(const string& name) {
+            lock_guard<mutex> lock(m);
+            auto found = ids.find(name);
+            if (found != ids.end()) {return found->second;}
+            names.push_back(name);
+            ids[name] = names.size() - 1;
+            return names.size() - 1;
+        }
+
+        const string& resolve(int id) {
+            lock_guard<mutex> lock(m);
+            return names[id];
+        }
+
+    private:
+        mutex m;
+        deque<string> names;
+        unordered_map<string, int> ids;
+};
+
+TeamNameTable& teamNames() {
+    static TeamNameTable table;
+    return table;
 }
 
+int internTeamName(const string& name) {return teamNames().intern(name);}
+
+const string& teamNameOf(int team_id) {return teamNames().resolve(team_id);}
+
 string getColor(string text="default") {
     // string will be colored based on team name (currently only support red & blue)
     // return color only if operating system is not windows (i.e., is linux-based)
@@ -94,63 +513,167 @@ int getPlainTextLength(const string& text) {
     return length;
 }
 
+// battle events
+// everything that happens in a battle is reported to an EventSink as a typed event,
+// so the battle logic itself never builds strings or touches cout
+
+class Monster;
+class Team;
+
+enum EventType {battle_start_event, turn_start_event, attack_event, regen_event, 
+    death_event, defeat_event, battle_end_event, skip_event,
+    lineup_event, text_event}; // the last two only appear in records (see ActionLog), never in events
+constexpr int N_EVENT_TYPES = skip_event + 1;
+
+struct BattleEvent {
+    EventType type;
+    const Monster* actor; // attacker / regenerating / dying monster; team1's lead on turn start
+    const Monster* target; // attacked monster; team2's lead on turn start
+    const Team* team1; // defeated team on defeat; first team on battle start/end
+    const Team* team2; // second team on battle start/end
+    int turn_idx;
+    int attempted_damage; // attempted damage from attacker -> target
+    int actual_damage; // actual damage dealt from attacker -> target
+    int reflected_damage; // reflected damage from target -> attacker (-1 if none)
+    int regen_amount; // health actually regenerated
+    bool regen_capped; // if the regeneration stopped at max health
+    int skipped_turns; // on skip: turns played in one go from turn_idx on
+    BattleOutcome outcome; // on battle end
+
+    BattleEvent(EventType event_type): 
+        type(event_type), actor(nullptr), target(nullptr), team1(nullptr), team2(nullptr),
+        turn_idx(0), attempted_damage(-1), actual_damage(-1), reflected_damage(-1), 
+        regen_amount(0), regen_capped(false), skipped_turns(0), outcome(unfinished) {}
+};
+
+class EventSink {
+    // interface that receives every event of a battle
+    public:
+        virtual ~EventSink() = default;
+        virtual void on_event(const BattleEvent& event) = 0;
+        // if true, the battle may play deterministic stretches of turns in one go and report them
+        // as a single skip event (actor/target: the leads) instead of their turn/attack/regen events
+        virtual bool takes_summaries() const {return false;}
+};
+
+class NullSink: public EventSink {
+    // discards everything, for headless runs; with summaries, battles may fast-forward (worth it only
+    // when long duels between leads of different speeds are common: checking costs a little every turn)
+    public:
+        explicit NullSink(bool summaries = false): fast_forward(summaries) {}
+        void on_event(const BattleEvent&) override {}
+        bool takes_summaries() const override {return fast_forward;}
+
+    private:
+        bool fast_forward;
+};
+
+class CountingSink: public EventSink {
+    // counts the events of each type (e.g. number of attacks, deaths, battles)
+    public:
+        long long counts[N_EVENT_TYPES];
+
+        CountingSink() {reset();}
+
+        void on_event(const BattleEvent& event) override {counts[event.type]++;}
+
+        void reset() {fill(counts, counts + N_EVENT_TYPES, 0);}
+
+        long long count(EventType type) const {return counts[type];}
+};
+
 // classes
 
+struct MonsterRecord {
+    // what a record needs to know about a monster (copied, so it stays valid after the monster changes)
+    MonsterType type;
+    int name_id;
+    int team_id;
+    int health;
+};
+
 class ActionLog {
-    // records the output of each action in each turn
+    // fixed-size record of one event of a battle: only ids and numbers, no pointers,
+    // so records can be copied to another thread and formatted later (see AsyncTextSink)
+    // monsters fill in the numbers of their attacks through the setters
     public:
-        ActionLog () : 
-            attempted_damage(-1), actual_damage(-1), reflected_damage(-1) {}
+        EventType type;
+        MonsterRecord actor; // as in BattleEvent; the monster of a lineup record
+        MonsterRecord target;
+        int team1_id; // defeated team on defeat; first team on battle start/end
+        int team2_id; // second team on battle start/end
+        bool team1_defeated; // on battle end
+        bool team2_defeated;
+        int n_team1; // on battle start: number of lineup records of each team that follow
+        int n_team2;
+        int turn_idx; // on a text record: the length of its text (see AsyncTextSink)
+        int attempted_damage; // attempted damage from attacker -> opponent
+        int actual_damage; // actual damage dealt from attacker -> opponent
+        int reflected_damage; // reflected damage from opponent -> attacker (-1 if none)
+        int regen_amount;
+        bool regen_capped;
+        BattleOutcome outcome; // on battle end
+
+        ActionLog (EventType record_type = attack_event) : 
+            type(record_type), actor(), target(), team1_id(-1), team2_id(-1), 
+            team1_defeated(false), team2_defeated(false), n_team1(0), n_team2(0), turn_idx(0),
+            attempted_damage(-1), actual_damage(-1), reflected_damage(-1), 
+            regen_amount(0), regen_capped(false), outcome(unfinished) {}
 
         // Setters
         void set_attempted_damage(int value) {attempted_damage = value;}
         void set_actual_damage(int value) {actual_damage = value;}
         void set_reflected_damage(int value) {reflected_damage = value;}
 
-        string get_action_text() {
-            string action_text = " for " + to_string(attempted_damage) + 
-                " damage; dealing " + to_string(actual_damage) + " damage; ";
-            if (reflected_damage != -1) {
-                action_text = action_text + "receiving " + to_string(reflected_damage) + " reflected damage;";
-            } 
-            return action_text;
+        // turn the record into an attack event
+        BattleEvent get_event(const Monster& attacker, const Monster& target) const {
+            BattleEvent event(attack_event);
+            event.actor = &attacker;
+            event.target = &target;
+            event.attempted_damage = attempted_damage;
+            event.actual_damage = actual_damage;
+            event.reflected_damage = reflected_damage;
+            return event;
         }
-    
-    private:
-        int attempted_damage; // attempted damage from attacker -> opponent
-        int actual_damage; // actual damage dealt from attacker -> opponent
-        int reflected_damage; // reflected damage from opponent -> attacker
-
 };
 
 class Monster {
     // parent class that contains most specs for each monster
     public:
         MonsterType type; // type of monster (in enum)
-        string name; // given name
+        int name_id; // given name (see monsterName())
         int max_health; // maximum health for the monster
         int health; // current health
         int damage; // damage (per attack)
         int speed; // speed that decides who attack first
         bool is_alive; // if the monster is currently alive (true/false)
-        string team; // place holder for team name
+        int team_id; // place holder for team name (see teamNameOf())
+
+        Monster (int given_name_id): 
+            name_id(given_name_id), is_alive(true), team_id(internTeamName("Unspecified")) {};
 
-        Monster (string given_name): is_alive(true), name(given_name), team("Unspecified") {};
+        // bring a pooled monster back to life for a new battle, under a new name
+        void respawn(int given_name_id) {
+            name_id = given_name_id;
+            health = max_health;
+            is_alive = true;
+        }
 
         // default virtual destructor
         virtual ~Monster() = default;
 
         // defines behavior of attacking, goblin will be different
-        virtual void attack(Monster& enemy){
+        virtual void attack(Monster& enemy, EventSink& sink){
             if (enemy.is_alive){
+                PROFILE_COUNT(prof_attacks);
                 ActionLog log;
                 log.set_attempted_damage(damage);
                 enemy.on_enemy_attack(damage, this, &log);
-                cout << attack_text(enemy) + log.get_action_text() + "\n";
+                sink.on_event(log.get_event(*this, enemy));
             }
             
-            enemy.check_death();
-            check_death();
+            enemy.check_death(sink);
+            check_death(sink);
 
         };
 
@@ -162,25 +685,25 @@ class Monster {
         };
 
         // defines behavior on the end of each turn, troll will be different
-        virtual void on_end_turn(){}; // nothing by default
+        virtual void on_end_turn(EventSink&){}; // nothing by default
 
         // get the display name of the monster
         // if with_team==true: <team> <monster type> <monster name>
         // if with_color==true: name will be colored based on team name
         // example: Blue Goblin Alex
-        string disp(bool with_team, bool with_color){
+        string disp(bool with_team, bool with_color) const {
             string disp_text = "";
             if (with_team){
-                disp_text = disp_text + team + " ";
+                disp_text = disp_text + teamNameOf(team_id) + " ";
             }
-            disp_text = disp_text + monsterTypeToString(type) + " " + name;
+            disp_text = disp_text + monsterTypeToString(type) + " " + monsterName(name_id);
             if (with_color) {
-                disp_text = getColor(team) + disp_text + getColor();
+                disp_text = getColor(teamNameOf(team_id)) + disp_text + getColor();
             }
             return disp_text;
         };
 
-        string attack_text(Monster& enemy){
+        string attack_text(const Monster& enemy) const {
             return disp(true, true) + " attacks " + enemy.disp(true, true);
         };
 
@@ -198,10 +721,13 @@ class Monster {
             return reduce_amount;
         };
 
-        bool check_death() {
+        bool check_death(EventSink& sink) {
             if (is_alive && health<=0) {
+                PROFILE_COUNT(prof_deaths);
                 is_alive = false;
-                cout << disp(true, true) + " has died!\n";
+                BattleEvent event(death_event);
+                event.actor = this;
+                sink.on_event(event);
                 return true;
             } else if (is_alive && health>0) {
                 return false;
@@ -215,27 +741,27 @@ class Goblin: public Monster {
     public:
         int num_attack; // number of attacks delt by goblin in each turn
 
-        Goblin(string given_name): 
-            Monster(given_name), num_attack(2) {
+        Goblin(int given_name_id): 
+            Monster(given_name_id), num_attack(MonsterStats<goblin>::num_attack) {
             type = goblin;
-            max_health = 50;
+            max_health = MonsterStats<goblin>::max_health;
             health = max_health;
-            damage = 30;
-            speed = 50;
+            damage = MonsterStats<goblin>::damage;
+            speed = MonsterStats<goblin>::speed;
         };
 
         // attack multiple times when attacking
-        void attack(Monster& enemy) {
+        void attack(Monster& enemy, EventSink& sink) override {
             for (int i = 0; i < num_attack; i++) {
                 if (enemy.is_alive && is_alive) {
-                    // attack_text(enemy);
+                    PROFILE_COUNT(prof_attacks);
                     ActionLog log;
                     log.set_attempted_damage(damage);
                     enemy.on_enemy_attack(damage, this, &log);
 
-                    cout << attack_text(enemy) + log.get_action_text() + "\n";
-                    check_death();
-                    enemy.check_death();
+                    sink.on_event(log.get_event(*this, enemy));
+                    check_death(sink);
+                    enemy.check_death(sink);
                     }
                 else {break;}
             }
@@ -247,29 +773,29 @@ class Troll: public Monster {
     public:
         int regen_amount; // amount of health regnerated at the end of (their own) turn
 
-        Troll(string given_name): 
-            Monster(given_name), regen_amount(20) {
+        Troll(int given_name_id): 
+            Monster(given_name_id), regen_amount(MonsterStats<troll>::regen_amount) {
             type = troll;
-            max_health = 100;
+            max_health = MonsterStats<troll>::max_health;
             health = max_health;
-            speed = 20;
-            damage = 40;
+            speed = MonsterStats<troll>::speed;
+            damage = MonsterStats<troll>::damage;
         };
 
         // regeneration occurs at the end of their own turn
-        void on_end_turn(){
+        void on_end_turn(EventSink& sink) override {
             if (is_alive && health<max_health) {
+                PROFILE_COUNT(prof_regens);
+                BattleEvent event(regen_event);
+                event.actor = this;
+                event.regen_amount = regen_amount;
                 health += regen_amount;
                 if (health > max_health) {
-                    int regenerated = max_health - health;
+                    event.regen_amount = regen_amount - (health - max_health);
+                    event.regen_capped = true;
                     health = max_health;
-                    cout << disp(true, true) << " regenerates " << regenerated <<
-                        " health to " << health << " (max);\n";
-                }
-                else {
-                    cout << disp(true, true) << " regenerates " << regen_amount <<
-                        " health to " << health << ";\n";
                 }
+                sink.on_event(event);
             }
             
         };
@@ -281,13 +807,15 @@ class Orc: public Monster {
         int block_amount;
         int reflect_amount;
 
-        Orc(string given_name): 
-            Monster(given_name), block_amount(10), reflect_amount(10) {
+        Orc(int given_name_id): 
+            Monster(given_name_id), 
+            block_amount(MonsterStats<orc>::block_amount), 
+            reflect_amount(MonsterStats<orc>::reflect_amount) {
             type = orc;
-            max_health = 70;
+            max_health = MonsterStats<orc>::max_health;
             health = max_health;
-            speed = 30;
-            damage = 30;
+            speed = MonsterStats<orc>::speed;
+            damage = MonsterStats<orc>::damage;
         };
 
         // blocking and reflecting occurs when enemy attacks
@@ -303,6 +831,7 @@ class Orc: public Monster {
             int reduce_amount = reduce_health(damage_dealt);
             log->set_actual_damage(reduce_amount);
             log->set_reflected_damage(reflect_amount);
+            PROFILE_COUNT(prof_reflects);
 
             enemy->reduce_health(reflect_amount);
         };
@@ -310,40 +839,57 @@ class Orc: public Monster {
 
 class Team {
     // team class that can store a series (of pointers) of monsters, and if the team is defeated
+    // the monsters are either owned by the team, or borrowed from a BattleArena (see reset())
     public:
-        vector<unique_ptr<Monster>> monsters; 
+        vector<Monster*> monsters; 
         string name;
+        int team_id; // interned name
         bool is_defeated;
         int n_monsters;
 
         Team(const string team_name, vector<unique_ptr<Monster>> monster_list)
-            : name(team_name), is_defeated(false), n_monsters(monster_list.size()) {
+            : name(team_name), team_id(internTeamName(team_name)), is_defeated(false), 
+            n_monsters(monster_list.size()) {
 
             for (auto& mon : monster_list) {
-                mon->team = team_name; // set team name for each monster    
-                monsters.push_back(std::move(mon)); // move monster into the team's vector
+                mon->team_id = team_id; // set team name for each monster    
+                monsters.push_back(mon.get());
+                owned_monsters.push_back(std::move(mon)); // move monster into the team's vector
             }
+            set_first_active_monster();
+        }
 
-            // set the first monster as the active monster
-            if (!monsters.empty()) {
-                active_monster = monsters[0].get();
-            } else {
-                throw runtime_error(
-                    name + " Team has no monsters. Cannot set active_monster.");
+        // empty (defeated) team, to be filled with reset()
+        Team(): team_id(-1), is_defeated(true), n_monsters(0) {}
+
+        // reuse the team for a new battle with borrowed monsters (keeps the vectors' capacity)
+        void reset(const string& team_name, const vector<Monster*>& monster_list) {
+            owned_monsters.clear();
+            monsters.assign(monster_list.begin(), monster_list.end());
+            if (team_id < 0 || team_name != name) { // only intern when the name changes
+                name = team_name;
+                team_id = internTeamName(team_name);
             }
-            update_active_monster();
+            is_defeated = false;
+            n_monsters = monsters.size();
+            for (auto mon : monsters) {
+                mon->team_id = team_id;
+            }
+            set_first_active_monster();
         }
         
         // update the team, check if the team is defeated
-        void update_team() {
+        void update_team(EventSink& sink) {
             update_active_monster();
             if (is_defeated) {
-                cout << get_team_name(true) + " is defeated!\n";
+                BattleEvent event(defeat_event);
+                event.team1 = this;
+                sink.on_event(event);
             }
         };
         
         // get the team's name, optionally with color
-        string get_team_name(bool color = true) {
+        string get_team_name(bool color = true) const {
             string text = name + " Team";
             if (color) {
                 text = getColor(name) + text + getColor();
@@ -361,10 +907,12 @@ class Team {
         void update_active_monster() {
             // if the active monster is still alive, do nothing
             if (active_monster->is_alive) {return;}
-            // else, iterate through the monster list and get the first alive monster
-            for (auto& mon : monsters) {
-                if (mon->is_alive) {
-                    active_monster = mon.get();
+            // else, move on to the next alive monster; only the active monster ever takes damage,
+            // so every monster before it is dead and the scan never has to restart from the front
+            // (O(1) per death, even for teams of millions)
+            while (++active_idx < monsters.size()) {
+                if (monsters[active_idx]->is_alive) {
+                    active_monster = monsters[active_idx];
                     return;
                 }
             }
@@ -375,12 +923,68 @@ class Team {
         }
     private:
         Monster* active_monster = nullptr; // points to the first alive monster; make it private so it can only be updated by its own class
+        size_t active_idx = 0; // index of active_monster in monsters
+        vector<unique_ptr<Monster>> owned_monsters; // monsters the team owns (empty for borrowed monsters)
+
+        void set_first_active_monster() {
+            // set the first monster as the active monster
+            if (!monsters.empty()) {
+                active_idx = 0;
+                active_monster = monsters[0];
+            } else {
+                throw runtime_error(
+                    name + " Team has no monsters. Cannot set active_monster.");
+            }
+            update_active_monster();
+        }
 };
 
+MonsterRecord recordOf(const Monster& mon) {
+    return MonsterRecord{mon.type, mon.name_id, mon.team_id, mon.health};
+}
+
+template <class Emit>
+void eventRecords(const BattleEvent& event, Emit emit) {
+    // copy an event into records: one record per event, and on battle start
+    // one lineup record per monster of both teams after it
+    ActionLog record(event.type);
+    if (event.actor) {record.actor = recordOf(*event.actor);}
+    if (event.target) {record.target = recordOf(*event.target);}
+    if (event.team1) {
+        record.team1_id = event.team1->team_id;
+        record.team1_defeated = event.team1->is_defeated;
+        record.n_team1 = event.team1->n_monsters;
+    }
+    if (event.team2) {
+        record.team2_id = event.team2->team_id;
+        record.team2_defeated = event.team2->is_defeated;
+        record.n_team2 = event.team2->n_monsters;
+    }
+    record.turn_idx = event.turn_idx;
+    record.attempted_damage = event.attempted_damage;
+    record.actual_damage = event.actual_damage;
+    record.reflected_damage = event.reflected_damage;
+    record.regen_amount = event.regen_amount;
+    record.regen_capped = event.regen_capped;
+    record.outcome = event.outcome;
+    emit(record);
+    if (event.type == battle_start_event) {
+        for (const Team* team : {event.team1, event.team2}) {
+            for (auto mon : team->monsters) {
+                ActionLog member(lineup_event);
+                member.actor = recordOf(*mon);
+                emit(member);
+            }
+        }
+    }
+}
+
 // battle specific functions
-void turn(Monster& mon1, Monster& mon2) {
+template <class Rng>
+bool turn(Monster& mon1, Monster& mon2, EventSink& sink, Rng& rng) {
     // function for each turn, this will run continuously until battle ends
     // for each turn, decide the faster and slower monster (based on speed)
+    // returns true if mon1 attacked first
     Monster* faster;
     Monster* slower;
     if (mon1.speed > mon2.speed) {
@@ -392,8 +996,9 @@ void turn(Monster& mon1, Monster& mon2) {
     } else {
         // randomly decides who goes first if both have the same speed
         // cout << "Randomly deciding order\n";
+        PROFILE_COUNT(prof_coin_flips);
         uniform_int_distribution<int> dist(0, 1);
-        if (dist(gen) == 0) {
+        if (dist(rng) == 0) {
             faster = &mon1;
             slower = &mon2;
         } else {
@@ -405,199 +1010,5917 @@ void turn(Monster& mon1, Monster& mon2) {
     // then faster monster's turn end effect activate
     // if slower monster is still alive: slower monster attack
     // then slower monster's turn end effect activate
-    faster->attack(*slower);
-    faster->on_end_turn();
+    faster->attack(*slower, sink);
+    faster->on_end_turn(sink);
 
     // the slower one attack if & only if it is still alive after the faster's attack
     if (slower->is_alive){
-        slower->attack(*faster);
-        slower->on_end_turn();
+        slower->attack(*faster, sink);
+        slower->on_end_turn(sink);
     }
+    return faster == &mon1;
 };
 
-string getMemberText(Monster& mon1, bool opposite=false){
+string getMemberText(const Monster& mon1, bool opposite=false){
     // get the text to be outputted as a team member
     // [ <team> | <monster type> <monster name> (remaining health) ]
     // example: [ Red | Orc Kyrios (70) ] 
     // if opposite=true: [ Goblin Alex (40) | Blue ]
+    const string& team = teamNameOf(mon1.team_id);
     if (opposite) {
-        return getColor(mon1.team)+
+        return getColor(team)+
             "[ " + mon1.disp(false, false) + " (" + to_string(mon1.health) + 
-            ") | " + mon1.team + " ]" + getColor();
+            ") | " + team + " ]" + getColor();
     }
-    return  getColor(mon1.team) + 
-            "[ " + mon1.team + " | " + mon1.disp(false, false) + 
+    return  getColor(team) + 
+            "[ " + team + " | " + mon1.disp(false, false) + 
             " (" + to_string(mon1.health) + 
             ") ]" + getColor();
 };
 
-string getVSstatusText(Monster& mon1, Monster& mon2, string vs_text=" ... "){
+string getVSstatusText(const Monster& mon1, const Monster& mon2, string vs_text=" ... "){
     // get the line up text at the beginning of each turn and battle
     // first and second monster have the opposite order to "face each other"
     return  getMemberText(mon1, false) + vs_text + getMemberText(mon2, true) + "\n";
 };
 
-void battle(unique_ptr<Team> team1, unique_ptr<Team> team2) {
-    // function that performs the battle
+class SimpleTextSink: public EventSink {
+    // renders the events as the coloured console text of the game, straight from the
+    // Monster/Team helpers (reference for TextSink, which must produce the same bytes)
+    public:
+        SimpleTextSink(ostream& output = cout): out(output) {}
 
-    // takes two teams, end after monsters in one team are all dead
-    int turn_idx = 1;
+        void on_event(const BattleEvent& event) override {
+            PROFILE_PHASE(phase_formatting);
+            switch (event.type) {
+                case battle_start_event: print_lineup(*event.team1, *event.team2); break;
+                case turn_start_event:
+                    out << "\nTurn " << event.turn_idx << "\n";
+                    out << getVSstatusText(*event.actor, *event.target);
+                    break;
+                case attack_event: print_attack(event); break;
+                case regen_event:
+                    out << event.actor->disp(true, true) << " regenerates " << event.regen_amount <<
+                        " health to " << event.actor->health << (event.regen_capped ? " (max);\n" : ";\n");
+                    break;
+                case death_event: out << event.actor->disp(true, true) + " has died!\n"; break;
+                case defeat_event: out << event.team1->get_team_name(true) + " is defeated!\n"; break;
+                case battle_end_event: print_result(event); break;
+                default: break;
+            }
+        }
 
-    // output line-up text: monsters facing each other in a single file
-    // gets the member text from all the monsters first
-    // for team1 only, get the longest text, use it as reference for padding
-    // to ensure team2 can line up in a straight line
-    vector<string> team1_vs_texts;
-    vector<string> team2_vs_texts;
-    int max_team1_len = 0;
-    for (const auto& mon : team1->monsters) {
-        string text = getMemberText(*mon);
-        int plain_length = getPlainTextLength(text);
-        team1_vs_texts.push_back(getMemberText(*mon));
-        if (plain_length > max_team1_len) {
-            max_team1_len = plain_length;
-        }
-    }
-    for (const auto& mon : team2->monsters) {
-        team2_vs_texts.push_back(getMemberText(*mon));
-    }
-    // get the lowest n_monsters (n_less)
-    // for the first n_less monsters on each team, have them face to face
-    // didn't use getVSstatusText because I want the second team to also line
-    // up in a straight line
-    int n_less = min(team1_vs_texts.size(), team2_vs_texts.size());
-    for (int i = 0; i < n_less; i++) {
-        string text1 = getMemberText(*(team1->monsters[i]));
-        cout << text1 + string(max_team1_len-getPlainTextLength(text1), ' ') + 
-            "   " + getMemberText(*(team2->monsters[i]), true) + "\n";
-    }
-    // for the rest of the monsters, output to corresponsing locations
-    if (team1->n_monsters > n_less) {
-        for (int i = n_less; i < team1->n_monsters; i++) {
-            cout << getMemberText(*(team1->monsters[i])) + "\n";
-        }
-    } else if (team2->n_monsters > n_less) {
-        for (int i = n_less; i < team2->n_monsters; i++) {
-            cout << string(max_team1_len+3, ' ') + // +3: corresponding to the length of text in the middle
-                getMemberText(*(team2->monsters[i]), true) + "\n";
-        }
-    }
-    
-    // actual combat
-    // while both teams are still standing, combat
-    while ((!team1->is_defeated) && (!team2->is_defeated)) {
-        cout << "\nTurn " << turn_idx << "\n";
-        cout << getVSstatusText(team1->get_active_monster(), team2->get_active_monster());
-        turn(team1->get_active_monster(), team2->get_active_monster());
-        team1->update_team();
-        team2->update_team();
-        turn_idx++;
-        if (turn_idx>100){break;}
+    private:
+        ostream& out;
+
+        void print_attack(const BattleEvent& event) {
+            string action_text = event.actor->attack_text(*event.target) + 
+                " for " + to_string(event.attempted_damage) + 
+                " damage; dealing " + to_string(event.actual_damage) + " damage; ";
+            if (event.reflected_damage != -1) {
+                action_text = action_text + "receiving " + to_string(event.reflected_damage) + " reflected damage;";
+            } 
+            out << action_text + "\n";
+        }
+
+        void print_lineup(const Team& team1, const Team& team2) {
+            // output line-up text: monsters facing each other in a single file
+            // first pass: for team1 only, get the longest text, use it as reference for padding
+            // to ensure team2 can line up in a straight line
+            // second pass: write the lines one by one (nothing is kept in memory, so this
+            // also works for huge teams)
+            int max_team1_len = 0;
+            for (const auto& mon : team1.monsters) {
+                int plain_length = getPlainTextLength(getMemberText(*mon));
+                if (plain_length > max_team1_len) {
+                    max_team1_len = plain_length;
+                }
+            }
+            // get the lowest n_monsters (n_less)
+            // for the first n_less monsters on each team, have them face to face
+            // didn't use getVSstatusText because I want the second team to also line
+            // up in a straight line
+            int n_less = min(team1.n_monsters, team2.n_monsters);
+            for (int i = 0; i < n_less; i++) {
+                string text1 = getMemberText(*(team1.monsters[i]));
+                out << text1 + string(max_team1_len-getPlainTextLength(text1), ' ') + 
+                    "   " + getMemberText(*(team2.monsters[i]), true) + "\n";
+            }
+            // for the rest of the monsters, output to corresponsing locations
+            if (team1.n_monsters > n_less) {
+                for (int i = n_less; i < team1.n_monsters; i++) {
+                    out << getMemberText(*(team1.monsters[i])) + "\n";
+                }
+            } else if (team2.n_monsters > n_less) {
+                for (int i = n_less; i < team2.n_monsters; i++) {
+                    out << string(max_team1_len+3, ' ') + // +3: corresponding to the length of text in the middle
+                        getMemberText(*(team2.monsters[i]), true) + "\n";
+                }
+            }
+        }
+
+        void print_result(const BattleEvent& event) {
+            // battle ended; if both team are defeated, tie; if team1 is defeated, team2 wins, vice versa
+            const Team& team1 = *event.team1;
+            const Team& team2 = *event.team2;
+            out << "\nBattle Over! ";
+            if (team1.is_defeated && team2.is_defeated) {
+                out << "Tied!\n";
+            } else if (team1.is_defeated){
+                out << team2.get_team_name(true) << " wins!\n";
+            } else if (team2.is_defeated){
+                out << team1.get_team_name(true) << " wins!\n";
+            } else if (event.outcome == stalemate) {
+                out << "Stalemate after " << event.turn_idx << " turns, neither team can win!\n";
+            } else {
+                out << "Stopped by the turn limit after " << event.turn_idx << " turns!\n";
+            }
+
+            out << "\n-----------------------------------------------------------------------------------------------------------------------\n";
+        }
+};
+
+uint32_t lineupCode(const vector<MonsterType>& lineup) {
+    // compact code of a lineup (base 4 digits, 0 marks the end), up to 15 monsters
+    uint32_t code = 0;
+    for (auto type : lineup) {
+        code = code * 4 + (static_cast<uint32_t>(type) + 1);
+    }
+    return code;
+}
+
+uint32_t lineupCode(const Team& team) {
+    // same, from the monsters of a team (0 if it has more than 15)
+    if (team.n_monsters > 15) {return 0;}
+    uint32_t code = 0;
+    for (auto mon : team.monsters) {
+        code = code * 4 + (static_cast<uint32_t>(mon->type) + 1);
     }
+    return code;
+}
 
-    // battle ended; if both team are defeated, tie; if team1 is defeated, team2 wins, vice versa
-    cout << "\nBattle Over! ";
-    if (team1->is_defeated && team2->is_defeated) {
-        cout << "Tied!\n";
-    } else if (team1->is_defeated){
-        cout << team2->get_team_name(true) << " wins!\n";
-    } else if (team2->is_defeated){
-        cout << team1->get_team_name(true) << " wins!\n";
+string lineupCodeToString(uint32_t code) {
+    // e.g. "Goblin Troll Troll"
+    string text = "";
+    while (code > 0) {
+        string name = monsterTypeToString(static_cast<MonsterType>(code % 4 - 1));
+        text = text.empty() ? name : name + " " + text;
+        code /= 4;
     }
+    return text;
+}
+
+struct BattleResult {
+    // summary of a finished battle (the fields after turns are only filled in by battle())
+    BattleOutcome outcome;
+    int turns; // number of turns played
+    int survivors1 = 0; // monsters left alive in each team
+    int survivors2 = 0;
+    int health1 = 0; // health left in each team
+    int health2 = 0;
+    uint64_t lineup_key = 0; // lineupCode(team1) << 32 | lineupCode(team2)
+};
+
+int fastForward(Monster& mon1, Monster& mon2, int max_turns); // after skippableTurns
+
+class BattleSteps {
+    // a battle as a resumable state machine: the constructor reports the start of the battle,
+    // every step() plays one turn, and the step that ends the battle reports its end and returns false,
+    // so many battles can be played interleaved (see BattleHost); battle() runs the steps in one go.
+    // if the sink takes summaries, a step may instead play a deterministic stretch of turns (see fastForward)
+    public:
+        BattleSteps(Team& first, Team& second, EventSink& event_sink, int turn_limit = MAX_TURNS): 
+            team1(&first), team2(&second), sink(&event_sink), max_turns(turn_limit), 
+            skip_ahead(event_sink.takes_summaries()) {
+            BattleEvent start_event(battle_start_event);
+            start_event.team1 = team1;
+            start_event.team2 = team2;
+            sink->on_event(start_event);
+        }
+
+        template <class Rng>
+        bool step(Rng& rng) {
+            if (is_over) {return false;}
+            PROFILE_PHASE(phase_simulation);
+            // while both teams are still standing, combat
+            if (!team1->is_defeated && !team2->is_defeated) {
+                Monster& mon1 = team1->get_active_monster();
+                Monster& mon2 = team2->get_active_monster();
+                if (skip_ahead && !skipped && mon1.speed != mon2.speed) {
+                    int n_skipped = fastForward(mon1, mon2, 
+                        max_turns > 0 ? max_turns - turn_idx + 1 : numeric_limits<int>::max());
+                    if (n_skipped > 0) {
+                        BattleEvent summary(skip_event);
+                        summary.turn_idx = turn_idx;
+                        summary.actor = &mon1;
+                        summary.target = &mon2;
+                        summary.skipped_turns = n_skipped;
+                        sink->on_event(summary);
+                        PROFILE_ADD(prof_turns, n_skipped);
+                        turn_idx += n_skipped;
+                        stalled_orders = 0;
+                        skipped = true;
+                        if (max_turns <= 0 || turn_idx <= max_turns) {return true;}
+                        finish();
+                        return false;
+                    }
+                }
+                skipped = false;
+                PROFILE_COUNT(prof_turns);
+                BattleEvent turn_event(turn_start_event);
+                turn_event.turn_idx = turn_idx;
+                turn_event.actor = &mon1;
+                turn_event.target = &mon2;
+                sink->on_event(turn_event);
+                int health1 = mon1.health;
+                int health2 = mon2.health;
+                rngAtTurn(rng, turn_idx);
+                bool team1_first = turn(mon1, mon2, *sink, rng);
+                team1->update_team(*sink);
+                team2->update_team(*sink);
+                turn_idx++;
+                if (mon1.is_alive && mon2.is_alive && mon1.health == health1 && mon2.health == health2) {
+                    // the turn changed nothing, so the same turn would repeat forever
+                    // (on a speed tie, only once the other order has changed nothing either)
+                    stalled_orders |= team1_first ? 1 : 2;
+                    is_stalemate = mon1.speed != mon2.speed || stalled_orders == 3;
+                } else {
+                    stalled_orders = 0;
+                }
+                if (!is_stalemate && (max_turns <= 0 || turn_idx <= max_turns) && 
+                    !team1->is_defeated && !team2->is_defeated) {
+                    return true;
+                }
+            }
+            finish();
+            return false;
+        }
+
+        bool over() const {return is_over;}
+        int turns_played() const {return turn_idx - 1;}
+        const BattleResult& result() const {return final_result;} // once over
+
+    private:
+        Team* team1;
+        Team* team2;
+        EventSink* sink;
+        int max_turns; // stop after max_turns turns (never if <= 0)
+        bool skip_ahead;
+        bool skipped = false; // the turn after a skip is lethal or capped, so it is played normally
+        int turn_idx = 1;
+        bool is_stalemate = false;
+        int stalled_orders = 0; // turn orders (bit 0: team1 first, bit 1: team2 first) that changed nothing
+        bool is_over = false;
+        BattleResult final_result;
+
+        void finish() {
+            PROFILE_COUNT(prof_battles);
+            BattleResult& result = final_result;
+            result.turns = turn_idx - 1;
+            if (team1->is_defeated && team2->is_defeated) {
+                result.outcome = tied;
+            } else if (team1->is_defeated) {
+                result.outcome = team2_wins;
+            } else if (team2->is_defeated) {
+                result.outcome = team1_wins;
+            } else if (is_stalemate) {
+                result.outcome = stalemate;
+            } else {
+                result.outcome = unfinished; // stopped by the turn limit
+            }
+            for (auto mon : team1->monsters) {
+                if (mon->is_alive) {
+                    result.survivors1++;
+                    result.health1 += mon->health;
+                }
+            }
+            for (auto mon : team2->monsters) {
+                if (mon->is_alive) {
+                    result.survivors2++;
+                    result.health2 += mon->health;
+                }
+            }
+            result.lineup_key = (static_cast<uint64_t>(lineupCode(*team1)) << 32) | lineupCode(*team2);
+
+            BattleEvent end_event(battle_end_event);
+            end_event.turn_idx = result.turns;
+            end_event.team1 = team1;
+            end_event.team2 = team2;
+            end_event.outcome = result.outcome;
+            sink->on_event(end_event);
+            is_over = true;
+        }
+};
 
-    cout << "\n-----------------------------------------------------------------------------------------------------------------------\n";
+template <class Rng>
+BattleResult battle(Team& team1, Team& team2, EventSink& sink, Rng& rng, int max_turns = MAX_TURNS) {
+    // function that performs the battle
+    // takes two teams, end after monsters in one team are all dead
+    // every action is reported to the sink (use a NullSink to run headless)
+    // rng is only used to break speed ties (a CounterRng is moved to the turn's stream first)
+    // stops after max_turns turns (never if max_turns <= 0), or as soon as the battle is a stalemate
+    BattleSteps steps(team1, team2, sink, max_turns);
+    while (steps.step(rng)) {}
+    return steps.result();
+};
 
+template <class Rng>
+BattleResult battle(unique_ptr<Team> team1, unique_ptr<Team> team2, EventSink& sink, Rng& rng) {
+    // same, for teams that are thrown away after the battle
+    return battle(*team1, *team2, sink, rng);
 };
 
-unique_ptr<Monster> getMonster(MonsterType type, vector<string>& namepool) {
+unique_ptr<Monster> getMonster(MonsterType type, NamePool& namepool) {
     // get a monster based on type
     switch (type) {
-        case goblin: return make_unique<Goblin>(popName(namepool));
-        case troll: return make_unique<Troll>(popName(namepool));
-        case orc: return make_unique<Orc>(popName(namepool));
-        default: return make_unique<Monster>(popName(namepool)); // should not happen
+        case goblin: return make_unique<Goblin>(namepool.pop());
+        case troll: return make_unique<Troll>(namepool.pop());
+        case orc: return make_unique<Orc>(namepool.pop());
+        default: return make_unique<Monster>(namepool.pop()); // should not happen
     }
 };
 
-vector<MonsterType> monsterPicker(int n) {
+const Monster& monsterPrototype(MonsterType type) {
+    // a nameless monster of each type, used to read the stats of a type without building one
+    static const Goblin proto_goblin(0);
+    static const Troll proto_troll(0);
+    static const Orc proto_orc(0);
+    switch (type) {
+        case goblin: return proto_goblin;
+        case troll: return proto_troll;
+        default: return proto_orc;
+    }
+}
+
+vector<MonsterType> parseLineup(const string& text) {
+    // lineup from letters, one per monster: G(oblin), T(roll), O(rc), e.g. "GTO"
+    vector<MonsterType> lineup;
+    for (char c : text) {
+        switch (tolower(c)) {
+            case 'g': lineup.push_back(goblin); break;
+            case 't': lineup.push_back(troll); break;
+            case 'o': lineup.push_back(orc); break;
+            default: throw invalid_argument("Unknown monster letter '" + string(1, c) + "' in lineup " + text);
+        }
+    }
+    return lineup;
+}
+
+string lineupLetters(const vector<MonsterType>& lineup) {
+    // inverse of parseLineup
+    string text;
+    for (MonsterType type : lineup) {text += type == goblin ? 'G' : type == troll ? 'T' : 'O';}
+    return text;
+}
+
+template <class Rng>
+vector<MonsterType> monsterPicker(int n, Rng& rng) {
     // pick n monsters randomly, and return the selected MonsterTypes 
     vector<MonsterType> selected;
-    uniform_int_distribution<> dis(0, 2);
+    uniform_int_distribution<> dis(0, N_MONSTER_TYPES - 1);
     for (int i = 0; i < n; i++) {
-        MonsterType type = static_cast<MonsterType>(dis(gen));
+        MonsterType type = static_cast<MonsterType>(dis(rng));
         selected.emplace_back(type);
     }
     return selected;
 }
 
-void makeBattle(
+class BattleArena {
+    // reusable storage for the monsters and teams of one battle at a time:
+    // monsters come from per-type pools that are rewound before every battle and only grow
+    // when a battle needs more monsters of a type than any battle before, so repeated
+    // battles do not touch the heap
+    public:
+        template <class Rng>
+        BattleResult make_battle(
+            const pair<string, vector<MonsterType>>& lineup1, 
+            const pair<string, vector<MonsterType>>& lineup2, 
+            NamePool& namepool,
+            EventSink& sink,
+            Rng& rng,
+            int max_turns = MAX_TURNS) {
+            n_goblins = n_trolls = n_orcs = 0;
+            fill_team(team1, lineup1, namepool);
+            fill_team(team2, lineup2, namepool);
+            return battle(team1, team2, sink, rng, max_turns);
+        }
+
+    private:
+        deque<Goblin> goblins; // deque: growing it never moves the monsters already handed out
+        deque<Troll> trolls;
+        deque<Orc> orcs;
+        size_t n_goblins = 0; // monsters of each pool in use by the current battle
+        size_t n_trolls = 0;
+        size_t n_orcs = 0;
+        vector<Monster*> members;
+        Team team1;
+        Team team2;
+
+        template <class T>
+        static Monster* acquire(deque<T>& pool, size_t& n_used) {
+            if (n_used == pool.size()) {pool.emplace_back(0);}
+            return &pool[n_used++];
+        }
+
+        void fill_team(Team& team, const pair<string, vector<MonsterType>>& lineup, NamePool& namepool) {
+            members.clear();
+            for (auto type : lineup.second) {
+                Monster* mon;
+                switch (type) {
+                    case goblin: mon = acquire(goblins, n_goblins); break;
+                    case troll: mon = acquire(trolls, n_trolls); break;
+                    default: mon = acquire(orcs, n_orcs); break;
+                }
+                mon->respawn(namepool.pop());
+                members.push_back(mon);
+            }
+            team.reset(lineup.first, members);
+        }
+};
+
+template <class Rng>
+BattleResult makeBattle(
     // readable wrapper for combat, takes two "lineup" of monster,
     // use it as instruction to build teams
     // then send it to battle()
+    // the monsters are reused between calls (one arena per thread), so the teams only live
+    // until the next makeBattle() on the same thread
     const pair<string, vector<MonsterType>>& lineup1, 
     const pair<string, vector<MonsterType>>& lineup2, 
-    vector<string>& namepool) {
-    vector<unique_ptr<Monster>> team1_monsters;
-    for (auto& type : lineup1.second) {
-        team1_monsters.emplace_back(getMonster(type, namepool));
-    }
+    NamePool& namepool,
+    EventSink& sink,
+    Rng& rng,
+    int max_turns = MAX_TURNS) {
+    thread_local BattleArena arena;
+    return arena.make_battle(lineup1, lineup2, namepool, sink, rng, max_turns);
+};
 
-    vector<unique_ptr<Monster>> team2_monsters;
-    for (auto& type : lineup2.second) {
-        team2_monsters.emplace_back(getMonster(type, namepool));
-    }
+class TextRenderer {
+    // formats battle records as the coloured console text of the game (same bytes as SimpleTextSink)
+    // and writes it to the stream in large blocks
+    // the strings that depend only on a monster are built once and kept in a small cache,
+    // and numbers are formatted straight into the buffer
+    public:
+        TextRenderer(ostream& output, size_t flush_size): out(output), block_size(flush_size), slots(N_SLOTS) {
+            buffer.reserve(block_size + 4096);
+        }
+
+        void append(const string& text) {buffer += text;}
+        void append(const char* text, size_t length) {buffer.append(text, length);}
+
+        void render(const ActionLog& record) {
+            switch (record.type) {
+                case battle_start_event: start_battle(record); break;
+                case lineup_event: 
+                    lineup.push_back(record.actor);
+                    if (static_cast<int>(lineup.size()) == n_team1 + n_team2) {print_lineup();}
+                    break;
+                case turn_start_event:
+                    buffer += "\nTurn ";
+                    append_int(record.turn_idx);
+                    buffer += '\n';
+                    append_member(record.actor, false);
+                    buffer += " ... ";
+                    append_member(record.target, true);
+                    buffer += '\n';
+                    break;
+                case attack_event: 
+                    buffer += slot(record.actor).display;
+                    buffer += " attacks ";
+                    buffer += slot(record.target).display;
+                    buffer += " for ";
+                    append_int(record.attempted_damage);
+                    buffer += " damage; dealing ";
+                    append_int(record.actual_damage);
+                    buffer += " damage; ";
+                    if (record.reflected_damage != -1) {
+                        buffer += "receiving ";
+                        append_int(record.reflected_damage);
+                        buffer += " reflected damage;";
+                    }
+                    buffer += '\n';
+                    break;
+                case regen_event:
+                    buffer += slot(record.actor).display;
+                    buffer += " regenerates ";
+                    append_int(record.regen_amount);
+                    buffer += " health to ";
+                    append_int(record.actor.health);
+                    buffer += record.regen_capped ? " (max);\n" : ";\n";
+                    break;
+                case death_event: 
+                    buffer += slot(record.actor).display;
+                    buffer += " has died!\n";
+                    break;
+                case defeat_event: 
+                    buffer += team_texts[record.team1_id == team1_id ? 0 : 1];
+                    buffer += " is defeated!\n";
+                    break;
+                case battle_end_event: print_result(record); break;
+                case text_event: break; // carries no text itself, see AsyncTextSink
+                case skip_event: break; // text sinks do not take summaries
+            }
+        }
+
+        // write the buffer once it holds a full block
+        void write_if_full() {
+            if (buffer.size() >= block_size) {write();}
+        }
+
+        // write everything buffered so far
+        void write() {
+            PROFILE_PHASE(phase_output);
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+
+    private:
+        struct MonsterText {
+            uint64_t key = ~0ull; // monster the strings belong to
+            string display; // coloured "<team> <type> <name>"
+            string head; // coloured "[ <team> | <type> <name> (" 
+            string tail; // ") ]" + colour reset
+            string opposite_head; // coloured "[ <type> <name> ("
+            string opposite_tail; // ") | <team> ]" + colour reset
+            int plain_length; // length of the member text without colours and health digits
+        };
+
+        // direct-mapped cache of monster strings: a battle only ever shows the two leads
+        // after the lineup, so a few slots are enough no matter how large the teams are
+        static constexpr size_t N_SLOTS = 64;
+
+        ostream& out;
+        size_t block_size;
+        string buffer;
+        vector<MonsterText> slots;
+        string team_texts[2]; // coloured "<team> Team" of both teams
+        int team1_id = -1;
+        int n_team1 = 0;
+        int n_team2 = 0;
+        vector<MonsterRecord> lineup; // lineup records of the current battle (16 bytes per monster)
+
+        static uint64_t key(const MonsterRecord& mon) {
+            // the text of a monster only depends on its team, type and name
+            return (static_cast<uint64_t>(static_cast<uint32_t>(mon.team_id)) << 34) | 
+                (static_cast<uint64_t>(static_cast<uint32_t>(mon.name_id)) << 2) | mon.type;
+        }
+
+        void append_int(int value) {
+            char digits[12];
+            int n = 0;
+            unsigned int v = value < 0 ? 0u - static_cast<unsigned int>(value) : value;
+            do {
+                digits[n++] = '0' + v % 10;
+                v /= 10;
+            } while (v > 0);
+            if (value < 0) {buffer += '-';}
+            while (n > 0) {buffer += digits[--n];}
+        }
+
+        static int n_digits(int value) {
+            int n = value < 0 ? 2 : 1;
+            for (int v = value < 0 ? -value : value; v >= 10; v /= 10) {n++;}
+            return n;
+        }
+
+        const MonsterText& slot(const MonsterRecord& mon) {
+            // strings of a monster, built on a cache miss
+            uint64_t k = key(mon);
+            MonsterText& text = slots[(k ^ (k >> 29)) % N_SLOTS];
+            if (text.key == k) {return text;}
+            const string& team_name = teamNameOf(mon.team_id);
+            string color = getColor(team_name);
+            string reset = getColor();
+            string type_and_name = monsterTypeToString(mon.type) + " " + monsterName(mon.name_id);
+            text.key = k;
+            text.display = color + team_name + " " + type_and_name + reset;
+            text.head = color + "[ " + team_name + " | " + type_and_name + " (";
+            text.tail = ") ]" + reset;
+            text.opposite_head = color + "[ " + type_and_name + " (";
+            text.opposite_tail = ") | " + team_name + " ]" + reset;
+            text.plain_length = 2 + team_name.size() + 3 + type_and_name.size() + 2 + 3;
+            return text;
+        }
+
+        void start_battle(const ActionLog& record) {
+            lineup.clear();
+            team1_id = record.team1_id;
+            n_team1 = record.n_team1;
+            n_team2 = record.n_team2;
+            team_texts[0] = getColor(teamNameOf(record.team1_id)) + teamNameOf(record.team1_id) + " Team" + getColor();
+            team_texts[1] = getColor(teamNameOf(record.team2_id)) + teamNameOf(record.team2_id) + " Team" + getColor();
+        }
+
+        void append_member(const MonsterRecord& mon, bool opposite) {
+            // same text as getMemberText()
+            const MonsterText& text = slot(mon);
+            buffer += opposite ? text.opposite_head : text.head;
+            append_int(mon.health);
+            buffer += opposite ? text.opposite_tail : text.tail;
+        }
+
+        int member_length(const MonsterRecord& mon) {
+            // same as getPlainTextLength(getMemberText(mon))
+            return slot(mon).plain_length + n_digits(mon.health);
+        }
+
+        void print_lineup() {
+            // same layout as SimpleTextSink: team1 padded to its longest entry, team2 facing it
+            // (written out block by block, so huge lineups never sit in the buffer as a whole)
+            const MonsterRecord* team1 = lineup.data();
+            const MonsterRecord* team2 = lineup.data() + n_team1;
+            int max_team1_len = 0;
+            for (int i = 0; i < n_team1; i++) {
+                max_team1_len = max(max_team1_len, member_length(team1[i]));
+            }
+            int n_less = min(n_team1, n_team2);
+            for (int i = 0; i < n_less; i++) {
+                append_member(team1[i], false);
+                buffer.append(max_team1_len - member_length(team1[i]) + 3, ' ');
+                append_member(team2[i], true);
+                buffer += '\n';
+                write_if_full();
+            }
+            for (int i = n_less; i < n_team1; i++) {
+                append_member(team1[i], false);
+                buffer += '\n';
+                write_if_full();
+            }
+            for (int i = n_less; i < n_team2; i++) {
+                buffer.append(max_team1_len + 3, ' ');
+                append_member(team2[i], true);
+                buffer += '\n';
+                write_if_full();
+            }
+        }
+
+        void print_result(const ActionLog& record) {
+            buffer += "\nBattle Over! ";
+            if (record.team1_defeated && record.team2_defeated) {
+                buffer += "Tied!\n";
+            } else if (record.team1_defeated){
+                buffer += team_texts[1];
+                buffer += " wins!\n";
+            } else if (record.team2_defeated){
+                buffer += team_texts[0];
+                buffer += " wins!\n";
+            } else if (record.outcome == stalemate) {
+                buffer += "Stalemate after ";
+                append_int(record.turn_idx);
+                buffer += " turns, neither team can win!\n";
+            } else {
+                buffer += "Stopped by the turn limit after ";
+                append_int(record.turn_idx);
+                buffer += " turns!\n";
+            }
+            buffer += "\n-----------------------------------------------------------------------------------------------------------------------\n";
+        }
+};
+
+class TextSink: public EventSink {
+    // renders the events on the simulation thread (use print() for text between battles to keep the order)
+    public:
+        TextSink(ostream& output = cout, size_t flush_size = 1 << 16): 
+            out(output), renderer(output, flush_size) {}
+
+        ~TextSink() {flush();}
+
+        void print(const string& text) {
+            PROFILE_PHASE(phase_formatting);
+            renderer.append(text);
+            renderer.write_if_full();
+        }
+
+        // write everything buffered so far
+        void flush() {
+            renderer.write();
+            PROFILE_PHASE(phase_output);
+            out.flush();
+        }
+
+        void on_event(const BattleEvent& event) override {
+            PROFILE_PHASE(phase_formatting);
+            eventRecords(event, [this](const ActionLog& record) {renderer.render(record);});
+            renderer.write_if_full();
+        }
+
+    private:
+        ostream& out;
+        TextRenderer renderer;
+};
+
+template <class T>
+class SpscRing {
+    // lock-free ring buffer for exactly one producer thread and one consumer thread
+    // (capacity is rounded up to a power of two)
+    public:
+        explicit SpscRing(size_t min_capacity) {
+            size_t capacity = 1;
+            while (capacity < min_capacity) {capacity *= 2;}
+            slots.resize(capacity);
+            mask = capacity - 1;
+        }
+
+        // producer side; false if the ring is full
+        bool try_push(const T& item) {
+            size_t t = tail.load(memory_order_relaxed);
+            if (t - head_seen > mask) {
+                head_seen = head.load(memory_order_acquire);
+                if (t - head_seen > mask) {return false;}
+            }
+            slots[t & mask] = item;
+            tail.store(t + 1, memory_order_release);
+            return true;
+        }
+
+        // consumer side; false if the ring is empty
+        bool try_pop(T& item) {
+            size_t h = head.load(memory_order_relaxed);
+            if (h == tail_seen) {
+                tail_seen = tail.load(memory_order_acquire);
+                if (h == tail_seen) {return false;}
+            }
+            item = slots[h & mask];
+            head.store(h + 1, memory_order_release);
+            return true;
+        }
+
+        // producer side, all n items or none; false if fewer than n slots are free
+        bool try_push(const T* items, size_t n) {
+            size_t t = tail.load(memory_order_relaxed);
+            if (t + n - head_seen > mask + 1) {
+                head_seen = head.load(memory_order_acquire);
+                if (t + n - head_seen > mask + 1) {return false;}
+            }
+            for (size_t i = 0; i < n; i++) {slots[(t + i) & mask] = items[i];}
+            tail.store(t + n, memory_order_release);
+            return true;
+        }
+
+        // consumer side, all n items or none; false if fewer than n items are in the ring
+        bool try_pop(T* items, size_t n) {
+            size_t h = head.load(memory_order_relaxed);
+            if (tail_seen - h < n) {
+                tail_seen = tail.load(memory_order_acquire);
+                if (tail_seen - h < n) {return false;}
+            }
+            for (size_t i = 0; i < n; i++) {items[i] = slots[(h + i) & mask];}
+            head.store(h + n, memory_order_release);
+            return true;
+        }
+
+        // items in the ring; exact for neither side while the other one is running
+        // (a lower bound for the consumer, an upper bound for the producer)
+        size_t size() const {return tail.load(memory_order_acquire) - head.load(memory_order_acquire);}
+        size_t capacity() const {return mask + 1;}
+
+    private:
+        vector<T> slots;
+        size_t mask;
+        // the two indices live on separate cache lines, next to the copy of the
+        // other side's index that each thread keeps to avoid reading it on every call
+        char pad0[64];
+        atomic<size_t> tail{0}; // written by the producer
+        size_t head_seen = 0;
+        char pad1[64];
+        atomic<size_t> head{0}; // written by the consumer
+        size_t tail_seen = 0;
+        char pad2[64];
+};
+
+class AsyncTextSink: public EventSink {
+    // same text as TextSink, but rendered on a separate formatter thread: the simulation only
+    // copies fixed-size records into a ring buffer and keeps going; if the formatter falls
+    // behind and the ring fills up, the simulation waits (back-pressure, nothing is dropped)
+    // the bytes of print() go through a second ring, followed by a text record with their length;
+    // a side that finds its ring empty (formatter) or full (simulation) polls a few times and
+    // then sleeps until the other side has pushed or popped something
+    public:
+        AsyncTextSink(ostream& output = cout, size_t ring_size = 1 << 14, size_t flush_size = 1 << 16): 
+            out(output), block_size(flush_size), ring(ring_size), text_ring(1 << 16), done(false), 
+            formatter_waiting(false), simulation_waiting(false), n_full_waits(0) {
+            formatter = thread(&AsyncTextSink::run, this);
+        }
+
+        ~AsyncTextSink() {finish();}
+
+        void print(const string& text) {
+            // in pieces of at most the text ring's size, each followed by its record
+            for (size_t pos = 0; pos < text.size(); ) {
+                size_t n = min(text.size() - pos, text_ring.capacity());
+                if (!text_ring.try_push(text.data() + pos, n)) {
+                    n_full_waits++;
+                    wait_until(simulation_waiting, not_full, [&]() {return text_ring.capacity() - text_ring.size() >= n;});
+                    text_ring.try_push(text.data() + pos, n);
+                }
+                ActionLog record(text_event);
+                record.turn_idx = n;
+                push(record);
+                pos += n;
+            }
+        }
+
+        void on_event(const BattleEvent& event) override {
+            eventRecords(event, [this](const ActionLog& record) {push(record);});
+        }
+
+        // wait until everything is rendered and written; the sink takes no events afterwards
+        void finish() {
+            if (!formatter.joinable()) {return;}
+            done.store(true, memory_order_release);
+            wake(formatter_waiting, not_empty);
+            formatter.join();
+        }
+
+        // number of times the simulation found a ring full
+        long long full_waits() const {return n_full_waits;}
+
+    private:
+        static constexpr int SPIN_TRIES = 64;
+
+        ostream& out;
+        size_t block_size;
+        SpscRing<ActionLog> ring;
+        SpscRing<char> text_ring;
+        atomic<bool> done;
+        atomic<bool> formatter_waiting; // asleep on not_empty
+        atomic<bool> simulation_waiting; // asleep on not_full
+        mutex wait_mutex;
+        condition_variable not_empty;
+        condition_variable not_full;
+        long long n_full_waits;
+        thread formatter;
+
+        void push(const ActionLog& record) {
+            if (!ring.try_push(record)) {
+                n_full_waits++;
+                wait_until(simulation_waiting, not_full, [this]() {return ring.size() <= ring.capacity() / 2;});
+                ring.try_push(record);
+            }
+            wake(formatter_waiting, not_empty);
+        }
+
+        template <typename Ready>
+        void wait_until(atomic<bool>& waiting, condition_variable& cv, Ready ready) {
+            // poll briefly, then sleep; the flag is raised before the last check and the other side
+            // looks at it after every push or pop (both behind a full fence), so a wake-up is never lost
+            for (int i = 0; i < SPIN_TRIES; i++) {
+                if (ready()) {return;}
+            }
+            unique_lock<mutex> lock(wait_mutex);
+            waiting.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            cv.wait(lock, ready);
+            waiting.store(false, memory_order_relaxed);
+        }
+
+        void wake(atomic<bool>& waiting, condition_variable& cv) {
+            atomic_thread_fence(memory_order_seq_cst);
+            if (waiting.load(memory_order_relaxed)) {
+                lock_guard<mutex> lock(wait_mutex);
+                cv.notify_one();
+            }
+        }
+
+        void run() {
+            // formatter thread: drain the ring until finish() is called and nothing is left
+            TextRenderer renderer(out, block_size);
+            vector<char> text(text_ring.capacity());
+            ActionLog record;
+            while (true) {
+                bool finishing = done.load(memory_order_acquire);
+                bool idle = true;
+                PROFILE_PHASE(phase_formatting);
+                while (ring.try_pop(record)) {
+                    idle = false;
+                    if (record.type == text_event) {
+                        // the bytes were pushed before the record, so they are all there
+                        text_ring.try_pop(text.data(), record.turn_idx);
+                        renderer.append(text.data(), record.turn_idx);
+                    } else {
+                        renderer.render(record);
+                    }
+                    if (record.type == text_event || ring.size() <= ring.capacity() / 2) {
+                        wake(simulation_waiting, not_full);
+                    }
+                    renderer.write_if_full();
+                }
+                if (idle) {
+                    if (finishing) {break;}
+                    wait_until(formatter_waiting, not_empty, [this]() {
+                        return ring.size() != 0 || done.load(memory_order_acquire);
+                    });
+                }
+            }
+            renderer.write();
+            out.flush();
+        }
+};
+
+// columnar results store
+// battle results are appended to a binary file in row groups; inside a group every field is a
+// contiguous column, so a query only reads the columns it needs. The reader memory-maps the file
+// and reads the columns in place, so files much larger than RAM can be scanned.
+// layout (native byte order): "MAR1" and 4 zero bytes, then groups of
+//   uint32 n_rows, uint32 0, uint64 battle[n], uint64 lineup_key[n], int32 turns[n],
+//   int32 survivors1[n], int32 survivors2[n], int32 health1[n], int32 health2[n], uint8 outcome[n],
+//   zero padding to a multiple of 8 bytes (so every column of the next group stays aligned)
+
+const char RESULT_STORE_MAGIC[4] = {'M', 'A', 'R', '1'};
+
+size_t resultGroupSize(uint32_t n_rows) {
+    size_t size = 8 + static_cast<size_t>(n_rows) * (8 + 8 + 5 * 4 + 1);
+    return (size + 7) / 8 * 8;
+}
+
+class ResultWriter {
+    // appends results to a store file (created if it does not exist), one group at a time
+    public:
+        static constexpr uint32_t GROUP_ROWS = 1 << 16;
+
+        explicit ResultWriter(const string& path): file(path, ios::binary | ios::app), n_flushed(0) {
+            if (!file) {throw runtime_error("Cannot open " + path + " for writing.");}
+            file.seekp(0, ios::end);
+            if (file.tellp() == 0) {
+                const char zeros[4] = {0, 0, 0, 0};
+                file.write(RESULT_STORE_MAGIC, 4);
+                file.write(zeros, 4);
+            }
+        }
+
+        ~ResultWriter() {flush();}
+
+        void add(const BattleResult& result, uint64_t battle_idx) {
+            battle.push_back(battle_idx);
+            lineup_key.push_back(result.lineup_key);
+            turns.push_back(result.turns);
+            survivors1.push_back(result.survivors1);
+            survivors2.push_back(result.survivors2);
+            health1.push_back(result.health1);
+            health2.push_back(result.health2);
+            outcome.push_back(static_cast<uint8_t>(result.outcome));
+            if (battle.size() == GROUP_ROWS) {flush();}
+        }
+
+        // write the rows added so far as a group
+        void flush() {
+            if (battle.empty()) {return;}
+            PROFILE_PHASE(phase_output);
+            uint32_t header[2] = {static_cast<uint32_t>(battle.size()), 0};
+            file.write(reinterpret_cast<const char*>(header), sizeof(header));
+            put(battle);
+            put(lineup_key);
+            put(turns);
+            put(survivors1);
+            put(survivors2);
+            put(health1);
+            put(health2);
+            put(outcome);
+            size_t padding = resultGroupSize(battle.size()) - (8 + battle.size() * (8 + 8 + 5 * 4 + 1));
+            const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            file.write(zeros, padding);
+            file.flush();
+            n_flushed += battle.size();
+            battle.clear(); lineup_key.clear(); turns.clear(); survivors1.clear(); survivors2.clear();
+            health1.clear(); health2.clear(); outcome.clear();
+        }
+
+        long long rows() const {return n_flushed + battle.size();}
+
+    private:
+        ofstream file;
+        long long n_flushed;
+        vector<uint64_t> battle;
+        vector<uint64_t> lineup_key;
+        vector<int32_t> turns;
+        vector<int32_t> survivors1;
+        vector<int32_t> survivors2;
+        vector<int32_t> health1;
+        vector<int32_t> health2;
+        vector<uint8_t> outcome;
+
+        template <class T>
+        void put(const vector<T>& column) {
+            file.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(T));
+        }
+};
+
+class MappedFile {
+    // read-only memory mapping of a whole file
+    public:
+        explicit MappedFile(const string& path): bytes(nullptr), n_bytes(0) {
+#ifdef _WIN32
+            handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (handle == INVALID_HANDLE_VALUE) {throw runtime_error("Cannot open " + path + ".");}
+            LARGE_INTEGER size;
+            GetFileSizeEx(handle, &size);
+            n_bytes = size.QuadPart;
+            mapping = n_bytes ? CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            if (mapping) {bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));}
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {throw runtime_error("Cannot open " + path + ".");}
+            struct stat info;
+            fstat(fd, &info);
+            n_bytes = info.st_size;
+            if (n_bytes > 0) {
+                void* p = mmap(nullptr, n_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    bytes = static_cast<const char*>(p);
+                    madvise(p, n_bytes, MADV_SEQUENTIAL);
+                }
+            }
+            close(fd);
+#endif
+            if (n_bytes > 0 && !bytes) {throw runtime_error("Cannot map " + path + ".");}
+        }
+
+        ~MappedFile() {
+#ifdef _WIN32
+            if (bytes) {UnmapViewOfFile(bytes);}
+            if (mapping) {CloseHandle(mapping);}
+            CloseHandle(handle);
+#else
+            if (bytes) {munmap(const_cast<char*>(bytes), n_bytes);}
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const {return bytes;}
+        size_t size() const {return n_bytes;}
+
+    private:
+        const char* bytes;
+        size_t n_bytes;
+#ifdef _WIN32
+        HANDLE handle;
+        HANDLE mapping = nullptr;
+#endif
+};
+
+struct ResultColumns {
+    // the columns of one row group, pointing into the mapped file
+    uint32_t n_rows;
+    const uint64_t* battle;
+    const uint64_t* lineup_key;
+    const int32_t* turns;
+    const int32_t* survivors1;
+    const int32_t* survivors2;
+    const int32_t* health1;
+    const int32_t* health2;
+    const uint8_t* outcome;
+};
+
+class ResultStore {
+    // a store file mapped into memory; only the group headers are read up front
+    public:
+        explicit ResultStore(const string& path): file(path), n_total(0) {
+            const char* base = file.data();
+            if (file.size() < 8 || memcmp(base, RESULT_STORE_MAGIC, 4) != 0) {
+                throw runtime_error(path + " is not a result store.");
+            }
+            size_t pos = 8;
+            while (pos + 8 <= file.size()) {
+                ResultColumns group;
+                memcpy(&group.n_rows, base + pos, 4);
+                if (pos + resultGroupSize(group.n_rows) > file.size()) {break;} // unfinished group at the end
+                size_t n = group.n_rows;
+                const char* p = base + pos + 8;
+                group.battle = reinterpret_cast<const uint64_t*>(p);
+                group.lineup_key = reinterpret_cast<const uint64_t*>(p += 8 * n);
+                group.turns = reinterpret_cast<const int32_t*>(p += 8 * n);
+                group.survivors1 = reinterpret_cast<const int32_t*>(p += 4 * n);
+                group.survivors2 = reinterpret_cast<const int32_t*>(p += 4 * n);
+                group.health1 = reinterpret_cast<const int32_t*>(p += 4 * n);
+                group.health2 = reinterpret_cast<const int32_t*>(p += 4 * n);
+                group.outcome = reinterpret_cast<const uint8_t*>(p += 4 * n);
+                row_groups.push_back(group);
+                n_total += n;
+                pos += resultGroupSize(group.n_rows);
+            }
+        }
+
+        long long n_rows() const {return n_total;}
+
+        const vector<ResultColumns>& groups() const {return row_groups;}
+
+    private:
+        MappedFile file;
+        vector<ResultColumns> row_groups;
+        long long n_total;
+};
+
+// multi-threaded tournament
+// runs a large number of random battles over all cores; every battle draws from its own
+// counter-based rng stream, every worker owns its name pool and statistics,
+// work is handed out in chunks and idle workers steal from busy ones
+
+struct LineupStats {
+    // aggregated results of all battles between the same two lineups
+    long long battles = 0;
+    long long n_team1_wins = 0;
+    long long n_team2_wins = 0;
+    long long n_ties = 0;
+    long long n_unfinished = 0; // stopped by the turn limit
+    long long n_stalemates = 0; // stopped because neither team could ever lose a monster
+    long long total_turns = 0;
+    int min_turns = 0;
+    int max_turns = 0;
+    long long longest_battle = -1; // index of the first battle with max_turns (if known)
+
+    void add(const BattleResult& result, long long battle_idx = -1) {
+        if (battles == 0 || result.turns < min_turns) {min_turns = result.turns;}
+        if (battles == 0 || result.turns > max_turns || 
+            (result.turns == max_turns && battle_idx < longest_battle)) {
+            max_turns = result.turns;
+            longest_battle = battle_idx;
+        }
+        battles++;
+        total_turns += result.turns;
+        switch (result.outcome) {
+            case team1_wins: n_team1_wins++; break;
+            case team2_wins: n_team2_wins++; break;
+            case tied: n_ties++; break;
+            case unfinished: n_unfinished++; break;
+            case stalemate: n_stalemates++; break;
+        }
+    }
+
+    void merge(const LineupStats& other) {
+        if (other.battles == 0) {return;}
+        if (battles == 0 || other.min_turns < min_turns) {min_turns = other.min_turns;}
+        if (battles == 0 || other.max_turns > max_turns || 
+            (other.max_turns == max_turns && other.longest_battle < longest_battle)) {
+            max_turns = other.max_turns;
+            longest_battle = other.longest_battle;
+        }
+        battles += other.battles;
+        n_team1_wins += other.n_team1_wins;
+        n_team2_wins += other.n_team2_wins;
+        n_ties += other.n_ties;
+        n_unfinished += other.n_unfinished;
+        n_stalemates += other.n_stalemates;
+        total_turns += other.total_turns;
+    }
+};
+
+class WorkRange {
+    // range of battle indices owned by one worker; the owner takes chunks from the front,
+    // thieves take half of what is left from the back
+    public:
+        WorkRange(): next(0), end(0) {}
+
+        void assign(long long begin, long long stop) {
+            lock_guard<mutex> lock(m);
+            next = begin;
+            end = stop;
+        }
+
+        bool take(long long chunk, long long& begin, long long& stop) {
+            lock_guard<mutex> lock(m);
+            if (next >= end) {return false;}
+            begin = next;
+            stop = min(end, next + chunk);
+            next = stop;
+            return true;
+        }
+
+        bool steal(long long min_chunk, long long& begin, long long& stop) {
+            lock_guard<mutex> lock(m);
+            long long remaining = end - next;
+            if (remaining < min_chunk) {return false;}
+            begin = end - remaining / 2;
+            stop = end;
+            end = begin;
+            return true;
+        }
+
+    private:
+        mutex m;
+        long long next;
+        long long end;
+};
+
+struct TournamentResult {
+    unordered_map<uint64_t, LineupStats> lineups; // keyed by (team1 code << 32 | team2 code)
+    LineupStats total;
+    double seconds = 0;
+};
+
+CounterRng tournamentRng(uint64_t seed, long long battle_idx, int team_size, vector<MonsterType>& lineup1, vector<MonsterType>& lineup2) {
+    // lineups of a tournament battle; returns the rng for its turns
+    // (depends on nothing but the seed and the index, so any battle can be regenerated alone)
+    CounterRng rng(seed, battle_idx);
+    lineup1 = monsterPicker(team_size, rng);
+    lineup2 = monsterPicker(team_size, rng);
+    return rng;
+}
+
+CounterRng gridRng(uint64_t seed, long long battle_idx, int team_size, vector<MonsterType>& lineup1, vector<MonsterType>& lineup2) {
+    // lineups of a grid battle: every pair of team_size lineups in turn (pair battle_idx modulo
+    // the number of pairs, lineups as base-3 digits); the rng only breaks speed ties
+    long long n_lineups = 1;
+    for (int i = 0; i < team_size; i++) {n_lineups *= N_MONSTER_TYPES;}
+    long long pair = battle_idx % (n_lineups * n_lineups);
+    long long codes[2] = {pair / n_lineups, pair % n_lineups};
+    for (int side = 0; side < 2; side++) {
+        vector<MonsterType>& lineup = side == 0 ? lineup1 : lineup2;
+        lineup.resize(team_size);
+        for (int i = team_size - 1; i >= 0; i--) {
+            lineup[i] = static_cast<MonsterType>(codes[side] % N_MONSTER_TYPES);
+            codes[side] /= N_MONSTER_TYPES;
+        }
+    }
+    return CounterRng(seed, battle_idx);
+}
+
+TournamentResult runTournament(long long n_battles, int n_threads, uint64_t seed, int team_size = 4, 
+    ResultWriter* writer = nullptr, long long first_battle = 0, bool grid = false) {
+    // run n_battles "team_size random vs team_size random" battles on n_threads threads
+    // battle i draws from CounterRng(seed, i), so the results do not depend on n_threads
+    // every result is also appended to writer if given (in the order the chunks finish)
+    // the battles are first_battle, first_battle + 1, ..., with gridRng lineups if grid
+    const long long chunk = 256;
+    vector<WorkRange> ranges(n_threads);
+    for (int w = 0; w < n_threads; w++) {
+        ranges[w].assign(first_battle + n_battles * w / n_threads, first_battle + n_battles * (w + 1) / n_threads);
+    }
+    vector<unordered_map<uint64_t, LineupStats>> worker_stats(n_threads);
+    mutex writer_mutex;
+
+    auto worker = [&](int w) {
+        NullSink sink;
+        NamePool namepool;
+        auto& stats = worker_stats[w];
+        vector<BattleResult> chunk_results;
+        long long begin, stop;
+        while (true) {
+            bool found = ranges[w].take(chunk, begin, stop);
+            for (int other = 1; !found && other < n_threads; other++) {
+                found = ranges[(w + other) % n_threads].steal(chunk, begin, stop);
+            }
+            if (!found) {return;}
+            vector<MonsterType> lineup1;
+            vector<MonsterType> lineup2;
+            chunk_results.clear();
+            for (long long i = begin; i < stop; i++) {
+                CounterRng rng = grid ? gridRng(seed, i, team_size, lineup1, lineup2) : 
+                    tournamentRng(seed, i, team_size, lineup1, lineup2);
+                BattleResult result = makeBattle({"Red", lineup1}, {"Blue", lineup2}, namepool, sink, rng);
+                stats[result.lineup_key].add(result, i);
+                if (writer) {chunk_results.push_back(result);}
+            }
+            if (writer) {
+                lock_guard<mutex> lock(writer_mutex);
+                for (long long i = begin; i < stop; i++) {writer->add(chunk_results[i - begin], i);}
+            }
+        }
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int w = 0; w < n_threads; w++) {
+        threads.emplace_back(worker, w);
+    }
+    for (auto& t : threads) {t.join();}
+
+    TournamentResult result;
+    for (auto& stats : worker_stats) {
+        for (auto& entry : stats) {
+            result.lineups[entry.first].merge(entry.second);
+            result.total.merge(entry.second);
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+void writeLineupCsv(const TournamentResult& result, const string& path) {
+    // one row per (team1 lineup, team2 lineup), sorted by key
+    ofstream out(path);
+    if (!out) {throw runtime_error("Cannot open " + path + " for writing.");}
+    map<uint64_t, LineupStats> sorted(result.lineups.begin(), result.lineups.end());
+    out << "team1,team2,battles,team1_wins,team2_wins,ties,unfinished,stalemates,mean_turns,min_turns,max_turns\n";
+    for (auto& entry : sorted) {
+        const LineupStats& s = entry.second;
+        out << lineupCodeToString(entry.first >> 32) << "," << 
+            lineupCodeToString(entry.first & 0xffffffffu) << "," << s.battles << "," << 
+            s.n_team1_wins << "," << s.n_team2_wins << "," << s.n_ties << "," << s.n_unfinished << "," << 
+            s.n_stalemates << "," << static_cast<double>(s.total_turns) / s.battles << "," << s.min_turns << "," << s.max_turns << "\n";
+    }
+}
+
+void printTournamentStats(const TournamentResult& result, uint64_t seed, bool grid, const string& csv_path) {
+    const LineupStats& s = result.total;
+    cout << "  team1 wins: " << s.n_team1_wins << ", team2 wins: " << s.n_team2_wins << 
+        ", ties: " << s.n_ties << ", unfinished: " << s.n_unfinished << ", stalemates: " << s.n_stalemates << "\n";
+    cout << "  turns: mean " << static_cast<double>(s.total_turns) / max(1LL, s.battles) << 
+        ", min " << s.min_turns << ", max " << s.max_turns << "\n";
+    cout << "  longest battle: #" << s.longest_battle;
+    if (!grid) {cout << " (replay with --replay " << seed << " " << s.longest_battle << ")";}
+    cout << "\n";
+    cout << "  distinct lineup pairs: " << result.lineups.size() << "\n";
+    if (!csv_path.empty()) {
+        writeLineupCsv(result, csv_path);
+        cout << "  per-lineup stats written to " << csv_path << "\n";
+    }
+}
+
+void runTournamentMode(long long n_battles, int n_threads, const string& csv_path, uint64_t seed, 
+    const string& store_path) {
+    if (n_threads <= 0) {n_threads = max(1u, thread::hardware_concurrency());}
+    unique_ptr<ResultWriter> writer;
+    if (!store_path.empty()) {writer = make_unique<ResultWriter>(store_path);}
+    TournamentResult result = runTournament(n_battles, n_threads, seed, 4, writer.get());
+    const LineupStats& s = result.total;
+    cout << "Tournament: " << s.battles << " random 4 vs 4 battles on " << n_threads << 
+        " threads (seed " << seed << ") in " << result.seconds << "s (" << 
+        static_cast<long long>(s.battles / result.seconds) << " battles/s)\n";
+    printTournamentStats(result, seed, false, csv_path);
+    if (writer) {
+        writer->flush();
+        cout << "  " << writer->rows() << " results appended to " << store_path << "\n";
+    }
+}
+
+// sharded jobs
+// a job is a long tournament (random lineups as in --tournament, or every lineup pair in turn) split
+// into shards: shard s of n owns the battles [n_battles * s / n, n_battles * (s + 1) / n), and since a
+// battle depends on nothing but the seed and its index, shards can run in separate processes or on
+// separate machines. a shard keeps its results aggregated per lineup pair and every few seconds replaces
+// its checkpoint file with them (written to a temporary file that is renamed over the old one, so a killed
+// process always leaves the last complete checkpoint behind); running the same command again resumes after
+// the last checkpointed battle, and --merge-jobs adds up the checkpoints of all shards
+// checkpoint layout, every field little-endian and fixed-width, so any machine can read any other's:
+//   "MBJ3", header (uint64 seed, int64 n_battles, int32 shard, n_shards, grid, team_size, int64 next_battle),
+//   uint64 n_entries, then per lineup pair: uint64 key, int64 battles, team1 wins, team2 wins, ties,
+//   unfinished, stalemates, total_turns, int32 min_turns, max_turns, int64 longest_battle
+
+const char JOB_MAGIC[4] = {'M', 'B', 'J', '3'};
+constexpr size_t JOB_HEADER_BYTES = 4 + 8 + 8 + 4 * 4 + 8 + 8; // with the magic and n_entries
+constexpr size_t JOB_ENTRY_BYTES = 8 + 7 * 8 + 2 * 4 + 8;
+
+void putLittleEndian(string& out, uint64_t value, int n_bytes) {
+    for (int i = 0; i < n_bytes; i++) {out += static_cast<char>(value >> (8 * i));}
+}
+
+uint64_t getLittleEndian(const string& data, size_t& pos, int n_bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < n_bytes; i++) {value |= static_cast<uint64_t>(static_cast<unsigned char>(data[pos + i])) << (8 * i);}
+    pos += n_bytes;
+    return value;
+}
+
+void replaceFile(const string& temp_path, const string& path) {
+    // move a completely written file over path in one step: readers see the old or the new file, never a mix
+#ifdef _WIN32
+    bool renamed = MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    int fd = open(temp_path.c_str(), O_RDONLY);
+    if (fd >= 0) { // on disk before it replaces the old file
+        fsync(fd);
+        close(fd);
+    }
+    bool renamed = rename(temp_path.c_str(), path.c_str()) == 0;
+#endif
+    if (!renamed) {throw runtime_error("Cannot replace " + path + ".");}
+}
+
+struct JobHeader {
+    uint64_t seed;
+    int64_t n_battles; // of the whole job
+    int32_t shard;
+    int32_t n_shards;
+    int32_t grid; // 1: gridRng lineups, 0: tournamentRng lineups
+    int32_t team_size;
+    int64_t next_battle; // first battle of the shard that is not in the checkpoint yet
+
+    long long begin() const {return n_battles * shard / n_shards;}
+    long long end() const {return n_battles * (shard + 1) / n_shards;}
+
+    bool same_job(const JobHeader& other) const {
+        return seed == other.seed && n_battles == other.n_battles && n_shards == other.n_shards && 
+            grid == other.grid && team_size == other.team_size;
+    }
+};
+
+struct JobCheckpoint {
+    JobHeader header;
+    unordered_map<uint64_t, LineupStats> lineups;
+
+    // replace the file at path with this checkpoint, never leaving a partial file behind
+    void save(const string& path) const {
+        PROFILE_PHASE(phase_output);
+        map<uint64_t, LineupStats> sorted(lineups.begin(), lineups.end()); // same bytes for the same results
+        string data(JOB_MAGIC, 4);
+        data.reserve(JOB_HEADER_BYTES + sorted.size() * JOB_ENTRY_BYTES);
+        putLittleEndian(data, header.seed, 8);
+        putLittleEndian(data, header.n_battles, 8);
+        putLittleEndian(data, header.shard, 4);
+        putLittleEndian(data, header.n_shards, 4);
+        putLittleEndian(data, header.grid, 4);
+        putLittleEndian(data, header.team_size, 4);
+        putLittleEndian(data, header.next_battle, 8);
+        putLittleEndian(data, sorted.size(), 8);
+        for (auto& entry : sorted) {
+            const LineupStats& stats = entry.second;
+            putLittleEndian(data, entry.first, 8);
+            for (long long count : {stats.battles, stats.n_team1_wins, stats.n_team2_wins, stats.n_ties, 
+                stats.n_unfinished, stats.n_stalemates, stats.total_turns}) {
+                putLittleEndian(data, count, 8);
+            }
+            putLittleEndian(data, stats.min_turns, 4);
+            putLittleEndian(data, stats.max_turns, 4);
+            putLittleEndian(data, stats.longest_battle, 8);
+        }
+
+        string temp_path = path + ".tmp";
+        {
+            ofstream file(temp_path, ios::binary | ios::trunc);
+            if (!file) {throw runtime_error("Cannot open " + temp_path + " for writing.");}
+            file.write(data.data(), data.size());
+            file.flush();
+            if (!file) {throw runtime_error("Cannot write " + temp_path + ".");}
+        }
+        replaceFile(temp_path, path);
+    }
+
+    static JobCheckpoint load(const string& path) {
+        ifstream file(path, ios::binary);
+        if (!file) {throw runtime_error("Cannot open " + path + ".");}
+        ostringstream bytes;
+        bytes << file.rdbuf();
+        string data = bytes.str();
+        if (data.size() < JOB_HEADER_BYTES || memcmp(data.data(), JOB_MAGIC, 4) != 0) {
+            throw runtime_error(path + " is not a job checkpoint.");
+        }
+        JobCheckpoint checkpoint;
+        JobHeader& header = checkpoint.header;
+        size_t pos = 4;
+        header.seed = getLittleEndian(data, pos, 8);
+        header.n_battles = getLittleEndian(data, pos, 8);
+        header.shard = static_cast<int32_t>(getLittleEndian(data, pos, 4));
+        header.n_shards = static_cast<int32_t>(getLittleEndian(data, pos, 4));
+        header.grid = static_cast<int32_t>(getLittleEndian(data, pos, 4));
+        header.team_size = static_cast<int32_t>(getLittleEndian(data, pos, 4));
+        header.next_battle = getLittleEndian(data, pos, 8);
+        uint64_t n_entries = getLittleEndian(data, pos, 8);
+        if (header.n_battles <= 0 || header.n_shards <= 0 || header.shard < 0 || header.shard >= header.n_shards || 
+            header.next_battle < header.begin() || header.next_battle > header.end()) {
+            throw runtime_error(path + " is not a job checkpoint.");
+        }
+        // the entry count must account for the rest of the file exactly
+        if ((data.size() - JOB_HEADER_BYTES) % JOB_ENTRY_BYTES != 0 || 
+            n_entries != (data.size() - JOB_HEADER_BYTES) / JOB_ENTRY_BYTES) {
+            throw runtime_error(path + " is truncated or corrupt.");
+        }
+        for (uint64_t i = 0; i < n_entries; i++) {
+            uint64_t key = getLittleEndian(data, pos, 8);
+            LineupStats& stats = checkpoint.lineups[key];
+            for (long long* count : {&stats.battles, &stats.n_team1_wins, &stats.n_team2_wins, &stats.n_ties, 
+                &stats.n_unfinished, &stats.n_stalemates, &stats.total_turns}) {
+                *count = getLittleEndian(data, pos, 8);
+            }
+            stats.min_turns = static_cast<int32_t>(getLittleEndian(data, pos, 4));
+            stats.max_turns = static_cast<int32_t>(getLittleEndian(data, pos, 4));
+            stats.longest_battle = getLittleEndian(data, pos, 8);
+        }
+        return checkpoint;
+    }
+};
+
+void runJobMode(const string& path, bool grid, uint64_t seed, long long n_battles, int shard, int n_shards, 
+    int n_threads, double checkpoint_seconds) {
+    if (n_battles <= 0 || n_shards <= 0 || shard < 0 || shard >= n_shards) {
+        throw runtime_error("A job needs n_battles > 0 and 0 <= shard < n_shards.");
+    }
+    if (n_threads <= 0) {n_threads = max(1u, thread::hardware_concurrency());}
+    JobCheckpoint job;
+    job.header = {seed, n_battles, shard, n_shards, grid, 4, 0};
+    job.header.next_battle = job.header.begin();
+    if (ifstream(path)) {
+        JobCheckpoint saved = JobCheckpoint::load(path);
+        if (!saved.header.same_job(job.header) || saved.header.shard != shard) {
+            throw runtime_error(path + " is the checkpoint of another job or shard.");
+        }
+        job = move(saved);
+    }
+    JobHeader& header = job.header;
+    cout << "Job shard " << shard << " of " << n_shards << " (" << (grid ? "grid" : "random") << " 4 vs 4, seed " << 
+        seed << "): battles " << header.begin() << " - " << header.end() - 1 << ", " << 
+        (header.next_battle == header.begin() ? "starting" : "resuming at " + to_string(header.next_battle)) << "\n";
+
+    // segments of a few chunks per thread, so runTournament still balances the load between checkpoints
+    const long long segment = 1 << 16;
+    long long first = header.next_battle;
+    auto start = chrono::steady_clock::now();
+    auto last_save = start;
+    while (header.next_battle < header.end()) {
+        long long n = min(segment * n_threads, header.end() - header.next_battle);
+        TournamentResult part = runTournament(n, n_threads, seed, 4, nullptr, header.next_battle, grid);
+        for (auto& entry : part.lineups) {job.lineups[entry.first].merge(entry.second);}
+        header.next_battle += n;
+        auto now = chrono::steady_clock::now();
+        if (header.next_battle == header.end() || chrono::duration<double>(now - last_save).count() >= checkpoint_seconds) {
+            job.save(path);
+            last_save = now;
+            cout << "  checkpoint: " << header.next_battle - header.begin() << " of " << 
+                header.end() - header.begin() << " battles\n";
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "Shard complete: " << header.end() - first << " battles in this run, " << elapsed.count() << "s (" << 
+        static_cast<long long>((header.end() - first) / max(elapsed.count(), 1e-9)) << " battles/s), results in " << path << "\n";
+}
+
+void runMergeJobsMode(const string& csv_path, const vector<string>& paths) {
+    // adds up shard checkpoints of one job (unfinished shards count with what they have so far)
+    TournamentResult merged;
+    JobHeader job = {};
+    vector<bool> seen;
+    long long covered = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        JobCheckpoint checkpoint = JobCheckpoint::load(paths[i]);
+        const JobHeader& header = checkpoint.header;
+        if (i == 0) {
+            job = header;
+            seen.assign(job.n_shards, false);
+        } else if (!header.same_job(job)) {
+            throw runtime_error(paths[i] + " belongs to another job than " + paths[0] + ".");
+        }
+        if (seen[header.shard]) {throw runtime_error(paths[i] + ": shard " + to_string(header.shard) + " appears twice.");}
+        seen[header.shard] = true;
+        covered += header.next_battle - header.begin();
+        if (header.next_battle < header.end()) {
+            cout << "  shard " << header.shard << " is unfinished (" << header.next_battle - header.begin() << " of " << 
+                header.end() - header.begin() << " battles)\n";
+        }
+        for (auto& entry : checkpoint.lineups) {
+            merged.lineups[entry.first].merge(entry.second);
+            merged.total.merge(entry.second);
+        }
+    }
+    int n_missing = count(seen.begin(), seen.end(), false);
+    cout << "Merged " << paths.size() << " of " << job.n_shards << " shards (" << (job.grid ? "grid" : "random") << 
+        " 4 vs 4, seed " << job.seed << "): " << covered << " of " << job.n_battles << " battles" << 
+        (n_missing ? ", " + to_string(n_missing) + " shards missing" : "") << "\n";
+    printTournamentStats(merged, job.seed, job.grid, csv_path == "-" ? "" : csv_path);
+}
+
+
+// structure-of-arrays battle engine
+// same rules as the Monster class hierarchy, but every stat of a team lives in its own
+// contiguous array and the type-specific behaviour is expressed through the stats
+// (non-goblins attack once, non-trolls regenerate 0, non-orcs block and reflect 0),
+// so a turn needs no virtual calls and no strings; names stay with the Monster objects
+
+class TeamArrays {
+    public:
+        vector<MonsterType> type;
+        vector<int> max_health;
+        vector<int> health;
+        vector<int> damage;
+        vector<int> speed;
+        vector<int> num_attack;
+        vector<int> regen_amount;
+        vector<int> block_amount;
+        vector<int> reflect_amount;
+        vector<char> is_alive;
+        int lead = 0; // index of the first alive monster (== size() when defeated)
+
+        int size() const {return static_cast<int>(health.size());}
+
+        bool is_defeated() const {return lead >= size();}
+
+        void clear() {
+            type.clear(); max_health.clear(); health.clear(); damage.clear(); speed.clear(); 
+            num_attack.clear(); regen_amount.clear(); block_amount.clear(); reflect_amount.clear(); 
+            is_alive.clear();
+            lead = 0;
+        }
+
+        // append a monster, copying its current stats
+        void add(const Monster& mon) {
+            type.push_back(mon.type);
+            max_health.push_back(mon.max_health);
+            health.push_back(mon.health);
+            damage.push_back(mon.damage);
+            speed.push_back(mon.speed);
+            num_attack.push_back(mon.type == goblin ? static_cast<const Goblin&>(mon).num_attack : 1);
+            regen_amount.push_back(mon.type == troll ? static_cast<const Troll&>(mon).regen_amount : 0);
+            block_amount.push_back(mon.type == orc ? static_cast<const Orc&>(mon).block_amount : 0);
+            reflect_amount.push_back(mon.type == orc ? static_cast<const Orc&>(mon).reflect_amount : 0);
+            is_alive.push_back(mon.is_alive);
+        }
+
+        void set_lineup(const vector<MonsterType>& lineup) {
+            clear();
+            for (auto t : lineup) {add(monsterPrototype(t));}
+        }
+
+        // move the lead past dead monsters (only the lead can die, so this only moves forward)
+        void advance_lead() {
+            while (lead < size() && !is_alive[lead]) {lead++;}
+        }
+};
+
+inline void soaAttack(TeamArrays& att, int a, TeamArrays& def, int d) {
+    // all attacks of monster a on monster d, with blocking and reflecting
+    for (int i = 0; i < att.num_attack[a]; i++) {
+        if (!(att.is_alive[a] && def.is_alive[d])) {break;}
+        int dealt = max(att.damage[a] - def.block_amount[d], 0);
+        def.health[d] -= min(dealt, def.health[d]);
+        att.health[a] -= min(def.reflect_amount[d], att.health[a]);
+        if (def.health[d] <= 0) {def.is_alive[d] = 0;}
+        if (att.health[a] <= 0) {att.is_alive[a] = 0;}
+    }
+}
+
+inline void soaEndTurn(TeamArrays& team, int m) {
+    // regeneration at the end of the monster's own turn, capped at max health
+    if (team.is_alive[m] && team.health[m] < team.max_health[m]) {
+        team.health[m] = min(team.health[m] + team.regen_amount[m], team.max_health[m]);
+    }
+}
+
+void soaTurn(TeamArrays& team1, TeamArrays& team2, mt19937& rng) {
+    // same order as turn(): faster lead attacks and regenerates, then the slower one if alive
+    int m1 = team1.lead;
+    int m2 = team2.lead;
+    bool team1_first;
+    if (team1.speed[m1] != team2.speed[m2]) {
+        team1_first = team1.speed[m1] > team2.speed[m2];
+    } else {
+        uniform_int_distribution<int> dist(0, 1);
+        team1_first = dist(rng) == 0;
+    }
+    TeamArrays& faster = team1_first ? team1 : team2;
+    TeamArrays& slower = team1_first ? team2 : team1;
+    int f = team1_first ? m1 : m2;
+    int s = team1_first ? m2 : m1;
+
+    soaAttack(faster, f, slower, s);
+    soaEndTurn(faster, f);
+    if (slower.is_alive[s]) {
+        soaAttack(slower, s, faster, f);
+        soaEndTurn(slower, s);
+    }
+}
+
+BattleResult soaBattle(TeamArrays& team1, TeamArrays& team2, mt19937& rng) {
+    // headless equivalent of battle()
+    int turn_idx = 1;
+    team1.advance_lead();
+    team2.advance_lead();
+    while (!team1.is_defeated() && !team2.is_defeated()) {
+        soaTurn(team1, team2, rng);
+        team1.advance_lead();
+        team2.advance_lead();
+        turn_idx++;
+        if (turn_idx>MAX_TURNS){break;}
+    }
+
+    BattleResult result;
+    result.turns = turn_idx - 1;
+    if (team1.is_defeated() && team2.is_defeated()) {
+        result.outcome = tied;
+    } else if (team1.is_defeated()) {
+        result.outcome = team2_wins;
+    } else if (team2.is_defeated()) {
+        result.outcome = team1_wins;
+    } else {
+        result.outcome = unfinished;
+    }
+    return result;
+}
+
+// compile-time matchup kernels
+// one kernel per (team1 lead type, team2 lead type) pair; the stats, the speed order,
+// goblin multi-attacks, orc block/reflect and troll regen are all compile-time constants,
+// so a kernel is a tight loop over two health values. The battle dispatches once per
+// lead change and the kernel plays turns until one of the leads dies.
+// (only valid for the stats in MonsterStats, healths are the only state)
+
+template <MonsterType Attacker, MonsterType Defender>
+inline void kernelAttack(int& attacker_health, int& defender_health) {
+    typedef MonsterStats<Attacker> A;
+    typedef MonsterStats<Defender> D;
+    constexpr int dealt = A::damage > D::block_amount ? A::damage - D::block_amount : 0;
+    constexpr int reflected = D::reflect_amount;
+    for (int i = 0; i < A::num_attack; i++) {
+        if (attacker_health <= 0 || defender_health <= 0) {break;}
+        defender_health -= dealt < defender_health ? dealt : defender_health;
+        if (reflected > 0) {
+            attacker_health -= reflected < attacker_health ? reflected : attacker_health;
+        }
+    }
+}
+
+template <MonsterType T>
+inline void kernelEndTurn(int& health) {
+    typedef MonsterStats<T> S;
+    if (S::regen_amount > 0 && health > 0 && health < S::max_health) {
+        health = health + S::regen_amount < S::max_health ? health + S::regen_amount : S::max_health;
+    }
+}
+
+template <MonsterType T1, MonsterType T2>
+struct MatchupKernel {
+    // 1: team1's lead is faster, -1: team2's lead is faster, 0: coin flip every turn
+    static constexpr int speed_order = 
+        MonsterStats<T1>::speed > MonsterStats<T2>::speed ? 1 : 
+        (MonsterStats<T1>::speed < MonsterStats<T2>::speed ? -1 : 0);
+
+    // play turns until a lead dies or max_turns are played, returns the number of turns
+    static int run(int& health1, int& health2, mt19937& rng, int max_turns) {
+        int turns = 0;
+        while (health1 > 0 && health2 > 0 && turns < max_turns) {
+            bool team1_first = speed_order > 0;
+            if (speed_order == 0) {
+                uniform_int_distribution<int> dist(0, 1);
+                team1_first = dist(rng) == 0;
+            }
+            if (team1_first) {
+                kernelAttack<T1, T2>(health1, health2);
+                kernelEndTurn<T1>(health1);
+                if (health2 > 0) {
+                    kernelAttack<T2, T1>(health2, health1);
+                    kernelEndTurn<T2>(health2);
+                }
+            } else {
+                kernelAttack<T2, T1>(health2, health1);
+                kernelEndTurn<T2>(health2);
+                if (health1 > 0) {
+                    kernelAttack<T1, T2>(health1, health2);
+                    kernelEndTurn<T1>(health1);
+                }
+            }
+            turns++;
+        }
+        return turns;
+    }
+};
+
+typedef int (*MatchupFunction)(int&, int&, mt19937&, int);
+
+// kernel table indexed by [team1 lead type][team2 lead type]
+const MatchupFunction MATCHUP_KERNELS[3][3] = {
+    {&MatchupKernel<goblin, goblin>::run, &MatchupKernel<goblin, troll>::run, &MatchupKernel<goblin, orc>::run},
+    {&MatchupKernel<troll, goblin>::run, &MatchupKernel<troll, troll>::run, &MatchupKernel<troll, orc>::run},
+    {&MatchupKernel<orc, goblin>::run, &MatchupKernel<orc, troll>::run, &MatchupKernel<orc, orc>::run},
+};
+
+int maxHealthOf(MonsterType type) {
+    switch (type) {
+        case goblin: return MonsterStats<goblin>::max_health;
+        case troll: return MonsterStats<troll>::max_health;
+        default: return MonsterStats<orc>::max_health;
+    }
+}
+
+BattleResult kernelBattle(const vector<MonsterType>& lineup1, const vector<MonsterType>& lineup2, mt19937& rng) {
+    // headless equivalent of battle() for default-stat monsters
+    int n1 = lineup1.size();
+    int n2 = lineup2.size();
+    int lead1 = 0;
+    int lead2 = 0;
+    int health1 = n1 > 0 ? maxHealthOf(lineup1[0]) : 0;
+    int health2 = n2 > 0 ? maxHealthOf(lineup2[0]) : 0;
+    int turns = 0;
+    while (lead1 < n1 && lead2 < n2 && turns < MAX_TURNS) {
+        turns += MATCHUP_KERNELS[lineup1[lead1]][lineup2[lead2]](health1, health2, rng, MAX_TURNS - turns);
+        if (health1 <= 0 && ++lead1 < n1) {health1 = maxHealthOf(lineup1[lead1]);}
+        if (health2 <= 0 && ++lead2 < n2) {health2 = maxHealthOf(lineup2[lead2]);}
+    }
+
+    BattleResult result;
+    result.turns = turns;
+    if (lead1 >= n1 && lead2 >= n2) {
+        result.outcome = tied;
+    } else if (lead1 >= n1) {
+        result.outcome = team2_wins;
+    } else if (lead2 >= n2) {
+        result.outcome = team1_wins;
+    } else {
+        result.outcome = unfinished;
+    }
+    return result;
+}
+
+// exact win probabilities
+// the only randomness in a battle is the coin flip on speed ties, and only the leads
+// ever take damage, so a battle state is just (remaining lineups, lead healths, turns played).
+// BattleAnalyzer solves the outcome distribution with memoized recursion over those states.
+
+struct MonsterSpec {
+    // plain stats of a monster type (num_attack/regen/block/reflect are 1/0/0/0 when not applicable)
+    int max_health;
+    int damage;
+    int speed;
+    int num_attack;
+    int regen_amount;
+    int block_amount;
+    int reflect_amount;
+};
+
+MonsterSpec specOf(const Monster& mon) {
+    MonsterSpec spec;
+    spec.max_health = mon.max_health;
+    spec.damage = mon.damage;
+    spec.speed = mon.speed;
+    spec.num_attack = mon.type == goblin ? static_cast<const Goblin&>(mon).num_attack : 1;
+    spec.regen_amount = mon.type == troll ? static_cast<const Troll&>(mon).regen_amount : 0;
+    spec.block_amount = mon.type == orc ? static_cast<const Orc&>(mon).block_amount : 0;
+    spec.reflect_amount = mon.type == orc ? static_cast<const Orc&>(mon).reflect_amount : 0;
+    return spec;
+}
+
+vector<MonsterSpec> defaultSpecs() {
+    // specs indexed by MonsterType
+    return {specOf(monsterPrototype(goblin)), specOf(monsterPrototype(troll)), specOf(monsterPrototype(orc))};
+}
+
+inline void specAttack(const MonsterSpec& attacker, int& attacker_health, const MonsterSpec& defender, int& defender_health) {
+    // all attacks of one lead on the other, same rules as the Monster classes
+    int dealt = max(attacker.damage - defender.block_amount, 0);
+    for (int i = 0; i < attacker.num_attack; i++) {
+        if (attacker_health <= 0 || defender_health <= 0) {break;}
+        defender_health -= min(dealt, defender_health);
+        attacker_health -= min(defender.reflect_amount, attacker_health);
+    }
+}
+
+inline void specEndTurn(const MonsterSpec& mon, int& health) {
+    if (health > 0 && health < mon.max_health) {
+        health = min(health + mon.regen_amount, mon.max_health);
+    }
+}
+
+inline void specTurn(const MonsterSpec& mon1, int& health1, const MonsterSpec& mon2, int& health2, bool team1_first) {
+    // one turn between two leads, with the order already decided
+    if (team1_first) {
+        specAttack(mon1, health1, mon2, health2);
+        specEndTurn(mon1, health1);
+        if (health2 > 0) {
+            specAttack(mon2, health2, mon1, health1);
+            specEndTurn(mon2, health2);
+        }
+    } else {
+        specAttack(mon2, health2, mon1, health1);
+        specEndTurn(mon2, health2);
+        if (health1 > 0) {
+            specAttack(mon1, health1, mon2, health2);
+            specEndTurn(mon1, health1);
+        }
+    }
+}
+
+// fast-forward
+// once both leads are fixed and their speeds differ, nothing random happens until one of them dies.
+// as long as nobody dies and no regeneration stops at max health within a turn, every turn moves
+// both healths by the same amounts, so such a stretch of turns can be played in one go
+
+long long skippableTurns(const MonsterSpec& mon1, int health1, const MonsterSpec& mon2, int health2,
+    bool team1_first, int& delta1, int& delta2) {
+    // number of turns from now on (speeds must differ) that each add delta1/delta2 to the healths,
+    // or -1 if that holds forever (only when both deltas are 0: the next turn is a stalemate)
+    const MonsterSpec* specs[2] = {&mon1, &mon2};
+    int healths[2] = {health1, health2};
+    int offset[2] = {0, 0}; // health change since the start of the turn
+    int lowest[2] = {0, 0}; // lowest offset within the turn
+    int ceiling[2] = {0, 0}; // highest start health at which the regeneration is not capped
+    int first = team1_first ? 0 : 1;
+    for (int side : {first, 1 - first}) {
+        const MonsterSpec& attacker = *specs[side];
+        const MonsterSpec& defender = *specs[1 - side];
+        int dealt = max(attacker.damage - defender.block_amount, 0);
+        offset[1 - side] -= attacker.num_attack * dealt;
+        offset[side] -= attacker.num_attack * defender.reflect_amount;
+        lowest[0] = min(lowest[0], offset[0]);
+        lowest[1] = min(lowest[1], offset[1]);
+        if (attacker.regen_amount > 0) {
+            ceiling[side] = attacker.max_health - attacker.regen_amount - offset[side];
+            offset[side] += attacker.regen_amount;
+        }
+    }
+    delta1 = offset[0];
+    delta2 = offset[1];
+
+    long long turns = -1;
+    auto limit = [&turns](long long margin, long long slope) {
+        // margin + t * slope > 0 must hold for every turn t = 0, 1, ... that is skipped
+        long long n = margin <= 0 ? 0 : slope < 0 ? (margin - 1) / -slope + 1 : -1;
+        if (n >= 0 && (turns < 0 || n < turns)) {turns = n;}
+    };
+    for (int side = 0; side < 2; side++) {
+        limit(healths[side] + lowest[side], offset[side]); // nobody dies
+        if (specs[side]->regen_amount > 0) {
+            limit(ceiling[side] - healths[side] + 1, -offset[side]); // the regeneration is never capped
+        }
+    }
+    return turns;
+}
+
+int fastForward(Monster& mon1, Monster& mon2, int max_turns) {
+    // plays up to max_turns turns of two leads with different speeds at once, if they are all
+    // deterministic and non-lethal; returns the number of turns played (0: play the next one normally)
+    int delta1, delta2;
+    long long skip = skippableTurns(specOf(mon1), mon1.health, specOf(mon2), mon2.health, 
+        mon1.speed > mon2.speed, delta1, delta2);
+    skip = min(skip, static_cast<long long>(max_turns));
+    if (skip <= 0) {return 0;}
+    mon1.health += skip * delta1;
+    mon2.health += skip * delta2;
+    return skip;
+}
+
+struct OutcomeDistribution {
+    double p_team1 = 0; // probability that team1 wins
+    double p_team2 = 0;
+    double p_tie = 0;
+    double p_unfinished = 0; // stopped by the turn limit
+    double expected_turns = 0;
+
+    void add(const OutcomeDistribution& other, double weight) {
+        p_team1 += weight * other.p_team1;
+        p_team2 += weight * other.p_team2;
+        p_tie += weight * other.p_tie;
+        p_unfinished += weight * other.p_unfinished;
+        expected_turns += weight * other.expected_turns;
+    }
+};
+
+class BattleAnalyzer {
+    // lineups are stored as suffix codes: base 4 digits (type + 1), lead in the lowest digit,
+    // so dropping the lead is code / 4 and every battle sharing a suffix shares its states
+    public:
+        BattleAnalyzer(const vector<MonsterSpec>& type_specs = defaultSpecs()): specs(type_specs) {}
+
+        OutcomeDistribution analyze(const vector<MonsterType>& lineup1, const vector<MonsterType>& lineup2) {
+            if (lineup1.size() > 15 || lineup2.size() > 15) {
+                throw invalid_argument("BattleAnalyzer supports at most 15 monsters per team.");
+            }
+            uint32_t code1 = suffixCode(lineup1);
+            uint32_t code2 = suffixCode(lineup2);
+            return solve(code1, code2, leadHealth(code1), leadHealth(code2), 0);
+        }
+
+        // outcome over all lineups monsterPicker(n1) vs monsterPicker(n2) can produce (all equally likely)
+        OutcomeDistribution analyze_random(int n1, int n2) {
+            OutcomeDistribution total;
+            vector<vector<MonsterType>> lineups1 = allLineups(n1);
+            vector<vector<MonsterType>> lineups2 = allLineups(n2);
+            double weight = 1.0 / (static_cast<double>(lineups1.size()) * lineups2.size());
+            for (auto& lineup1 : lineups1) {
+                for (auto& lineup2 : lineups2) {
+                    total.add(analyze(lineup1, lineup2), weight);
+                }
+            }
+            return total;
+        }
+
+        size_t n_states() const {return states.size();}
+
+        static vector<vector<MonsterType>> allLineups(int n) {
+            vector<vector<MonsterType>> lineups(1);
+            for (int i = 0; i < n; i++) {
+                vector<vector<MonsterType>> longer;
+                for (auto& lineup : lineups) {
+                    for (int t = 0; t < 3; t++) {
+                        longer.push_back(lineup);
+                        longer.back().push_back(static_cast<MonsterType>(t));
+                    }
+                }
+                lineups.swap(longer);
+            }
+            return lineups;
+        }
+
+    private:
+        struct StateKey {
+            uint32_t code1;
+            uint32_t code2;
+            uint16_t health1;
+            uint16_t health2;
+            uint16_t turns;
+
+            bool operator==(const StateKey& other) const {
+                return code1 == other.code1 && code2 == other.code2 && health1 == other.health1 && 
+                    health2 == other.health2 && turns == other.turns;
+            }
+        };
+
+        struct StateKeyHash {
+            size_t operator()(const StateKey& key) const {
+                uint64_t h = (static_cast<uint64_t>(key.code1) << 32 | key.code2) * 0x9E3779B97F4A7C15ull;
+                h ^= (static_cast<uint64_t>(key.health1) << 32 | static_cast<uint64_t>(key.health2) << 16 | key.turns) 
+                    * 0xC2B2AE3D27D4EB4Full;
+                return static_cast<size_t>(h ^ (h >> 29));
+            }
+        };
+
+        vector<MonsterSpec> specs;
+        unordered_map<StateKey, OutcomeDistribution, StateKeyHash> states; // memo of solved states
+
+        static uint32_t suffixCode(const vector<MonsterType>& lineup) {
+            uint32_t code = 0;
+            for (int i = lineup.size() - 1; i >= 0; i--) {
+                code = code * 4 + (static_cast<uint32_t>(lineup[i]) + 1);
+            }
+            return code;
+        }
+
+        int leadHealth(uint32_t code) const {
+            return code == 0 ? 0 : specs[code % 4 - 1].max_health;
+        }
+
+        OutcomeDistribution solve(uint32_t code1, uint32_t code2, int health1, int health2, int turns) {
+            OutcomeDistribution result;
+            if (code1 == 0 || code2 == 0) {
+                if (code1 == 0 && code2 == 0) {result.p_tie = 1;}
+                else if (code1 == 0) {result.p_team2 = 1;}
+                else {result.p_team1 = 1;}
+                return result;
+            }
+            if (turns >= MAX_TURNS) {
+                result.p_unfinished = 1;
+                return result;
+            }
+
+            StateKey state_key = {code1, code2, static_cast<uint16_t>(health1), 
+                static_cast<uint16_t>(health2), static_cast<uint16_t>(turns)};
+            auto found = states.find(state_key);
+            if (found != states.end()) {return found->second;}
+
+            const MonsterSpec& mon1 = specs[code1 % 4 - 1];
+            const MonsterSpec& mon2 = specs[code2 % 4 - 1];
+            if (mon1.speed != mon2.speed) {
+                result = next(code1, code2, health1, health2, turns, mon1.speed > mon2.speed);
+            } else {
+                // coin flip, as in turn()
+                result.add(next(code1, code2, health1, health2, turns, true), 0.5);
+                result.add(next(code1, code2, health1, health2, turns, false), 0.5);
+            }
+            states[state_key] = result;
+            return result;
+        }
+
+        OutcomeDistribution next(uint32_t code1, uint32_t code2, int health1, int health2, int turns, bool team1_first) {
+            specTurn(specs[code1 % 4 - 1], health1, specs[code2 % 4 - 1], health2, team1_first);
+            if (health1 <= 0) {
+                code1 /= 4;
+                health1 = leadHealth(code1);
+            }
+            if (health2 <= 0) {
+                code2 /= 4;
+                health2 = leadHealth(code2);
+            }
+            OutcomeDistribution result = solve(code1, code2, health1, health2, turns + 1);
+            result.expected_turns += 1;
+            return result;
+        }
+};
+
+// lineup order optimizer
+// finds the order of a fixed pool of monsters that scores best against an opponent, given as one or more
+// lineups with weights (e.g. every lineup monsterPicker can produce). score = P(win) + P(tie) / 2.
+// - team1's monsters only matter one at a time, so the order is built one position at a time. a search node
+//   keeps cheap POD snapshots of the battle at the moment its last monster fell (what is left of the opponent's
+//   lineup, its lead's health, turns) with their probabilities, plus the outcomes already decided; children
+//   extend those snapshots, so the battle for a shared prefix is simulated once.
+// - the opponent lineups are stored as a tree of shared suffixes, so snapshots of different opponents
+//   with the same monsters left are merged.
+// - how one fresh monster does from a snapshot is memoized, the same snapshot shows up under many prefixes.
+// - branch and bound: the bound of a node is what the team could score if it picked each next monster after
+//   seeing the snapshot, memoized per (monsters left, snapshot). no fixed order beats it, so branches that
+//   cannot beat the best complete order so far are dropped. without coin flips the bound is exact and the
+//   search walks straight to the best order.
+// - monsters of the same type are interchangeable, so only distinct types are tried at each position.
+
+class LineupOptimizer {
+    public:
+        LineupOptimizer(const vector<vector<MonsterType>>& opponent_lineups, const vector<double>& opponent_weights,
+            const vector<MonsterSpec>& type_specs = defaultSpecs()): specs(type_specs) {
+            if (opponent_lineups.empty() || opponent_lineups.size() != opponent_weights.size()) {
+                throw invalid_argument("LineupOptimizer needs at least one opponent lineup, and one weight each.");
+            }
+            for (auto& spec : specs) {
+                if (spec.max_health > 0xFFFF) {throw invalid_argument("LineupOptimizer supports max health up to 65535.");}
+            }
+            // suffix 0 is the empty lineup
+            suffix_lead.push_back(goblin);
+            suffix_rest.push_back(0);
+            map<pair<int, uint32_t>, uint32_t> suffix_ids;
+            double total = 0;
+            for (auto& lineup : opponent_lineups) {
+                if (lineup.empty()) {throw invalid_argument("Opponent lineups need at least one monster.");}
+                uint32_t suffix = 0;
+                for (int i = lineup.size() - 1; i >= 0; i--) {
+                    auto inserted = suffix_ids.emplace(make_pair(static_cast<int>(lineup[i]), suffix), suffix_lead.size());
+                    if (inserted.second) {
+                        suffix_lead.push_back(lineup[i]);
+                        suffix_rest.push_back(suffix);
+                    }
+                    suffix = inserted.first->second;
+                }
+                opponents.push_back(suffix);
+            }
+            for (double weight : opponent_weights) {total += weight;}
+            for (double weight : opponent_weights) {weights.push_back(weight / total);}
+        }
+
+        // best order of the pool, with its exact outcome against the opponents
+        vector<MonsterType> optimize(const vector<MonsterType>& pool, OutcomeDistribution& outcome) {
+            int counts[3] = {0, 0, 0};
+            for (MonsterType type : pool) {counts[type]++;}
+            if (pool.empty() || counts[0] > 0xFF || counts[1] > 0xFF || counts[2] > 0xFF) {
+                throw invalid_argument("LineupOptimizer needs 1 - 255 monsters of each type in the pool.");
+            }
+            Node root;
+            map<uint64_t, double> starts;
+            for (size_t i = 0; i < opponents.size(); i++) {
+                Snapshot start = {opponents[i], static_cast<uint16_t>(specs[suffix_lead[opponents[i]]].max_health), 0};
+                starts[start.key()] += weights[i];
+            }
+            root.snapshots.assign(starts.begin(), starts.end());
+            best_score = -1;
+            best_order.clear();
+            vector<MonsterType> order;
+            search(counts, root, order);
+            outcome = best_outcome;
+            return best_order;
+        }
+
+        static double score(const OutcomeDistribution& d) {return d.p_team1 + 0.5 * d.p_tie;}
+
+        long long n_nodes() const {return nodes;}
+        long long n_pruned() const {return pruned;}
+        size_t n_fights() const {return fights.size();}
+        size_t n_bounds() const {return bounds.size();}
+        size_t n_suffixes() const {return suffix_lead.size() - 1;}
+
+    private:
+        struct Snapshot {
+            // the battle right after one of team1's monsters fell (or before the first one leads)
+            uint32_t suffix; // what is left of the opponent's lineup
+            uint16_t health; // health of the opponent's lead
+            uint8_t turns;
+
+            uint64_t key() const {return static_cast<uint64_t>(suffix) << 24 | static_cast<uint64_t>(health) << 8 | turns;}
+
+            static Snapshot from_key(uint64_t key) {
+                return {static_cast<uint32_t>(key >> 24), static_cast<uint16_t>(key >> 8), static_cast<uint8_t>(key)};
+            }
+        };
+        static_assert(MAX_TURNS <= 0xFF, "Snapshot stores the turns in 8 bits.");
+
+        struct Node {
+            vector<pair<uint64_t, double>> snapshots; // battles still running, with their probabilities
+            OutcomeDistribution decided; // expected_turns holds sum(p * turns) of the decided part
+        };
+
+        struct Fight {
+            // a fresh monster against a snapshot, until it falls or the opponent is defeated
+            OutcomeDistribution decided;
+            vector<pair<uint64_t, double>> next;
+        };
+
+        struct MemoKey {
+            uint64_t snapshot;
+            uint32_t extra; // (type, is last) for fights, the monsters left for bounds
+
+            bool operator==(const MemoKey& other) const {return snapshot == other.snapshot && extra == other.extra;}
+        };
+
+        struct MemoKeyHash {
+            size_t operator()(const MemoKey& key) const {
+                uint64_t h = key.snapshot * 0x9E3779B97F4A7C15ull ^ key.extra * 0xC2B2AE3D27D4EB4Full;
+                return static_cast<size_t>(h ^ (h >> 29));
+            }
+        };
+
+        vector<uint32_t> opponents; // suffix of each opponent lineup
+        vector<double> weights;
+        vector<MonsterType> suffix_lead; // lead of each suffix
+        vector<uint32_t> suffix_rest; // the suffix after its lead falls
+        vector<MonsterSpec> specs;
+        unordered_map<MemoKey, Fight, MemoKeyHash> fights;
+        unordered_map<MemoKey, double, MemoKeyHash> bounds;
+        double best_score = -1;
+        vector<MonsterType> best_order;
+        OutcomeDistribution best_outcome;
+        long long nodes = 0;
+        long long pruned = 0;
+
+        const Fight& fight(int type, bool last, uint64_t snapshot_key) {
+            MemoKey memo_key = {snapshot_key, static_cast<uint32_t>(type * 2 + last)};
+            auto found = fights.find(memo_key);
+            if (found != fights.end()) {return found->second;}
+
+            // advance every (health, opponent suffix, lead health) one turn at a time, merging equal states,
+            // so long coin flip sequences stay as small as the set of reachable healths
+            Fight result;
+            Snapshot start = Snapshot::from_key(snapshot_key);
+            const MonsterSpec& mon1 = specs[type];
+            unordered_map<uint64_t, double> layer = {{static_cast<uint64_t>(mon1.max_health) << 48 | 
+                static_cast<uint64_t>(start.suffix) << 16 | start.health, 1.0}};
+            unordered_map<uint64_t, double> next_layer;
+            unordered_map<uint64_t, double> fallen;
+            for (int turns = start.turns; !layer.empty(); turns++) {
+                if (turns >= MAX_TURNS) {
+                    for (auto& state : layer) {
+                        result.decided.p_unfinished += state.second;
+                        result.decided.expected_turns += state.second * turns;
+                    }
+                    break;
+                }
+                for (auto& state : layer) {
+                    uint32_t suffix2 = static_cast<uint32_t>(state.first >> 16);
+                    const MonsterSpec& mon2 = specs[suffix_lead[suffix2]];
+                    for (int order = 0; order < 2; order++) {
+                        double p = state.second;
+                        bool team1_first = order == 0;
+                        if (mon1.speed != mon2.speed) {
+                            if (order == 1) {break;}
+                            team1_first = mon1.speed > mon2.speed;
+                        } else {
+                            p *= 0.5; // coin flip, as in turn()
+                        }
+                        int health1 = static_cast<int>(state.first >> 48);
+                        int health2 = static_cast<int>(state.first & 0xFFFF);
+                        uint32_t suffix = suffix2;
+                        specTurn(mon1, health1, mon2, health2, team1_first);
+                        if (health2 <= 0) {
+                            suffix = suffix_rest[suffix];
+                            health2 = suffix == 0 ? 0 : specs[suffix_lead[suffix]].max_health;
+                        }
+                        if (suffix == 0) {
+                            if (health1 > 0 || !last) {result.decided.p_team1 += p;}
+                            else {result.decided.p_tie += p;}
+                            result.decided.expected_turns += p * (turns + 1);
+                        } else if (health1 <= 0) {
+                            if (last) {
+                                result.decided.p_team2 += p;
+                                result.decided.expected_turns += p * (turns + 1);
+                            } else {
+                                Snapshot snapshot = {suffix, static_cast<uint16_t>(health2), static_cast<uint8_t>(turns + 1)};
+                                fallen[snapshot.key()] += p;
+                            }
+                        } else {
+                            next_layer[static_cast<uint64_t>(health1) << 48 | static_cast<uint64_t>(suffix) << 16 | 
+                                static_cast<uint64_t>(health2)] += p;
+                        }
+                    }
+                }
+                layer.swap(next_layer);
+                next_layer.clear();
+            }
+            result.next.assign(fallen.begin(), fallen.end());
+            sort(result.next.begin(), result.next.end()); // keeps the sums independent of the hash order
+            return fights.emplace(memo_key, std::move(result)).first->second;
+        }
+
+        double bound(const int counts[3], uint64_t snapshot_key) {
+            // best score from the snapshot when each next monster may be picked after seeing the battle so far
+            int left = counts[0] + counts[1] + counts[2];
+            MemoKey memo_key = {snapshot_key, static_cast<uint32_t>(counts[0] << 16 | counts[1] << 8 | counts[2])};
+            auto found = bounds.find(memo_key);
+            if (found != bounds.end()) {return found->second;}
+            double best = 0;
+            for (int type = 0; type < 3; type++) {
+                if (counts[type] == 0) {continue;}
+                const Fight& f = fight(type, left == 1, snapshot_key);
+                int rest[3] = {counts[0], counts[1], counts[2]};
+                rest[type]--;
+                double value = score(f.decided);
+                for (auto& next : f.next) {value += next.second * bound(rest, next.first);}
+                best = max(best, value);
+            }
+            bounds.emplace(memo_key, best);
+            return best;
+        }
+
+        void search(const int counts[3], const Node& node, vector<MonsterType>& order) {
+            nodes++;
+            int left = counts[0] + counts[1] + counts[2];
+            if (left == 0) {
+                double value = score(node.decided);
+                if (value > best_score) {
+                    best_score = value;
+                    best_order = order;
+                    best_outcome = node.decided;
+                }
+                return;
+            }
+
+            // extend the snapshots by each distinct type, then visit the most promising child first
+            struct Child {
+                int type;
+                double bound;
+                Node node;
+            };
+            vector<Child> children;
+            for (int type = 0; type < 3; type++) {
+                if (counts[type] == 0) {continue;}
+                int rest[3] = {counts[0], counts[1], counts[2]};
+                rest[type]--;
+                Child child = {type, 0, Node()};
+                child.node.decided = node.decided;
+                map<uint64_t, double> merged;
+                for (auto& snapshot : node.snapshots) {
+                    const Fight& f = fight(type, left == 1, snapshot.first);
+                    child.node.decided.add(f.decided, snapshot.second);
+                    for (auto& next : f.next) {merged[next.first] += snapshot.second * next.second;}
+                }
+                child.bound = score(child.node.decided);
+                for (auto& snapshot : merged) {
+                    child.node.snapshots.push_back(snapshot);
+                    child.bound += snapshot.second * bound(rest, snapshot.first);
+                }
+                children.push_back(std::move(child));
+            }
+            stable_sort(children.begin(), children.end(), [](const Child& a, const Child& b) {return a.bound > b.bound;});
+            for (auto& child : children) {
+                if (child.bound <= best_score + 1e-12) {
+                    pruned++;
+                    continue;
+                }
+                int rest[3] = {counts[0], counts[1], counts[2]};
+                rest[child.type]--;
+                order.push_back(static_cast<MonsterType>(child.type));
+                search(rest, child.node, order);
+                order.pop_back();
+            }
+        }
+};
+
+// monster catalog
+// monster archetypes as data instead of classes: a name, a letter for lineups, base stats and any mix
+// of the traits multi-attack, regen, block and reflect. A catalog file has one archetype per line:
+//   name letter health damage speed [attacks n] [regen n] [block n] [reflect n]
+// ('#' starts a comment; see monsters.catalog). Loading compiles it into one flat table of MonsterSpec,
+// indexed by archetype id, which catalogBattle() reads directly: no Monster objects, no virtual calls,
+// and every trait is just a number in the table, so an archetype without a trait pays nothing for it.
+// The Monster classes stay the engine with text output; the catalog is for headless sweeps.
+
+class MonsterCatalog {
+    public:
+        // the three Monster classes, ids equal to their MonsterType
+        static MonsterCatalog builtin() {
+            MonsterCatalog catalog;
+            vector<MonsterSpec> specs = defaultSpecs();
+            for (int type = 0; type < N_MONSTER_TYPES; type++) {
+                catalog.add(monsterTypeToString(static_cast<MonsterType>(type)), "GTO"[type], specs[type]);
+            }
+            return catalog;
+        }
+
+        static MonsterCatalog load(const string& path) {
+            ifstream file(path);
+            if (!file) {throw runtime_error("Cannot open " + path + ".");}
+            MonsterCatalog catalog;
+            string line;
+            for (int line_idx = 1; getline(file, line); line_idx++) {
+                string where = path + ":" + to_string(line_idx) + ": ";
+                line = line.substr(0, line.find('#'));
+                istringstream words(line);
+                string name, letter;
+                if (!(words >> name)) {continue;} // blank or comment
+                MonsterSpec spec = {0, 0, 0, 1, 0, 0, 0};
+                if (!(words >> letter >> spec.max_health >> spec.damage >> spec.speed) || letter.size() != 1) {
+                    throw runtime_error(where + "expected: name letter health damage speed [trait value ...]");
+                }
+                string trait;
+                int value;
+                while (words >> trait) {
+                    if (!(words >> value)) {throw runtime_error(where + "trait " + trait + " needs a value");}
+                    if (trait == "attacks") {spec.num_attack = value;}
+                    else if (trait == "regen") {spec.regen_amount = value;}
+                    else if (trait == "block") {spec.block_amount = value;}
+                    else if (trait == "reflect") {spec.reflect_amount = value;}
+                    else {throw runtime_error(where + "unknown trait " + trait + " (attacks, regen, block, reflect)");}
+                }
+                if (spec.max_health <= 0 || spec.damage < 0 || spec.num_attack < 1 || spec.regen_amount < 0 || 
+                    spec.block_amount < 0 || spec.reflect_amount < 0) {
+                    throw runtime_error(where + "health and attacks must be positive, the rest not negative");
+                }
+                char upper = static_cast<char>(toupper(letter[0]));
+                if (catalog.id_of_letter[static_cast<unsigned char>(upper)] >= 0) {
+                    throw runtime_error(where + "letter " + string(1, upper) + " is already taken");
+                }
+                catalog.add(name, upper, spec);
+            }
+            if (catalog.size() == 0) {throw runtime_error(path + " has no archetypes.");}
+            return catalog;
+        }
+
+        int size() const {return table.size();}
+        const MonsterSpec& spec(int id) const {return table[id];}
+        const vector<MonsterSpec>& specs() const {return table;}
+        const string& name(int id) const {return names[id];}
+        char letter(int id) const {return letters[id];}
+
+        // lineup of archetype ids from letters, e.g. "GTO"
+        vector<int> parse_lineup(const string& text) const {
+            vector<int> lineup;
+            for (char c : text) {
+                int id = id_of_letter[static_cast<unsigned char>(toupper(c))];
+                if (id < 0) {throw invalid_argument("Unknown monster letter '" + string(1, c) + "' in lineup " + text);}
+                lineup.push_back(id);
+            }
+            return lineup;
+        }
+
+    private:
+        vector<MonsterSpec> table;
+        vector<string> names;
+        vector<char> letters;
+        vector<int> id_of_letter = vector<int>(256, -1);
+
+        void add(const string& name, char letter, const MonsterSpec& spec) {
+            id_of_letter[static_cast<unsigned char>(letter)] = table.size();
+            table.push_back(spec);
+            names.push_back(name);
+            letters.push_back(letter);
+        }
+};
+
+template <class Rng>
+vector<int> pickArchetypes(int n, int n_archetypes, Rng& rng) {
+    // monsterPicker for a catalog: n archetype ids, each equally likely
+    vector<int> selected;
+    uniform_int_distribution<> dis(0, n_archetypes - 1);
+    for (int i = 0; i < n; i++) {selected.push_back(dis(rng));}
+    return selected;
+}
+
+struct BattleState {
+    // where a battle between two lineups stands: only the leads can be hurt, so every monster behind
+    // a lead has full health and every monster before it is dead
+    int lead1 = 0; // index of team1's lead (== lineup size when defeated)
+    int lead2 = 0;
+    int health1 = 0; // health of team1's lead
+    int health2 = 0;
+    int turns = 0; // turns played so far
+    int stalled_orders = 0; // as in battle()
+    bool is_stalemate = false;
+};
+
+template <class Id>
+BattleState initialState(const MonsterSpec* specs, const vector<Id>& lineup1, const vector<Id>& lineup2) {
+    BattleState state;
+    state.health1 = lineup1.empty() ? 0 : specs[lineup1[0]].max_health;
+    state.health2 = lineup2.empty() ? 0 : specs[lineup2[0]].max_health;
+    return state;
+}
+
+template <class Id, class Rng>
+bool playFrom(const MonsterSpec* specs, const vector<Id>& lineup1, const vector<Id>& lineup2, BattleState& state, 
+    Rng& rng, int max_turns = MAX_TURNS, bool fast_forward = false, bool stop_at_coin_flip = false) {
+    // battle() on flat stat tables (lineups index specs), from state on and with the same rules: coin flips on
+    // speed ties drawn the same way, stalemates, turn limit (max_turns, none if <= 0); state is left where the
+    // battle stands. with stop_at_coin_flip it stops right before the first coin flip and returns true,
+    // without drawing from rng; otherwise it returns false once the battle is over
+    // with fast_forward, the turns between speed ties, deaths and capped regenerations are skipped (see skippableTurns);
+    // off by default, since it only pays off for long duels and slows down short ones
+    size_t n1 = lineup1.size();
+    size_t n2 = lineup2.size();
+    size_t lead1 = state.lead1;
+    size_t lead2 = state.lead2;
+    int health1 = state.health1;
+    int health2 = state.health2;
+    int turn_idx = state.turns + 1;
+    int stalled_orders = state.stalled_orders;
+    bool is_stalemate = state.is_stalemate;
+    bool skipped = false; // the turn after a skip is lethal or capped, so it is played normally
+    bool stopped = false;
+    while (!is_stalemate && lead1 < n1 && lead2 < n2 && !(max_turns > 0 && turn_idx > max_turns)) {
+        const MonsterSpec& mon1 = specs[lineup1[lead1]];
+        const MonsterSpec& mon2 = specs[lineup2[lead2]];
+        if (fast_forward && !skipped && mon1.speed != mon2.speed) {
+            int delta1, delta2;
+            long long skip = skippableTurns(mon1, health1, mon2, health2, mon1.speed > mon2.speed, delta1, delta2);
+            if (max_turns > 0) {skip = min(skip, static_cast<long long>(max_turns - turn_idx + 1));}
+            if (skip > 0) {
+                health1 += skip * delta1;
+                health2 += skip * delta2;
+                turn_idx += skip;
+                stalled_orders = 0;
+                skipped = true;
+                continue;
+            }
+        }
+        skipped = false;
+        int before1 = health1;
+        int before2 = health2;
+        bool team1_first;
+        if (mon1.speed != mon2.speed) {
+            team1_first = mon1.speed > mon2.speed;
+        } else {
+            if (stop_at_coin_flip) {
+                stopped = true;
+                break;
+            }
+            rngAtTurn(rng, turn_idx);
+            uniform_int_distribution<int> dist(0, 1);
+            team1_first = dist(rng) == 0;
+        }
+        specTurn(mon1, health1, mon2, health2, team1_first);
+        turn_idx++;
+        if (health1 > 0 && health2 > 0 && health1 == before1 && health2 == before2) {
+            stalled_orders |= team1_first ? 1 : 2;
+            if (mon1.speed != mon2.speed || stalled_orders == 3) {is_stalemate = true;}
+        } else {
+            stalled_orders = 0;
+        }
+        if (health1 <= 0 && ++lead1 < n1) {health1 = specs[lineup1[lead1]].max_health;}
+        if (health2 <= 0 && ++lead2 < n2) {health2 = specs[lineup2[lead2]].max_health;}
+    }
+    state.lead1 = lead1;
+    state.lead2 = lead2;
+    state.health1 = health1;
+    state.health2 = health2;
+    state.turns = turn_idx - 1;
+    state.stalled_orders = stalled_orders;
+    state.is_stalemate = is_stalemate;
+    return stopped;
+}
+
+template <class Id>
+BattleResult stateResult(const MonsterSpec* specs, const vector<Id>& lineup1, const vector<Id>& lineup2, const BattleState& state) {
+    // the result of a battle that stands at state (unfinished if it could go on)
+    // (lineup_key is not filled in, lineupCode only knows the three built-in types)
+    size_t n1 = lineup1.size();
+    size_t n2 = lineup2.size();
+    size_t lead1 = state.lead1;
+    size_t lead2 = state.lead2;
+    BattleResult result;
+    result.turns = state.turns;
+    if (lead1 >= n1 && lead2 >= n2) {result.outcome = tied;}
+    else if (lead1 >= n1) {result.outcome = team2_wins;}
+    else if (lead2 >= n2) {result.outcome = team1_wins;}
+    else if (state.is_stalemate) {result.outcome = stalemate;}
+    else {result.outcome = unfinished;}
+    if (lead1 < n1) {
+        result.survivors1 = n1 - lead1;
+        result.health1 = state.health1;
+        for (size_t i = lead1 + 1; i < n1; i++) {result.health1 += specs[lineup1[i]].max_health;}
+    }
+    if (lead2 < n2) {
+        result.survivors2 = n2 - lead2;
+        result.health2 = state.health2;
+        for (size_t i = lead2 + 1; i < n2; i++) {result.health2 += specs[lineup2[i]].max_health;}
+    }
+    return result;
+}
+
+template <class Rng>
+BattleResult catalogBattle(const MonsterCatalog& catalog, const vector<int>& lineup1, const vector<int>& lineup2, 
+    Rng& rng, int max_turns = MAX_TURNS, bool fast_forward = false) {
+    // battle() on the catalog's flat tables, from the start (see playFrom)
+    const MonsterSpec* specs = catalog.specs().data();
+    BattleState state = initialState(specs, lineup1, lineup2);
+    playFrom(specs, lineup1, lineup2, state, rng, max_turns, fast_forward);
+    return stateResult(specs, lineup1, lineup2, state);
+}
+
+// balancing solver
+// searches stats (on a grid with the given step, all within 0 - 100) such that
+// one goblin defeats one troll but loses to two, one troll defeats one orc but loses to two,
+// and one orc defeats one goblin but loses to two.
+// - only the speed order between types matters, so speeds are one of the 6 strict orders
+//   (a speed tie would leave 1 vs 1 outcomes to the coin flip, so types never share a speed)
+// - goblins attack at least twice, trolls regenerate, orcs block and reflect (as in the description)
+// - each rule only involves two types, so every rule is evaluated once per (stats, stats, who is faster)
+//   and cached as a margin matrix; a configuration is valid when all three cached rules hold
+// margin of a rule: the smaller of the winner's remaining health (in % of its team's max health)
+// in the 1 vs 1 and the 1 vs 2 battle; the margin of a configuration is its weakest rule
+
+void parallelFor(int n, int n_threads, const function<void(int, int)>& body) {
+    // calls body(i, worker) for every i in [0, n), handing out indices dynamically
+    atomic<int> next(0);
+    vector<thread> threads;
+    for (int w = 0; w < n_threads; w++) {
+        threads.emplace_back([&, w]() {
+            for (int i = next++; i < n; i = next++) {body(i, w);}
+        });
+    }
+    for (auto& t : threads) {t.join();}
+}
+
+BattleOutcome specBattle(const MonsterSpec& mon1, int n1, const MonsterSpec& mon2, int n2, 
+    bool team1_first, int& health_left1, int& health_left2) {
+    // n1 copies of mon1 vs n2 copies of mon2 with a fixed speed order;
+    // health_left is the total health the team has left at the end
+    int health1 = mon1.max_health;
+    int health2 = mon2.max_health;
+    int turns = 0;
+    while (n1 > 0 && n2 > 0 && turns < MAX_TURNS) {
+        specTurn(mon1, health1, mon2, health2, team1_first);
+        if (health1 <= 0 && --n1 > 0) {health1 = mon1.max_health;}
+        if (health2 <= 0 && --n2 > 0) {health2 = mon2.max_health;}
+        turns++;
+    }
+    health_left1 = n1 > 0 ? health1 + (n1 - 1) * mon1.max_health : 0;
+    health_left2 = n2 > 0 ? health2 + (n2 - 1) * mon2.max_health : 0;
+    if (n1 == 0 && n2 == 0) {return tied;}
+    if (n1 == 0) {return team2_wins;}
+    if (n2 == 0) {return team1_wins;}
+    return unfinished;
+}
+
+uint8_t ruleMargin(const MonsterSpec& winner, const MonsterSpec& loser, bool winner_first) {
+    // margin (1 - 100) of "one winner defeats one loser, but loses to two", 0 if the rule fails
+    int left1, left2;
+    if (specBattle(winner, 1, loser, 1, winner_first, left1, left2) != team1_wins) {return 0;}
+    int margin1 = left1 * 100 / winner.max_health;
+    if (specBattle(winner, 1, loser, 2, winner_first, left1, left2) != team2_wins) {return 0;}
+    int margin2 = left2 * 100 / (2 * loser.max_health);
+    return static_cast<uint8_t>(max(1, min(margin1, margin2)));
+}
+
+struct BalanceConfig {
+    MonsterSpec specs[3]; // indexed by MonsterType
+    int margin;
+};
+
+string specText(MonsterType type, const MonsterSpec& spec) {
+    string text = monsterTypeToString(type) + "(health " + to_string(spec.max_health) + 
+        ", damage " + to_string(spec.damage) + ", speed " + to_string(spec.speed);
+    if (type == goblin) {text += ", attacks " + to_string(spec.num_attack);}
+    if (type == troll) {text += ", regen " + to_string(spec.regen_amount);}
+    if (type == orc) {text += ", block " + to_string(spec.block_amount) + ", reflect " + to_string(spec.reflect_amount);}
+    return text + ")";
+}
+
+unique_ptr<Monster> getMonster(MonsterType type, const MonsterSpec& spec, int name_id) {
+    // a monster of the given type with custom stats
+    unique_ptr<Monster> mon;
+    switch (type) {
+        case goblin: {
+            auto gob = make_unique<Goblin>(name_id);
+            gob->num_attack = spec.num_attack;
+            mon = std::move(gob);
+            break;
+        }
+        case troll: {
+            auto tro = make_unique<Troll>(name_id);
+            tro->regen_amount = spec.regen_amount;
+            mon = std::move(tro);
+            break;
+        }
+        default: {
+            auto orc_mon = make_unique<Orc>(name_id);
+            orc_mon->block_amount = spec.block_amount;
+            orc_mon->reflect_amount = spec.reflect_amount;
+            mon = std::move(orc_mon);
+            break;
+        }
+    }
+    mon->max_health = spec.max_health;
+    mon->health = spec.max_health;
+    mon->damage = spec.damage;
+    mon->speed = spec.speed;
+    return mon;
+}
+
+bool verifyBalance(const BalanceConfig& config) {
+    // re-run the six balancing battles through the Monster class hierarchy
+    NullSink sink;
+    mt19937 rng(0); // speeds never tie, so the rng is never used
+    auto play = [&](MonsterType one, MonsterType other, int n_other) {
+        vector<unique_ptr<Monster>> team1_monsters;
+        team1_monsters.push_back(getMonster(one, config.specs[one], 0));
+        vector<unique_ptr<Monster>> team2_monsters;
+        for (int i = 0; i < n_other; i++) {
+            team2_monsters.push_back(getMonster(other, config.specs[other], i + 1));
+        }
+        return battle(make_unique<Team>("Red", std::move(team1_monsters)), 
+            make_unique<Team>("Blue", std::move(team2_monsters)), sink, rng).outcome;
+    };
+    return play(goblin, troll, 1) == team1_wins && play(goblin, troll, 2) == team2_wins &&
+        play(troll, orc, 1) == team1_wins && play(troll, orc, 2) == team2_wins &&
+        play(orc, goblin, 1) == team1_wins && play(orc, goblin, 2) == team2_wins;
+}
+
+class BalanceSolver {
+    public:
+        int step;
+        int n_threads;
+        const int rank_speeds[3] = {20, 30, 50}; // speeds given to the slowest/middle/fastest type
+
+        BalanceSolver(int grid_step, int threads): step(grid_step), n_threads(threads) {
+            goblins = candidates(goblin);
+            trolls = candidates(troll);
+            orcs = candidates(orc);
+        }
+
+        size_t n_candidates(MonsterType type) const {
+            return type == goblin ? goblins.size() : (type == troll ? trolls.size() : orcs.size());
+        }
+
+        // run the search; keeps the top_k configurations by margin, and optionally
+        // streams every valid configuration to csv; returns the number of valid configurations
+        long long solve(int top_k, ostream* csv, vector<BalanceConfig>& best) {
+            // margin matrices for both speed orders of each pair of types
+            vector<uint8_t> goblin_troll[2], troll_orc[2], orc_goblin[2];
+            for (int first = 0; first < 2; first++) {
+                goblin_troll[first] = ruleMatrix(goblins, trolls, first);
+                troll_orc[first] = ruleMatrix(trolls, orcs, first);
+                orc_goblin[first] = ruleMatrix(orcs, goblins, first);
+            }
+
+            long long n_valid = 0;
+            mutex out_mutex;
+            vector<BalanceConfig> worker_best;
+            int speed_orders[6][3] = {{0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0}}; // speed rank per type
+            for (auto& ranks : speed_orders) {
+                bool goblin_first = ranks[goblin] > ranks[troll];
+                bool troll_first = ranks[troll] > ranks[orc];
+                bool orc_first = ranks[orc] > ranks[goblin];
+                const vector<uint8_t>& gt = goblin_troll[goblin_first];
+                const vector<uint8_t>& to = troll_orc[troll_first];
+                const vector<uint8_t>& og = orc_goblin[orc_first];
+
+                // valid orcs per troll, so the innermost loop only visits orcs that already pass a rule
+                vector<vector<int>> orcs_of_troll(trolls.size());
+                for (size_t t = 0; t < trolls.size(); t++) {
+                    for (size_t o = 0; o < orcs.size(); o++) {
+                        if (to[t * orcs.size() + o]) {orcs_of_troll[t].push_back(o);}
+                    }
+                }
+
+                vector<long long> counts(n_threads, 0);
+                vector<vector<BalanceConfig>> tops(n_threads);
+                parallelFor(goblins.size(), n_threads, [&](int g, int w) {
+                    string rows;
+                    for (size_t t = 0; t < trolls.size(); t++) {
+                        int margin_gt = gt[g * trolls.size() + t];
+                        if (!margin_gt) {continue;}
+                        for (int o : orcs_of_troll[t]) {
+                            int margin_og = og[o * goblins.size() + g];
+                            if (!margin_og) {continue;}
+                            int margin = min(margin_gt, min(static_cast<int>(to[t * orcs.size() + o]), margin_og));
+                            counts[w]++;
+                            BalanceConfig config = makeConfig(g, t, o, ranks, margin);
+                            keepBest(tops[w], config, top_k);
+                            if (csv) {rows += csvRow(config);}
+                        }
+                    }
+                    if (csv && !rows.empty()) {
+                        lock_guard<mutex> lock(out_mutex);
+                        *csv << rows;
+                    }
+                });
+                for (int w = 0; w < n_threads; w++) {
+                    n_valid += counts[w];
+                    for (auto& config : tops[w]) {keepBest(worker_best, config, top_k);}
+                }
+            }
+            best = worker_best;
+            sort(best.begin(), best.end(), [](const BalanceConfig& a, const BalanceConfig& b) {return a.margin > b.margin;});
+            return n_valid;
+        }
+
+        static string csvHeader() {
+            return "margin,goblin_health,goblin_damage,goblin_speed,goblin_attacks,"
+                "troll_health,troll_damage,troll_speed,troll_regen,"
+                "orc_health,orc_damage,orc_speed,orc_block,orc_reflect\n";
+        }
+
+    private:
+        vector<MonsterSpec> goblins;
+        vector<MonsterSpec> trolls;
+        vector<MonsterSpec> orcs;
+
+        vector<int> grid(int low) const {
+            // low, low + step, ... up to 100
+            vector<int> values;
+            for (int v = low; v <= 100; v += step) {values.push_back(v);}
+            return values;
+        }
+
+        vector<MonsterSpec> candidates(MonsterType type) const {
+            // every grid point of the type's own stats (speed is filled in per speed order)
+            vector<MonsterSpec> list;
+            vector<int> extra1 = {0};
+            vector<int> extra2 = {0};
+            if (type == goblin) {extra1 = {2, 3, 4, 5};}
+            if (type == troll) {extra1 = grid(step);}
+            if (type == orc) {extra1 = grid(step); extra2 = grid(step);}
+            for (int health : grid(step)) {
+                for (int damage : grid(step)) {
+                    for (int e1 : extra1) {
+                        for (int e2 : extra2) {
+                            MonsterSpec spec = {health, damage, 0, 1, 0, 0, 0};
+                            if (type == goblin) {spec.num_attack = e1;}
+                            if (type == troll) {spec.regen_amount = e1;}
+                            if (type == orc) {spec.block_amount = e1; spec.reflect_amount = e2;}
+                            list.push_back(spec);
+                        }
+                    }
+                }
+            }
+            return list;
+        }
+
+        vector<uint8_t> ruleMatrix(const vector<MonsterSpec>& winners, const vector<MonsterSpec>& losers, bool winner_first) {
+            // margin of "winner defeats one loser, but loses to two" for every pair
+            vector<uint8_t> matrix(winners.size() * losers.size());
+            parallelFor(winners.size(), n_threads, [&](int i, int) {
+                for (size_t j = 0; j < losers.size(); j++) {
+                    matrix[i * losers.size() + j] = ruleMargin(winners[i], losers[j], winner_first);
+                }
+            });
+            return matrix;
+        }
+
+        BalanceConfig makeConfig(int g, int t, int o, const int* ranks, int margin) const {
+            BalanceConfig config;
+            config.specs[goblin] = goblins[g];
+            config.specs[troll] = trolls[t];
+            config.specs[orc] = orcs[o];
+            for (int type = 0; type < 3; type++) {config.specs[type].speed = rank_speeds[ranks[type]];}
+            config.margin = margin;
+            return config;
+        }
+
+        static void keepBest(vector<BalanceConfig>& top, const BalanceConfig& config, int top_k) {
+            // min-heap on margin holding at most top_k configurations
+            auto cmp = [](const BalanceConfig& a, const BalanceConfig& b) {return a.margin > b.margin;};
+            if (static_cast<int>(top.size()) < top_k) {
+                top.push_back(config);
+                push_heap(top.begin(), top.end(), cmp);
+            } else if (top_k > 0 && config.margin > top.front().margin) {
+                pop_heap(top.begin(), top.end(), cmp);
+                top.back() = config;
+                push_heap(top.begin(), top.end(), cmp);
+            }
+        }
+
+        static string csvRow(const BalanceConfig& c) {
+            const MonsterSpec& g = c.specs[goblin];
+            const MonsterSpec& t = c.specs[troll];
+            const MonsterSpec& o = c.specs[orc];
+            return to_string(c.margin) + "," + 
+                to_string(g.max_health) + "," + to_string(g.damage) + "," + to_string(g.speed) + "," + to_string(g.num_attack) + "," +
+                to_string(t.max_health) + "," + to_string(t.damage) + "," + to_string(t.speed) + "," + to_string(t.regen_amount) + "," +
+                to_string(o.max_health) + "," + to_string(o.damage) + "," + to_string(o.speed) + "," + 
+                to_string(o.block_amount) + "," + to_string(o.reflect_amount) + "\n";
+        }
+};
+
+// outcome cache
+// a battle only becomes random once two leads with the same speed meet; until then it always
+// plays out the same way. BattleService remembers the outcome of pairs that never reach a coin
+// flip and answers repeats without simulating; for the other pairs it remembers the state
+// right before the first coin flip and only simulates from there. It plays with playFrom, the
+// engine of catalogBattle, so it follows the same rules (stalemates, any turn limit); a cached
+// state belongs to one turn limit, which is part of the key.
+
+struct CachedBattle {
+    BattleResult result;
+    BattleState final_state;
+};
+
+class BattleService {
+    // memoizing battle runner with a fixed memory budget: a 4-way set-associative table,
+    // least recently used entry of a set is replaced; lineups of the built-in types with any specs
+    // for them, at most 15 monsters per team (the key is the lineupCode of both lineups and the turn limit)
+    public:
+        long long hits = 0; // answered from the cache without simulating
+        long long misses = 0; // first time a pair is seen (or it was evicted)
+        long long random_plays = 0; // pairs with coin flips, simulated from the cached first coin flip
+        long long turns_skipped = 0; // turns answered from the cache instead of simulated
+        long long evictions = 0;
+
+        BattleService(size_t max_entries, const vector<MonsterSpec>& type_specs = defaultSpecs()): 
+            specs(type_specs), n_sets(max<size_t>(1, max_entries / WAYS)), 
+            table(n_sets * WAYS), tick(0) {}
+
+        size_t capacity() const {return table.size();}
+        size_t memory_bytes() const {return table.size() * sizeof(Entry);}
+
+        CachedBattle play(const vector<MonsterType>& lineup1, const vector<MonsterType>& lineup2, mt19937& rng, 
+            int max_turns = MAX_TURNS) {
+            if (lineup1.size() > 15 || lineup2.size() > 15) {
+                throw invalid_argument("BattleService supports at most 15 monsters per team.");
+            }
+            // canonical key: the two lineup codes in ascending order (the rules are symmetric)
+            uint32_t code1 = lineupCode(lineup1);
+            uint32_t code2 = lineupCode(lineup2);
+            bool swapped = code1 > code2;
+            uint64_t key = swapped ? (static_cast<uint64_t>(code2) << 32 | code1) : (static_cast<uint64_t>(code1) << 32 | code2);
+
+            Entry* entry = find(key, max_turns);
+            if (entry) {
+                entry->last_used = ++tick;
+                CachedBattle cached = swapped ? swapSides(entry->value) : entry->value;
+                turns_skipped += cached.final_state.turns;
+                if (!entry->random) {
+                    hits++;
+                    return cached;
+                }
+                // resume from the first coin flip (in the caller's orientation, so the
+                // coin flips draw exactly like the other engines)
+                random_plays++;
+                playFrom(specs.data(), lineup1, lineup2, cached.final_state, rng, max_turns);
+                cached.result = stateResult(specs.data(), lineup1, lineup2, cached.final_state);
+                return cached;
+            }
+
+            misses++;
+            CachedBattle battle_result;
+            battle_result.final_state = initialState(specs.data(), lineup1, lineup2);
+            bool random = playFrom(specs.data(), lineup1, lineup2, battle_result.final_state, rng, max_turns, false, true);
+            battle_result.result = stateResult(specs.data(), lineup1, lineup2, battle_result.final_state);
+            Entry& slot = victim(key, max_turns);
+            slot.key = key;
+            slot.turn_limit = max_turns;
+            slot.random = random;
+            slot.value = swapped ? swapSides(battle_result) : battle_result; // final state, or state at the first coin flip
+            slot.last_used = ++tick;
+            if (random) {
+                playFrom(specs.data(), lineup1, lineup2, battle_result.final_state, rng, max_turns);
+                battle_result.result = stateResult(specs.data(), lineup1, lineup2, battle_result.final_state);
+            }
+            return battle_result;
+        }
+
+    private:
+        static constexpr int WAYS = 4;
+        static constexpr uint64_t EMPTY = ~0ull;
+
+        struct Entry {
+            uint64_t key = EMPTY;
+            int turn_limit = 0;
+            uint64_t last_used = 0;
+            bool random = false; // the pair reaches a coin flip: value holds the state before it
+            CachedBattle value;
+        };
+
+        vector<MonsterSpec> specs;
+        size_t n_sets;
+        vector<Entry> table;
+        uint64_t tick;
+
+        size_t setOf(uint64_t key, int turn_limit) const {
+            // splitmix64 finalizer, so neighbouring lineup codes spread over all sets
+            key ^= static_cast<uint64_t>(static_cast<uint32_t>(turn_limit)) * 0x9E3779B97F4A7C15ull;
+            key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ull;
+            key = (key ^ (key >> 27)) * 0x94D049BB133111EBull;
+            return static_cast<size_t>((key ^ (key >> 31)) % n_sets);
+        }
+
+        Entry* find(uint64_t key, int turn_limit) {
+            Entry* set = &table[setOf(key, turn_limit) * WAYS];
+            for (int way = 0; way < WAYS; way++) {
+                if (set[way].key == key && set[way].turn_limit == turn_limit) {return &set[way];}
+            }
+            return nullptr;
+        }
+
+        Entry& victim(uint64_t key, int turn_limit) {
+            // an empty way if there is one, otherwise the least recently used
+            Entry* set = &table[setOf(key, turn_limit) * WAYS];
+            Entry* oldest = &set[0];
+            for (int way = 0; way < WAYS; way++) {
+                if (set[way].key == EMPTY) {return set[way];}
+                if (set[way].last_used < oldest->last_used) {oldest = &set[way];}
+            }
+            evictions++;
+            return *oldest;
+        }
+
+        static CachedBattle swapSides(CachedBattle battle_result) {
+            BattleResult& result = battle_result.result;
+            if (result.outcome == team1_wins) {result.outcome = team2_wins;}
+            else if (result.outcome == team2_wins) {result.outcome = team1_wins;}
+            swap(result.survivors1, result.survivors2);
+            swap(result.health1, result.health2);
+            BattleState& state = battle_result.final_state;
+            swap(state.lead1, state.lead2);
+            swap(state.health1, state.health2);
+            state.stalled_orders = (state.stalled_orders & 1) << 1 | (state.stalled_orders & 2) >> 1;
+            return battle_result;
+        }
+};
+
+// lockstep lane engine
+// plays LANES independent battles at once: each stat of the two leads of every battle sits in
+// one vector (lane i = battle i), and the rules are written as compares and selects, so a turn of
+// all lanes is a few dozen vector instructions. Finished lanes are masked out and refilled with the
+// next battle; lead changes and coin flips are done per lane in scalar code.
+// AVX2 (one register) or SSE2 (two registers) when the compiler targets them, plain loops
+// otherwise (-DNO_SIMD forces the loops)
+
+constexpr int LANES = 8;
+
+#if defined(__AVX2__) && !defined(NO_SIMD)
+const char* const LANE_BACKEND = "AVX2";
+
+struct LaneVec {__m256i v;};
+
+inline LaneVec laneLoad(const int32_t* p) {return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))};}
+inline void laneStore(int32_t* p, LaneVec a) {_mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a.v);}
+inline LaneVec laneSet(int32_t x) {return {_mm256_set1_epi32(x)};}
+inline LaneVec operator+(LaneVec a, LaneVec b) {return {_mm256_add_epi32(a.v, b.v)};}
+inline LaneVec operator-(LaneVec a, LaneVec b) {return {_mm256_sub_epi32(a.v, b.v)};}
+inline LaneVec operator&(LaneVec a, LaneVec b) {return {_mm256_and_si256(a.v, b.v)};}
+inline LaneVec laneGreater(LaneVec a, LaneVec b) {return {_mm256_cmpgt_epi32(a.v, b.v)};} // all ones where a > b
+inline LaneVec laneSelect(LaneVec mask, LaneVec a, LaneVec b) {return {_mm256_blendv_epi8(b.v, a.v, mask.v)};} // a where mask
+inline LaneVec laneMin(LaneVec a, LaneVec b) {return {_mm256_min_epi32(a.v, b.v)};}
+inline LaneVec laneMax(LaneVec a, LaneVec b) {return {_mm256_max_epi32(a.v, b.v)};}
+inline LaneVec laneEqual(LaneVec a, LaneVec b) {return {_mm256_cmpeq_epi32(a.v, b.v)};}
+inline LaneVec laneAndNot(LaneVec a, LaneVec b) {return {_mm256_andnot_si256(a.v, b.v)};} // ~a & b
+inline bool laneAny(LaneVec mask) {return _mm256_movemask_epi8(mask.v) != 0;}
+inline int laneBits(LaneVec mask) {return _mm256_movemask_ps(_mm256_castsi256_ps(mask.v));} // bit i = lane i
+
+#elif defined(__SSE2__) && !defined(NO_SIMD)
+const char* const LANE_BACKEND = "SSE2";
+
+struct LaneVec {__m128i lo, hi;}; // lanes 0-3 and 4-7
+
+inline LaneVec laneLoad(const int32_t* p) {
+    return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 4))};
+}
+inline void laneStore(int32_t* p, LaneVec a) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a.lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 4), a.hi);
+}
+inline LaneVec laneSet(int32_t x) {return {_mm_set1_epi32(x), _mm_set1_epi32(x)};}
+inline LaneVec operator+(LaneVec a, LaneVec b) {return {_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)};}
+inline LaneVec operator-(LaneVec a, LaneVec b) {return {_mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi)};}
+inline LaneVec operator&(LaneVec a, LaneVec b) {return {_mm_and_si128(a.lo, b.lo), _mm_and_si128(a.hi, b.hi)};}
+inline LaneVec laneGreater(LaneVec a, LaneVec b) {return {_mm_cmpgt_epi32(a.lo, b.lo), _mm_cmpgt_epi32(a.hi, b.hi)};}
+inline LaneVec laneSelect(LaneVec mask, LaneVec a, LaneVec b) {
+    // SSE2 has no blend: (mask & a) | (~mask & b)
+    return {_mm_or_si128(_mm_and_si128(mask.lo, a.lo), _mm_andnot_si128(mask.lo, b.lo)),
+        _mm_or_si128(_mm_and_si128(mask.hi, a.hi), _mm_andnot_si128(mask.hi, b.hi))};
+}
+inline LaneVec laneMin(LaneVec a, LaneVec b) {return laneSelect(laneGreater(a, b), b, a);} // no 32-bit min before SSE4.1
+inline LaneVec laneMax(LaneVec a, LaneVec b) {return laneSelect(laneGreater(a, b), a, b);}
+inline LaneVec laneEqual(LaneVec a, LaneVec b) {return {_mm_cmpeq_epi32(a.lo, b.lo), _mm_cmpeq_epi32(a.hi, b.hi)};}
+inline LaneVec laneAndNot(LaneVec a, LaneVec b) {return {_mm_andnot_si128(a.lo, b.lo), _mm_andnot_si128(a.hi, b.hi)};}
+inline bool laneAny(LaneVec mask) {return _mm_movemask_epi8(_mm_or_si128(mask.lo, mask.hi)) != 0;}
+inline int laneBits(LaneVec mask) {
+    return _mm_movemask_ps(_mm_castsi128_ps(mask.lo)) | (_mm_movemask_ps(_mm_castsi128_ps(mask.hi)) << 4);
+}
+
+#else
+const char* const LANE_BACKEND = "scalar";
+
+struct LaneVec {int32_t v[LANES];};
+
+inline LaneVec laneLoad(const int32_t* p) {LaneVec r; copy(p, p + LANES, r.v); return r;}
+inline void laneStore(int32_t* p, LaneVec a) {copy(a.v, a.v + LANES, p);}
+inline LaneVec laneSet(int32_t x) {LaneVec r; fill(r.v, r.v + LANES, x); return r;}
+inline LaneVec operator+(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] += b.v[i];} return a;}
+inline LaneVec operator-(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] -= b.v[i];} return a;}
+inline LaneVec operator&(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] &= b.v[i];} return a;}
+inline LaneVec laneGreater(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] = a.v[i] > b.v[i] ? -1 : 0;} return a;}
+inline LaneVec laneSelect(LaneVec mask, LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] = mask.v[i] ? a.v[i] : b.v[i];} return a;}
+inline LaneVec laneMin(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] = min(a.v[i], b.v[i]);} return a;}
+inline LaneVec laneMax(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] = max(a.v[i], b.v[i]);} return a;}
+inline LaneVec laneEqual(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] = a.v[i] == b.v[i] ? -1 : 0;} return a;}
+inline LaneVec laneAndNot(LaneVec a, LaneVec b) {for (int i = 0; i < LANES; i++) {a.v[i] = ~a.v[i] & b.v[i];} return a;}
+inline bool laneAny(LaneVec mask) {for (int i = 0; i < LANES; i++) {if (mask.v[i]) {return true;}} return false;}
+inline int laneBits(LaneVec mask) {int bits = 0; for (int i = 0; i < LANES; i++) {if (mask.v[i]) {bits |= 1 << i;}} return bits;}
+#endif
+
+struct LaneSide {
+    // stats of the lead of one team in every lane
+    int32_t health[LANES];
+    int32_t max_health[LANES];
+    int32_t damage[LANES];
+    int32_t speed[LANES];
+    int32_t num_attack[LANES];
+    int32_t regen_amount[LANES];
+    int32_t block_amount[LANES];
+    int32_t reflect_amount[LANES];
+};
+
+struct LaneLeads {
+    // the same stats loaded into vectors (speed is only needed by the scalar turn order)
+    LaneVec health, max_health, damage, num_attack, regen_amount, block_amount, reflect_amount;
+
+    explicit LaneLeads(const LaneSide& side): 
+        health(laneLoad(side.health)), max_health(laneLoad(side.max_health)), damage(laneLoad(side.damage)), 
+        num_attack(laneLoad(side.num_attack)), regen_amount(laneLoad(side.regen_amount)), 
+        block_amount(laneLoad(side.block_amount)), reflect_amount(laneLoad(side.reflect_amount)) {}
+
+    // a where mask is set, b elsewhere
+    LaneLeads(LaneVec mask, const LaneLeads& a, const LaneLeads& b): 
+        health(laneSelect(mask, a.health, b.health)), max_health(laneSelect(mask, a.max_health, b.max_health)), 
+        damage(laneSelect(mask, a.damage, b.damage)), num_attack(laneSelect(mask, a.num_attack, b.num_attack)), 
+        regen_amount(laneSelect(mask, a.regen_amount, b.regen_amount)), 
+        block_amount(laneSelect(mask, a.block_amount, b.block_amount)), 
+        reflect_amount(laneSelect(mask, a.reflect_amount, b.reflect_amount)) {}
+};
+
+inline void laneAttack(LaneVec mask, LaneLeads& att, LaneLeads& def, int max_attacks) {
+    // all attacks of the attacking leads on the defending leads, in the lanes of mask
+    // (same rules as specAttack: blocked damage, reflected damage, health clamped at 0)
+    LaneVec zero = laneSet(0);
+    LaneVec dealt = laneMax(att.damage - def.block_amount, zero);
+    for (int i = 0; i < max_attacks; i++) {
+        LaneVec m = mask & laneGreater(att.num_attack, laneSet(i)) & 
+            laneGreater(att.health, zero) & laneGreater(def.health, zero);
+        if (!laneAny(m)) {break;}
+        def.health = laneSelect(m, laneMax(def.health - dealt, zero), def.health);
+        att.health = laneSelect(m, laneMax(att.health - def.reflect_amount, zero), att.health);
+    }
+}
+
+inline void laneEndTurn(LaneVec mask, LaneLeads& mon) {
+    // regeneration of the living leads below max health, capped at max health
+    LaneVec m = mask & laneGreater(mon.health, laneSet(0)) & laneGreater(mon.max_health, mon.health);
+    mon.health = laneSelect(m, laneMin(mon.health + mon.regen_amount, mon.max_health), mon.health);
+}
+
+class LaneBattles {
+    // runs a list of battles LANES at a time; lane l plays battles l, l + LANES, l + 2 * LANES, ...
+    // with its own rng seeded by seed_seq{seed, l}, so every battle can be replayed on its own
+    // with catalogBattle (or, for the built-in monsters, the Monster classes) and gives exactly the same result
+    // lineups are indices into the specs (MonsterType values for defaultSpecs, archetype ids for a catalog)
+    // stats are taken at run time, so it competes with catalogBattle, not with the compiled matchup kernels;
+    // it only pays off with AVX2 and long battles: short battles spend their time in the scalar lead changes
+    // (see --bench-lanes)
+    public:
+        LaneBattles(const vector<MonsterSpec>& type_specs = defaultSpecs(), int max_turns = MAX_TURNS): 
+            specs(type_specs), turn_limit(max_turns), max_attacks(0) {
+            for (const auto& spec : specs) {max_attacks = max(max_attacks, spec.num_attack);}
+        }
+
+        vector<BattleResult> run(const vector<pair<vector<int>, vector<int>>>& battles, uint32_t seed) {
+            vector<BattleResult> results(battles.size());
+            int n = battles.size();
+            mt19937 rngs[LANES];
+            for (int l = 0; l < LANES; l++) {
+                seed_seq seq{seed, static_cast<uint32_t>(l)};
+                rngs[l].seed(seq);
+                battle_of[l] = l;
+                active[l] = 0;
+                if (l < n) {start(l, battles[l]);}
+            }
+            int n_active = min(n, LANES);
+
+            LaneVec zero = laneSet(0);
+            LaneVec limit = laneSet(turn_limit > 0 ? turn_limit : numeric_limits<int32_t>::max());
+            while (n_active > 0) {
+                // turn order: the faster lead first, coin flips (per lane) on speed ties
+                LaneVec mask = laneLoad(active);
+                LaneVec speed1 = laneLoad(side1.speed);
+                LaneVec speed2 = laneLoad(side2.speed);
+                LaneVec first = laneGreater(speed1, speed2);
+                int ties = laneBits(mask & laneEqual(speed1, speed2));
+                if (ties) {
+                    laneStore(team1_first, first);
+                    for (int l = 0; l < LANES; l++) {
+                        if (!(ties >> l & 1)) {continue;}
+                        uniform_int_distribution<int> dist(0, 1);
+                        team1_first[l] = dist(rngs[l]) == 0 ? -1 : 0;
+                    }
+                    first = laneLoad(team1_first);
+                }
+                laneStore(team1_first, first);
+
+                // one turn of every lane
+                LaneLeads leads1(side1);
+                LaneLeads leads2(side2);
+                LaneLeads faster(first, leads1, leads2);
+                LaneLeads slower(first, leads2, leads1);
+                laneAttack(mask, faster, slower, max_attacks);
+                laneEndTurn(mask, faster);
+                LaneVec slower_alive = mask & laneGreater(slower.health, zero);
+                laneAttack(slower_alive, slower, faster, max_attacks);
+                laneEndTurn(slower_alive, slower);
+                LaneVec health1 = laneSelect(first, faster.health, slower.health);
+                LaneVec health2 = laneSelect(first, slower.health, faster.health);
+                LaneVec turns = laneLoad(n_turns) - mask; // mask is -1 in active lanes
+                laneStore(n_turns, turns);
+
+                // lanes where nothing happens but damage go on without any scalar work:
+                // both leads alive, some health changed, turn limit not reached
+                LaneVec both_alive = laneGreater(health1, zero) & laneGreater(health2, zero);
+                LaneVec stalled = both_alive & laneEqual(health1, leads1.health) & laneEqual(health2, leads2.health);
+                LaneVec calm = laneAndNot(stalled, both_alive) & laneGreater(limit, turns);
+                laneStore(stalled_orders, laneAndNot(calm, laneLoad(stalled_orders)));
+                laneStore(is_stalled, stalled);
+                laneStore(side1.health, health1);
+                laneStore(side2.health, health2);
+
+                // lead changes, stalemates and finished battles, per lane
+                int eventful = laneBits(laneAndNot(calm, mask));
+                for (int l = 0; l < LANES; l++) {
+                    if (!(eventful >> l & 1)) {continue;}
+                    if (!finish_turn(l)) {continue;}
+                    results[battle_of[l]] = BattleResult{outcome[l], n_turns[l]};
+                    battle_of[l] += LANES;
+                    if (battle_of[l] < n) {
+                        start(l, battles[battle_of[l]]);
+                    } else {
+                        active[l] = 0;
+                        n_active--;
+                    }
+                }
+            }
+            return results;
+        }
+
+    private:
+        vector<MonsterSpec> specs;
+        int turn_limit;
+        int max_attacks; // most attacks any type makes in a turn
+        LaneSide side1;
+        LaneSide side2;
+        int32_t active[LANES]; // -1 while the lane plays a battle
+        int32_t team1_first[LANES]; // -1 if team1's lead went first this turn
+        int32_t n_turns[LANES]; // turns played by the lane's battle
+        int32_t is_stalled[LANES]; // -1 if the last turn changed nothing
+        int32_t stalled_orders[LANES]; // as in battle()
+        int battle_of[LANES]; // battle played by each lane
+        const vector<int>* lineup1[LANES];
+        const vector<int>* lineup2[LANES];
+        int lead1[LANES];
+        int lead2[LANES];
+        BattleOutcome outcome[LANES];
+
+        void set_lead(LaneSide& side, int l, int id) {
+            const MonsterSpec& spec = specs[id];
+            side.health[l] = spec.max_health;
+            side.max_health[l] = spec.max_health;
+            side.damage[l] = spec.damage;
+            side.speed[l] = spec.speed;
+            side.num_attack[l] = spec.num_attack;
+            side.regen_amount[l] = spec.regen_amount;
+            side.block_amount[l] = spec.block_amount;
+            side.reflect_amount[l] = spec.reflect_amount;
+        }
+
+        void start(int l, const pair<vector<int>, vector<int>>& battle) {
+            lineup1[l] = &battle.first;
+            lineup2[l] = &battle.second;
+            lead1[l] = 0;
+            lead2[l] = 0;
+            set_lead(side1, l, battle.first[0]);
+            set_lead(side2, l, battle.second[0]);
+            stalled_orders[l] = 0;
+            n_turns[l] = 0;
+            active[l] = -1;
+        }
+
+        bool finish_turn(int l) {
+            // bookkeeping after a turn in which a lead died, nothing changed or the turn limit
+            // was reached, same as battle(); true once the lane's battle is over
+            bool lead1_alive = side1.health[l] > 0;
+            bool lead2_alive = side2.health[l] > 0;
+            if (!lead1_alive && ++lead1[l] < static_cast<int>(lineup1[l]->size())) {set_lead(side1, l, (*lineup1[l])[lead1[l]]);}
+            if (!lead2_alive && ++lead2[l] < static_cast<int>(lineup2[l]->size())) {set_lead(side2, l, (*lineup2[l])[lead2[l]]);}
+            bool defeated1 = lead1[l] >= static_cast<int>(lineup1[l]->size());
+            bool defeated2 = lead2[l] >= static_cast<int>(lineup2[l]->size());
+            if (defeated1 && defeated2) {outcome[l] = tied; return true;}
+            if (defeated1) {outcome[l] = team2_wins; return true;}
+            if (defeated2) {outcome[l] = team1_wins; return true;}
+            if (is_stalled[l]) {
+                stalled_orders[l] |= team1_first[l] ? 1 : 2;
+                if (side1.speed[l] != side2.speed[l] || stalled_orders[l] == 3) {
+                    outcome[l] = stalemate;
+                    return true;
+                }
+            } else {
+                stalled_orders[l] = 0;
+            }
+            if (turn_limit > 0 && n_turns[l] >= turn_limit) {outcome[l] = unfinished; return true;}
+            return false;
+        }
+};
+
+// binary battle recording
+// a compact record of battles: one op byte per event (event type, side, one flag) followed by
+// the numbers of the event as varints, so a turn takes about a dozen bytes instead of hundreds of
+// bytes of coloured text. Every few turns a keyframe stores the state of both teams (index and
+// health of the lead; the monsters behind it are untouched), so a replay can start at any turn.
+// BattleLog replays a recording as the same coloured text TextSink prints.
+
+enum RecordOp {start_op, turn_op, attack_op, regen_op, death_op, defeat_op, end_op, keyframe_op};
+// op byte: bits 0-2 RecordOp, bit 3 side (0: team1, 1: team2), bit 4 flag (reflected / capped)
+
+const char BATTLE_LOG_MAGIC[4] = {'M', 'A', 'B', '1'};
+
+class BattleRecorder: public EventSink {
+    // writes the events of battles as a binary recording
+    public:
+        BattleRecorder(ostream& output, int keyframe_every = 16, size_t flush_size = 1 << 16): 
+            out(&output), keyframe_interval(keyframe_every), block_size(flush_size), n_written(0) {
+            buffer.append(BATTLE_LOG_MAGIC, 4);
+        }
+
+        // take-only: no stream at all, the bytes stay buffered until take() hands them over
+        explicit BattleRecorder(int keyframe_every): 
+            out(nullptr), keyframe_interval(keyframe_every), block_size(numeric_limits<size_t>::max()), n_written(0) {
+            buffer.append(BATTLE_LOG_MAGIC, 4);
+        }
+
+        ~BattleRecorder() {flush();}
+
+        // write everything buffered so far
+        void flush() {
+            if (!out) {return;}
+            write();
+            out->flush();
+        }
+
+        // bytes recorded so far
+        long long size() const {return n_written + buffer.size();}
+
+        // move the bytes recorded so far to the end of bytes instead of writing them (for streaming)
+        void take(string& bytes) {
+            bytes += buffer;
+            n_written += buffer.size();
+            buffer.clear();
+        }
+
+        void on_event(const BattleEvent& event) override {
+            PROFILE_PHASE(phase_formatting);
+            switch (event.type) {
+                case battle_start_event:
+                    team1 = event.team1;
+                    n_dead[0] = n_dead[1] = 0;
+                    buffer += static_cast<char>(start_op);
+                    put_string(event.team1->name);
+                    put_string(event.team2->name);
+                    put_varint(event.team1->n_monsters);
+                    put_varint(event.team2->n_monsters);
+                    for (const Team* team : {event.team1, event.team2}) {
+                        for (auto mon : team->monsters) {
+                            buffer += static_cast<char>(mon->type);
+                            put_varint(mon->name_id);
+                            put_varint(mon->health);
+                        }
+                    }
+                    break;
+                case turn_start_event:
+                    lead1 = event.actor;
+                    if ((event.turn_idx - 1) % keyframe_interval == 0) {
+                        buffer += static_cast<char>(keyframe_op);
+                        put_varint(event.turn_idx);
+                        put_varint(n_dead[0]);
+                        put_varint(event.actor->health);
+                        put_varint(n_dead[1]);
+                        put_varint(event.target->health);
+                    }
+                    buffer += static_cast<char>(turn_op);
+                    break;
+                case attack_event:
+                    put_op(attack_op, side(event.actor), event.reflected_damage != -1);
+                    put_varint(event.attempted_damage);
+                    put_varint(event.actual_damage);
+                    if (event.reflected_damage != -1) {put_varint(event.reflected_damage);}
+                    break;
+                case regen_event:
+                    put_op(regen_op, side(event.actor), event.regen_capped);
+                    put_varint(event.regen_amount);
+                    break;
+                case death_event:
+                    put_op(death_op, side(event.actor), false);
+                    n_dead[side(event.actor)]++;
+                    break;
+                case defeat_event:
+                    put_op(defeat_op, event.team1 == team1 ? 0 : 1, false);
+                    break;
+                case battle_end_event:
+                    buffer += static_cast<char>(end_op);
+                    buffer += static_cast<char>(event.outcome);
+                    put_varint(event.turn_idx);
+                    break;
+                default: break;
+            }
+            if (buffer.size() >= block_size && out) {write();}
+        }
+
+    private:
+        ostream* out; // nullptr if take-only
+        int keyframe_interval; // turns between keyframes
+        size_t block_size;
+        long long n_written;
+        string buffer;
+        const Team* team1 = nullptr;
+        const Monster* lead1 = nullptr; // team1's lead of the current turn
+        int n_dead[2] = {0, 0}; // dead monsters of each team (= index of the lead, only leads die)
+
+        int side(const Monster* mon) const {return mon == lead1 ? 0 : 1;}
+
+        void put_op(RecordOp op, int side, bool flag) {
+            buffer += static_cast<char>(op | side << 3 | (flag ? 1 << 4 : 0));
+        }
+
+        void put_varint(uint32_t value) {
+            // 7 bits per byte, high bit set on all but the last byte
+            while (value >= 0x80) {
+                buffer += static_cast<char>(value | 0x80);
+                value >>= 7;
+            }
+            buffer += static_cast<char>(value);
+        }
+
+        void put_string(const string& text) {
+            put_varint(text.size());
+            buffer += text;
+        }
+
+        void write() {
+            PROFILE_PHASE(phase_output);
+            out->write(buffer.data(), buffer.size());
+            n_written += buffer.size();
+            buffer.clear();
+        }
+};
+
+class BattleLog {
+    // a binary recording loaded into memory; one scan on load indexes the battles and keyframes
+    public:
+        explicit BattleLog(string bytes): data(std::move(bytes)) {
+            if (data.size() < 4 || data.compare(0, 4, BATTLE_LOG_MAGIC, 4) != 0) {
+                throw runtime_error("Not a battle recording.");
+            }
+            size_t pos = 4;
+            while (pos < data.size()) {
+                size_t op_pos = pos;
+                int op = static_cast<uint8_t>(data[pos++]);
+                if ((op & 7) != start_op && battles.empty()) {throw runtime_error("Corrupt battle recording.");}
+                switch (op & 7) {
+                    case start_op: {
+                        battles.push_back(BattleIndex{op_pos, 0, {}});
+                        skip(pos, read_varint(pos));
+                        skip(pos, read_varint(pos));
+                        size_t n_monsters = read_count(pos);
+                        n_monsters += read_count(pos);
+                        for (size_t i = 0; i < n_monsters; i++) {
+                            read_type(pos);
+                            read_name_id(pos);
+                            read_varint(pos);
+                        }
+                        break;
+                    }
+                    case attack_op:
+                        read_varint(pos);
+                        read_varint(pos);
+                        if (op & 16) {read_varint(pos);}
+                        break;
+                    case regen_op: read_varint(pos); break;
+                    case end_op:
+                        read_outcome(pos);
+                        battles.back().turns = read_varint(pos);
+                        break;
+                    case keyframe_op:
+                        battles.back().keyframes.emplace_back(read_varint(pos), op_pos);
+                        for (int i = 0; i < 4; i++) {read_varint(pos);}
+                        break;
+                    default: break; // turn, death, defeat: no payload
+                }
+            }
+        }
+
+        static BattleLog load(const string& path) {
+            ifstream file(path, ios::binary);
+            if (!file) {throw runtime_error("Cannot open " + path + ".");}
+            ostringstream bytes;
+            bytes << file.rdbuf();
+            return BattleLog(bytes.str());
+        }
+
+        int n_battles() const {return battles.size();}
+
+        int n_turns(int battle_idx) const {return battles.at(battle_idx).turns;}
+
+        // render a battle as the coloured text of TextSink: from_turn > 1 jumps to the last keyframe
+        // before that turn and starts the text there, to_turn > 0 stops after that turn
+        void render(int battle_idx, TextRenderer& renderer, int from_turn = 0, int to_turn = 0) const {
+            PROFILE_PHASE(phase_formatting);
+            const BattleIndex& battle = battles.at(battle_idx);
+            size_t pos = battle.start + 1;
+            ReplayTeam teams[2];
+            for (auto& team : teams) {
+                team.name_size = read_varint(pos);
+                size_t name_pos = pos;
+                skip(pos, team.name_size);
+                team.team_id = internTeamName(data.substr(name_pos, team.name_size));
+            }
+            for (auto& team : teams) {team.members.resize(read_count(pos));}
+            for (auto& team : teams) {
+                for (auto& mon : team.members) {
+                    mon.type = read_type(pos);
+                    mon.name_id = read_name_id(pos);
+                    mon.health = read_varint(pos);
+                    mon.team_id = team.team_id;
+                }
+            }
+
+            ActionLog start(battle_start_event);
+            start.team1_id = teams[0].team_id;
+            start.team2_id = teams[1].team_id;
+            start.n_team1 = teams[0].members.size();
+            start.n_team2 = teams[1].members.size();
+            renderer.render(start);
+            bool show = from_turn <= 1;
+            if (show) {
+                for (auto& team : teams) {
+                    for (auto& mon : team.members) {
+                        ActionLog member(lineup_event);
+                        member.actor = mon;
+                        renderer.render(member);
+                    }
+                }
+            } else {
+                for (const auto& keyframe : battle.keyframes) {
+                    if (keyframe.first > from_turn) {break;}
+                    pos = keyframe.second;
+                }
+            }
+
+            int turn_idx = 0;
+            while (pos < data.size()) {
+                int op = read_byte(pos);
+                ReplayTeam& team = teams[op >> 3 & 1];
+                ReplayTeam& other = teams[1 - (op >> 3 & 1)];
+                bool flag = op & 16;
+                ActionLog record;
+                switch (op & 7) {
+                    case start_op: return;
+                    case keyframe_op:
+                        turn_idx = read_varint(pos) - 1;
+                        for (auto& t : teams) {
+                            t.lead = read_varint(pos);
+                            t.lead_monster().health = read_varint(pos);
+                        }
+                        continue;
+                    case turn_op:
+                        if (++turn_idx > to_turn && to_turn > 0) {return;}
+                        show = show || turn_idx >= from_turn;
+                        for (auto& t : teams) {
+                            // dead monsters are always in front of the lead
+                            while (t.lead < static_cast<int>(t.members.size()) - 1 && t.members[t.lead].health <= 0) {t.lead++;}
+                        }
+                        record.type = turn_start_event;
+                        record.turn_idx = turn_idx;
+                        record.actor = teams[0].lead_record();
+                        record.target = teams[1].lead_record();
+                        break;
+                    case attack_op:
+                        record.type = attack_event;
+                        record.attempted_damage = read_varint(pos);
+                        record.actual_damage = read_varint(pos);
+                        record.reflected_damage = flag ? static_cast<int>(read_varint(pos)) : -1;
+                        other.lead_monster().health -= record.actual_damage;
+                        if (flag) {team.lead_monster().health -= record.reflected_damage;}
+                        record.actor = team.lead_record();
+                        record.target = other.lead_record();
+                        break;
+                    case regen_op:
+                        record.type = regen_event;
+                        record.regen_amount = read_varint(pos);
+                        record.regen_capped = flag;
+                        team.lead_monster().health += record.regen_amount;
+                        record.actor = team.lead_record();
+                        break;
+                    case death_op:
+                        record.type = death_event;
+                        record.actor = team.lead_record();
+                        break;
+                    case defeat_op:
+                        record.type = defeat_event;
+                        record.team1_id = team.team_id;
+                        break;
+                    case end_op: {
+                        record.type = battle_end_event;
+                        record.outcome = read_outcome(pos);
+                        record.turn_idx = read_varint(pos);
+                        record.team1_id = teams[0].team_id;
+                        record.team2_id = teams[1].team_id;
+                        record.team1_defeated = record.outcome == team2_wins || record.outcome == tied;
+                        record.team2_defeated = record.outcome == team1_wins || record.outcome == tied;
+                        if (show) {renderer.render(record);}
+                        return;
+                    }
+                }
+                if (show) {
+                    renderer.render(record);
+                    renderer.write_if_full();
+                }
+            }
+        }
+
+    private:
+        struct BattleIndex {
+            size_t start; // offset of the battle's start op
+            int turns;
+            vector<pair<int, size_t>> keyframes; // (turn, offset of the keyframe op)
+        };
+
+        struct ReplayTeam {
+            int name_size = 0;
+            int team_id = -1;
+            int lead = 0;
+            vector<MonsterRecord> members;
+
+            // the lead comes from the recording, so it is checked like every other byte of it
+            MonsterRecord& lead_monster() {
+                if (lead < 0 || lead >= static_cast<int>(members.size())) {throw runtime_error("Corrupt battle recording.");}
+                return members[lead];
+            }
+
+            MonsterRecord lead_record() {return lead_monster();}
+        };
+
+        string data;
+        vector<BattleIndex> battles;
+
+        uint32_t read_varint(size_t& pos) const {
+            uint32_t value = 0;
+            for (int shift = 0; ; shift += 7) {
+                if (pos >= data.size() || shift > 28) {throw runtime_error("Corrupt battle recording.");}
+                uint8_t byte = data[pos++];
+                value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {return value;}
+            }
+        }
+
+        uint8_t read_byte(size_t& pos) const {
+            if (pos >= data.size()) {throw runtime_error("Corrupt battle recording.");}
+            return data[pos++];
+        }
+
+        void skip(size_t& pos, size_t n_bytes) const {
+            if (n_bytes > data.size() - pos) {throw runtime_error("Corrupt battle recording.");}
+            pos += n_bytes;
+        }
+
+        size_t read_count(size_t& pos) const {
+            // number of monsters of a team: every monster takes at least 3 bytes
+            size_t n = read_varint(pos);
+            if (n > (data.size() - pos) / 3) {throw runtime_error("Corrupt battle recording.");}
+            return n;
+        }
+
+        MonsterType read_type(size_t& pos) const {
+            uint8_t type = read_byte(pos);
+            if (type >= N_MONSTER_TYPES) {throw runtime_error("Corrupt battle recording.");}
+            return static_cast<MonsterType>(type);
+        }
+
+        int read_name_id(size_t& pos) const {
+            uint32_t name_id = read_varint(pos);
+            if (name_id > static_cast<uint32_t>(numeric_limits<int>::max())) {throw runtime_error("Corrupt battle recording.");}
+            return name_id;
+        }
+
+        BattleOutcome read_outcome(size_t& pos) const {
+            uint8_t outcome = read_byte(pos);
+            if (outcome >= N_OUTCOMES) {throw runtime_error("Corrupt battle recording.");}
+            return static_cast<BattleOutcome>(outcome);
+        }
+};
+
+// battle host
+// plays many battles at once, one turn at a time: every match is a BattleSteps with its own teams and
+// recording, and a small pool of workers takes turns round robin from one run queue, so a long battle never
+// holds up the others. At most max_active matches are in play and later submissions wait for a free slot,
+// so a turn never waits behind more than max_active other turns, whatever the load.
+// The output of a match is its binary recording (see BattleRecorder), handed over turn by turn.
+// BattleServer puts a host on a loopback TCP port. Protocol, one text line per request:
+//   "<lineup1> <lineup2>" (letters, e.g. "GTO OOT")  ->  "M <match_id>", then after every turn
+//   "E <match_id> <n_bytes>" and n_bytes of recording (all of them together: a recording of one battle,
+//   see --play), and at the end "R <match_id> <outcome> <turns> <survivors1> <survivors2>"
+//   "STATS"  ->  "S turns <n> active <n> waiting <n> turn_latency_us p50 <t> p99 <t> p99.9 <t> max <t>"
+//   bad requests  ->  "X <message>"
+
+class LatencyHistogram {
+    // latencies in nanoseconds, in log-linear buckets (8 per power of two, so percentiles are within 12.5%)
+    public:
+        LatencyHistogram(): buckets(N_BUCKETS, 0) {}
+
+        void add(long long ns) {
+            buckets[bucket(max(ns, 0ll))]++;
+            n++;
+            max_ns = max(max_ns, ns);
+        }
+
+        void merge(const LatencyHistogram& other) {
+            for (int i = 0; i < N_BUCKETS; i++) {buckets[i] += other.buckets[i];}
+            n += other.n;
+            max_ns = max(max_ns, other.max_ns);
+        }
+
+        long long count() const {return n;}
+
+        // upper edge of the bucket holding the q quantile (0 - 1)
+        long long percentile(double q) const {
+            long long rank = max(1ll, static_cast<long long>(q * n + 0.5));
+            long long seen = 0;
+            for (int i = 0; i < N_BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen >= rank) {return min(upper(i), max_ns);}
+            }
+            return max_ns;
+        }
+
+    private:
+        static constexpr int N_BUCKETS = 64 * 8;
+        vector<long long> buckets;
+        long long n = 0;
+        long long max_ns = 0;
+
+        static int bucket(long long ns) {
+            if (ns < 8) {return static_cast<int>(ns);}
+            int msb = 3;
+            while (ns >> (msb + 1)) {msb++;}
+            return (msb - 2) * 8 + static_cast<int>((ns >> (msb - 3)) & 7);
+        }
+
+        static long long upper(int idx) {
+            if (idx < 8) {return idx;}
+            int msb = idx / 8 + 2;
+            return ((8ll + idx % 8 + 1) << (msb - 3)) - 1;
+        }
+};
+
+class BattleHost {
+    public:
+        // called on a worker after every turn of a match with the recording of the turn,
+        // and with the result once the match is over (nullptr before)
+        using Output = function<void(int client, long long match_id, const string& bytes, const BattleResult* result)>;
+
+        BattleHost(Output output_fn, int n_threads, int max_active, uint64_t seed): 
+            output(std::move(output_fn)), active_limit(max(1, max_active)), rng_seed(seed) {
+            for (int w = 0; w < max(1, n_threads); w++) {worker_stats.emplace_back();}
+            for (int w = 0; w < max(1, n_threads); w++) {workers.emplace_back(&BattleHost::work, this, w);}
+        }
+
+        ~BattleHost() {
+            {
+                lock_guard<mutex> lock(m);
+                stopping = true;
+            }
+            work_ready.notify_all();
+            for (auto& t : workers) {t.join();}
+        }
+
+        // queue a match and return its id; it plays with CounterRng(seed, id) once a slot is free
+        long long submit(int client, const vector<MonsterType>& lineup1, const vector<MonsterType>& lineup2) {
+            lock_guard<mutex> lock(m);
+            unique_ptr<HostedMatch> match(new HostedMatch(next_id++, client, lineup1, lineup2, rng_seed));
+            long long id = match->id;
+            waiting.push_back(std::move(match));
+            admit();
+            return id;
+        }
+
+        // block until every submitted match is over
+        void wait_idle() {
+            unique_lock<mutex> lock(m);
+            idle.wait(lock, [this]() {return n_active == 0 && waiting.empty();});
+        }
+
+        LatencyHistogram turn_latency() {
+            LatencyHistogram total;
+            for (auto& stats : worker_stats) {
+                lock_guard<mutex> lock(stats.m);
+                total.merge(stats.latency);
+            }
+            return total;
+        }
+
+        string stats() {
+            LatencyHistogram latency = turn_latency();
+            ostringstream text;
+            lock_guard<mutex> lock(m);
+            text << "turns " << n_turns << " active " << n_active << " waiting " << waiting.size() << 
+                " turn_latency_us p50 " << latency.percentile(0.5) / 1000.0 << " p99 " << latency.percentile(0.99) / 1000.0 << 
+                " p99.9 " << latency.percentile(0.999) / 1000.0 << " max " << latency.percentile(1.0) / 1000.0;
+            return text.str();
+        }
+
+    private:
+        struct HostedMatch {
+            long long id;
+            int client;
+            vector<MonsterType> lineup1;
+            vector<MonsterType> lineup2;
+            CounterRng rng;
+            unique_ptr<Team> team1;
+            unique_ptr<Team> team2;
+            unique_ptr<BattleRecorder> recorder;
+            unique_ptr<BattleSteps> steps; // null until the first turn
+            chrono::steady_clock::time_point ready; // when its next turn was queued
+
+            HostedMatch(long long match_id, int client_id, const vector<MonsterType>& l1, const vector<MonsterType>& l2, 
+                uint64_t seed): id(match_id), client(client_id), lineup1(l1), lineup2(l2), rng(seed, match_id) {}
+        };
+
+        struct WorkerStats {
+            mutex m;
+            LatencyHistogram latency; // from queueing a turn to its output being handed over
+        };
+
+        Output output;
+        int active_limit;
+        uint64_t rng_seed;
+        mutex m; // guards everything below
+        condition_variable work_ready;
+        condition_variable idle;
+        deque<unique_ptr<HostedMatch>> run_queue; // matches whose next turn is ready
+        deque<unique_ptr<HostedMatch>> waiting; // submitted, waiting for a slot
+        int n_active = 0; // matches admitted and not over
+        long long next_id = 0;
+        long long n_turns = 0;
+        bool stopping = false;
+        deque<WorkerStats> worker_stats; // deque: WorkerStats cannot move
+        vector<thread> workers;
+
+        void admit() {
+            // with m held
+            while (n_active < active_limit && !waiting.empty()) {
+                waiting.front()->ready = chrono::steady_clock::now();
+                run_queue.push_back(std::move(waiting.front()));
+                waiting.pop_front();
+                n_active++;
+                work_ready.notify_one();
+            }
+        }
+
+        void start(HostedMatch& match) {
+            NamePool namepool;
+            namepool.shuffle_names(match.rng); // the turns seek their own streams, see rngAtTurn
+            vector<unique_ptr<Monster>> monsters1, monsters2;
+            for (MonsterType type : match.lineup1) {monsters1.push_back(getMonster(type, namepool));}
+            for (MonsterType type : match.lineup2) {monsters2.push_back(getMonster(type, namepool));}
+            match.team1.reset(new Team("Red", std::move(monsters1)));
+            match.team2.reset(new Team("Blue", std::move(monsters2)));
+            match.recorder.reset(new BattleRecorder(16));
+            match.steps.reset(new BattleSteps(*match.team1, *match.team2, *match.recorder));
+        }
+
+        void work(int worker) {
+            string bytes;
+            unique_lock<mutex> lock(m);
+            while (true) {
+                work_ready.wait(lock, [this]() {return stopping || !run_queue.empty();});
+                if (stopping) {return;}
+                unique_ptr<HostedMatch> match = std::move(run_queue.front());
+                run_queue.pop_front();
+                lock.unlock();
+
+                if (!match->steps) {start(*match);}
+                bool more = match->steps->step(match->rng);
+                bytes.clear();
+                match->recorder->take(bytes);
+                output(match->client, match->id, bytes, more ? nullptr : &match->steps->result());
+                auto now = chrono::steady_clock::now();
+                {
+                    lock_guard<mutex> stats_lock(worker_stats[worker].m);
+                    worker_stats[worker].latency.add(chrono::duration_cast<chrono::nanoseconds>(now - match->ready).count());
+                }
+                if (!more) {match.reset();}
+
+                lock.lock();
+                n_turns++;
+                if (more) {
+                    match->ready = now;
+                    run_queue.push_back(std::move(match));
+                } else {
+                    n_active--;
+                    admit();
+                    if (n_active == 0 && waiting.empty()) {idle.notify_all();}
+                }
+            }
+        }
+};
+
+#ifndef _WIN32
+class BattleServer {
+    // a BattleHost on 127.0.0.1: one thread runs a poll() loop that accepts clients, reads their requests
+    // and writes the output the workers queue for each client (protocol above)
+    public:
+        BattleServer(int port, int n_threads, int max_active, uint64_t seed): 
+            host([this](int client, long long id, const string& bytes, const BattleResult* result) {
+                queue_output(client, id, bytes, result);
+            }, n_threads, max_active, seed) {
+            if (pipe(wake_fds) != 0) {throw runtime_error("Cannot create the wake-up pipe.");}
+            set_nonblocking(wake_fds[0]);
+            set_nonblocking(wake_fds[1]);
+            listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            int on = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            socklen_t length = sizeof(address);
+            if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || 
+                listen(listen_fd, 128) != 0 || getsockname(listen_fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+                throw runtime_error("Cannot listen on 127.0.0.1:" + to_string(port) + ".");
+            }
+            set_nonblocking(listen_fd);
+            bound_port = ntohs(address.sin_port);
+        }
+
+        ~BattleServer() {
+            for (auto& client : clients) {close(client.second.fd);}
+            close(listen_fd);
+            close(wake_fds[0]);
+            close(wake_fds[1]);
+        }
+
+        int port() const {return bound_port;}
+
+        BattleHost& battle_host() {return host;}
+
+        // serve until stop is set (checked at least every 100 ms)
+        void run(const atomic<bool>& stop) {
+            vector<pollfd> fds;
+            vector<int> ids;
+            char chunk[1 << 14];
+            while (!stop) {
+                fds.assign({{listen_fd, POLLIN, 0}, {wake_fds[0], POLLIN, 0}});
+                ids.assign(2, -1);
+                {
+                    lock_guard<mutex> lock(m);
+                    for (auto& client : clients) {
+                        fds.push_back({client.second.fd, static_cast<short>(POLLIN | (client.second.out.empty() ? 0 : POLLOUT)), 0});
+                        ids.push_back(client.first);
+                    }
+                }
+                if (poll(fds.data(), fds.size(), 100) <= 0) {continue;}
+                if (fds[1].revents & POLLIN) {
+                    while (read(wake_fds[0], chunk, sizeof(chunk)) > 0) {}
+                }
+                if (fds[0].revents & POLLIN) {
+                    int fd;
+                    while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+                        set_nonblocking(fd);
+                        int on = 1;
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                        lock_guard<mutex> lock(m);
+                        clients[next_client++].fd = fd;
+                    }
+                }
+                for (size_t i = 2; i < fds.size(); i++) {
+                    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                        ssize_t n = recv(fds[i].fd, chunk, sizeof(chunk), 0);
+                        if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+                            drop(ids[i]);
+                            continue;
+                        }
+                        if (n > 0) {handle_input(ids[i], string(chunk, n));}
+                    }
+                    if (fds[i].revents & POLLOUT) {send_output(ids[i]);}
+                }
+            }
+        }
+
+    private:
+        struct Client {
+            int fd = -1;
+            string in; // partial request line
+            string out; // waiting to be sent
+            string held; // output of matches queued while requests are being answered (see handle_input)
+            bool replying = false;
+        };
+
+        int listen_fd = -1;
+        int wake_fds[2] = {-1, -1};
+        int bound_port = 0;
+        mutex m; // guards clients
+        map<int, Client> clients;
+        int next_client = 0;
+        BattleHost host; // last, so the workers stop before the rest goes away
+
+        static void set_nonblocking(int fd) {fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);}
+
+        void wake() {
+            char byte = 0;
+            if (write(wake_fds[1], &byte, 1) < 0) {} // a full pipe already wakes the loop
+        }
+
+        void queue_output(int client_id, long long match_id, const string& bytes, const BattleResult* result) {
+            static const char* outcome_names[N_OUTCOMES] = {"team1", "team2", "tie", "unfinished", "stalemate"};
+            lock_guard<mutex> lock(m);
+            auto found = clients.find(client_id);
+            if (found == clients.end()) {return;} // the client has left
+            Client& client = found->second;
+            string& out = client.replying ? client.held : client.out;
+            bool was_empty = client.out.empty() && !client.replying;
+            if (!bytes.empty()) {
+                out += "E " + to_string(match_id) + " " + to_string(bytes.size()) + "\n";
+                out += bytes;
+            }
+            if (result) {
+                out += "R " + to_string(match_id) + " " + outcome_names[result->outcome] + " " + to_string(result->turns) + 
+                    " " + to_string(result->survivors1) + " " + to_string(result->survivors2) + "\n";
+            }
+            if (was_empty) {wake();}
+        }
+
+        void handle_input(int client_id, const string& data) {
+            // the host is called without holding m, so neither the poll loop nor the workers handing over
+            // output wait for it; meanwhile the client's output is held back, so that "M <id>" still goes
+            // out before anything of that match
+            vector<string> lines;
+            {
+                lock_guard<mutex> lock(m);
+                auto found = clients.find(client_id);
+                if (found == clients.end()) {return;}
+                Client& client = found->second;
+                client.in += data;
+                size_t line_end;
+                while ((line_end = client.in.find('\n')) != string::npos) {
+                    string line = client.in.substr(0, line_end);
+                    client.in.erase(0, line_end + 1);
+                    if (!line.empty() && line.back() == '\r') {line.pop_back();}
+                    if (!line.empty()) {lines.push_back(line);}
+                }
+                if (lines.empty()) {return;}
+                client.replying = true;
+            }
+            string replies;
+            for (const string& line : lines) {
+                if (line == "STATS") {
+                    replies += "S " + host.stats() + "\n";
+                    continue;
+                }
+                istringstream words(line);
+                string text1, text2;
+                try {
+                    if (!(words >> text1 >> text2)) {throw invalid_argument("Expected two lineups, e.g. GTO OOT");}
+                    vector<MonsterType> lineup1 = parseLineup(text1);
+                    vector<MonsterType> lineup2 = parseLineup(text2);
+                    replies += "M " + to_string(host.submit(client_id, lineup1, lineup2)) + "\n";
+                } catch (const invalid_argument& e) {
+                    replies += "X " + string(e.what()) + "\n";
+                }
+            }
+            lock_guard<mutex> lock(m);
+            auto found = clients.find(client_id);
+            if (found == clients.end()) {return;}
+            Client& client = found->second;
+            client.out += replies;
+            client.out += client.held;
+            client.held.clear();
+            client.replying = false;
+            send_locked(client);
+        }
+
+        void send_output(int client_id) {
+            lock_guard<mutex> lock(m);
+            auto found = clients.find(client_id);
+            if (found != clients.end()) {send_locked(found->second);}
+        }
+
+        void send_locked(Client& client) {
+            while (!client.out.empty()) {
+                ssize_t n = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+                if (n <= 0) {return;} // full (or gone, which the next recv notices)
+                client.out.erase(0, n);
+            }
+        }
+
+        void drop(int client_id) {
+            lock_guard<mutex> lock(m);
+            auto found = clients.find(client_id);
+            if (found == clients.end()) {return;}
+            close(found->second.fd);
+            clients.erase(found); // its matches still play, their output is dropped
+        }
+};
+#endif
+
+// round-robin league
+// every pair of lineups plays n_games battles through makeBattle, swapping sides every game; battle g of
+// the pair (i, j), i > j, draws from CounterRng(seed, (i * (i - 1) / 2 + j) * n_games + g), so the pairs of
+// the first teams keep their battles when more teams are added. the triangle of pairs is cut into square
+// blocks that touch only 2 * BLOCK lineups each; waves of blocks are played over all cores and then folded
+// into Glicko ratings in block order, one rating period per block, so the ratings do not depend on the
+// number of threads. a league is saved as a text file and only plays the pairings of newly added teams
+
+struct LeagueTeam {
+    vector<MonsterType> lineup;
+    double rating = 1500;
+    double rd = 350; // rating deviation
+    long long wins = 0; // battles
+    long long losses = 0;
+    long long ties = 0; // including stalemates and unfinished battles
+
+    long long games() const {return wins + losses + ties;}
+    double score() const {return games() ? (wins + 0.5 * ties) / games() : 0;}
+};
+
+class League {
+    public:
+        static constexpr int BLOCK = 64;
+
+        League(uint64_t league_seed, int games_per_pair): seed(league_seed), n_games(games_per_pair) {
+            if (n_games <= 0 || n_games > 65535) {throw runtime_error("A league needs 1 - 65535 games per pair.");}
+        }
+
+        static League load(const string& path) {
+            ifstream file(path);
+            if (!file) {throw runtime_error("Cannot open " + path + ".");}
+            string word;
+            uint64_t seed;
+            int n_games, n_scheduled;
+            if (!(file >> word >> seed >> n_games >> n_scheduled) || word != "league") {
+                throw runtime_error(path + " is not a league.");
+            }
+            League league(seed, n_games);
+            LeagueTeam team;
+            string letters;
+            while (file >> letters >> team.rating >> team.rd >> team.wins >> team.losses >> team.ties) {
+                team.lineup = parseLineup(letters);
+                league.teams.push_back(team);
+            }
+            if (n_scheduled < 0 || n_scheduled > league.size()) {throw runtime_error(path + " is truncated.");}
+            league.n_scheduled = n_scheduled;
+            return league;
+        }
+
+        void save(const string& path) const {
+            string temp_path = path + ".tmp";
+            {
+                ofstream file(temp_path);
+                if (!file) {throw runtime_error("Cannot open " + temp_path + " for writing.");}
+                file.precision(17);
+                file << "league " << seed << " " << n_games << " " << n_scheduled << "\n";
+                for (auto& team : teams) {
+                    file << lineupLetters(team.lineup) << " " << team.rating << " " << team.rd << " " << 
+                        team.wins << " " << team.losses << " " << team.ties << "\n";
+                }
+                file.flush();
+                if (!file) {throw runtime_error("Cannot write " + temp_path + ".");}
+            }
+            replaceFile(temp_path, path);
+        }
+
+        void add(const vector<MonsterType>& lineup) {
+            LeagueTeam team;
+            team.lineup = lineup;
+            teams.push_back(team);
+        }
+
+        int size() const {return teams.size();}
+        int n_rated() const {return n_scheduled;} // teams whose pairings have all been played
+        uint64_t league_seed() const {return seed;}
+        int games_per_pair() const {return n_games;}
+        const LeagueTeam& team(int i) const {return teams[i];}
+
+        // play every pairing that involves a team added since the last call; returns the number of battles
+        long long play(int n_threads) {
+            int old_n = n_scheduled;
+            int n = size();
+            vector<pair<int, int>> blocks; // (row block, column block), rows hold the newer team of a pair
+            for (int row = old_n / BLOCK; row * BLOCK < n; row++) {
+                for (int col = 0; col <= row; col++) {blocks.push_back({row, col});}
+            }
+            // fixed team names: a team that keeps its name is not interned again for every battle
+            vector<pair<string, vector<MonsterType>>> red, blue;
+            for (auto& team : teams) {
+                red.push_back({"Red", team.lineup});
+                blue.push_back({"Blue", team.lineup});
+            }
+            vector<NamePool> namepools(n_threads);
+            NullSink sink;
+            long long n_battles = 0;
+            size_t wave_size = 4 * n_threads;
+            vector<vector<uint16_t>> tallies(wave_size); // per block, two per pair: wins of the row team, ties
+            sum_impact.assign(n, 0);
+            sum_variance.assign(n, 0);
+            for (size_t first = 0; first < blocks.size(); first += wave_size) {
+                int n_blocks = min(wave_size, blocks.size() - first);
+                parallelFor(n_blocks, n_threads, [&](int k, int worker) {
+                    tallies[k].clear();
+                    for_pairs(blocks[first + k], old_n, [&](int i, int j) {
+                        long long pair_idx = static_cast<long long>(i) * (i - 1) / 2 + j;
+                        int wins = 0;
+                        int ties = 0;
+                        for (int g = 0; g < n_games; g++) {
+                            CounterRng rng(seed, pair_idx * n_games + g);
+                            bool i_first = g % 2 == 0;
+                            BattleOutcome outcome = makeBattle(i_first ? red[i] : red[j], 
+                                i_first ? blue[j] : blue[i], namepools[worker], sink, rng).outcome;
+                            wins += outcome == (i_first ? team1_wins : team2_wins);
+                            ties += outcome != team1_wins && outcome != team2_wins;
+                        }
+                        tallies[k].push_back(wins);
+                        tallies[k].push_back(ties);
+                    });
+                });
+                for (int k = 0; k < n_blocks; k++) {
+                    n_battles += static_cast<long long>(tallies[k].size() / 2) * n_games;
+                    rate(blocks[first + k], old_n, tallies[k]);
+                }
+            }
+            n_scheduled = n;
+            return n_battles;
+        }
+
+    private:
+        uint64_t seed;
+        int n_games;
+        vector<LeagueTeam> teams;
+        int n_scheduled = 0;
+        vector<double> sum_impact; // per team while rating a block: sum of g * (score - expected)
+        vector<double> sum_variance; // sum of g^2 * expected * (1 - expected)
+
+        template <class Fn>
+        void for_pairs(pair<int, int> block, int old_n, Fn fn) const {
+            // the pairs (i, j) of a block that are new: j < i, i >= old_n
+            int row_end = min((block.first + 1) * BLOCK, size());
+            int col_end = min((block.second + 1) * BLOCK, size());
+            for (int i = max(block.first * BLOCK, old_n); i < row_end; i++) {
+                for (int j = block.second * BLOCK; j < min(col_end, i); j++) {fn(i, j);}
+            }
+        }
+
+        void rate(pair<int, int> block, int old_n, const vector<uint16_t>& tally) {
+            // one Glicko rating period: every game of the block against the ratings from before it
+            const double q = log(10.0) / 400;
+            const double pi = 3.14159265358979323846;
+            auto g = [&](double rd) {return 1 / sqrt(1 + 3 * q * q * rd * rd / (pi * pi));};
+            size_t k = 0;
+            for_pairs(block, old_n, [&](int i, int j) {
+                int wins = tally[k++];
+                int ties = tally[k++];
+                int losses = n_games - wins - ties;
+                teams[i].wins += wins;
+                teams[i].ties += ties;
+                teams[i].losses += losses;
+                teams[j].wins += losses;
+                teams[j].ties += ties;
+                teams[j].losses += wins;
+                for (int idx : {i, j}) {
+                    const LeagueTeam& self = teams[idx];
+                    const LeagueTeam& other = teams[idx == i ? j : i];
+                    double score = idx == i ? wins + 0.5 * ties : losses + 0.5 * ties;
+                    double g_other = g(other.rd);
+                    double expected = 1 / (1 + pow(10.0, -g_other * (self.rating - other.rating) / 400));
+                    sum_impact[idx] += g_other * (score - n_games * expected);
+                    sum_variance[idx] += n_games * g_other * g_other * expected * (1 - expected);
+                }
+            });
+            for (int side : {block.first, block.second}) {
+                for (int idx = side * BLOCK; idx < min((side + 1) * BLOCK, size()); idx++) {
+                    if (sum_variance[idx] == 0) {continue;} // not in any new pair (or the other side, same block)
+                    LeagueTeam& team = teams[idx];
+                    double precision = 1 / (team.rd * team.rd) + q * q * sum_variance[idx];
+                    team.rating += q / precision * sum_impact[idx];
+                    team.rd = sqrt(1 / precision);
+                    sum_impact[idx] = 0;
+                    sum_variance[idx] = 0;
+                }
+            }
+        }
+};
+
+// benchmarks
+
+class DiscardBuffer: public streambuf {
+    // stream buffer that throws away everything written to it
+    // (lets the text sink do all of its formatting without paying for terminal output)
+    protected:
+        int overflow(int c) override {return c;}
+        streamsize xsputn(const char*, streamsize n) override {return n;}
+};
+
+double benchSink(EventSink& sink, int n_battles, mt19937& rng) {
+    // run n_battles random 4 vs 4 battles into the sink, return battles per second
+    NamePool namepool;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        makeBattle({"Red", monsterPicker(4, rng)}, {"Blue", monsterPicker(4, rng)}, namepool, sink, rng);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return n_battles / elapsed.count();
+}
+
+void runSinkBenchmark(int n_battles) {
+    // compare headless (null/counting sink) throughput to full text rendering
+    NullSink null_sink;
+    CountingSink counting_sink;
+    DiscardBuffer discard;
+    ostream discard_stream(&discard);
+    TextSink text_sink(discard_stream);
+
+    mt19937 rng(rd());
+    double null_rate = benchSink(null_sink, n_battles, rng);
+    double counting_rate = benchSink(counting_sink, n_battles, rng);
+    double text_rate = benchSink(text_sink, n_battles, rng);
+
+    cout << "Sink benchmark: " << n_battles << " random 4 vs 4 battles per sink\n";
+    cout << "  null sink:     " << static_cast<long long>(null_rate) << " battles/s (" <<
+        static_cast<long long>(null_rate * 60) << " battles/min)\n";
+    cout << "  counting sink: " << static_cast<long long>(counting_rate) << " battles/s (" << 
+        counting_sink.count(turn_start_event) << " turns, " << counting_sink.count(attack_event) << 
+        " attacks, " << counting_sink.count(death_event) << " deaths)\n";
+    cout << "  text sink:     " << static_cast<long long>(text_rate) << " battles/s (output discarded)\n";
+    cout << "  headless speedup: " << null_rate / text_rate << "x\n";
+}
+
+int runSoaBenchmark(int n_battles, uint32_t seed) {
+    // run the same random 4 vs 4 battles through both engines; both engines draw from
+    // identically seeded rngs in the same order, so every result must match;
+    // returns the exit code (1 if any result differs)
+    mt19937 lineup_rng(seed);
+    vector<vector<MonsterType>> lineups;
+    for (int i = 0; i < 2 * n_battles; i++) {
+        lineups.push_back(monsterPicker(4, lineup_rng));
+    }
+
+    NullSink sink;
+    NamePool namepool;
+    vector<BattleResult> class_results;
+    class_results.reserve(n_battles);
+    mt19937 class_rng(seed);
+    long long class_turns = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        class_results.push_back(makeBattle({"Red", lineups[2*i]}, {"Blue", lineups[2*i+1]}, namepool, sink, class_rng));
+        class_turns += class_results.back().turns;
+    }
+    chrono::duration<double> class_time = chrono::steady_clock::now() - start;
+
+    TeamArrays team1;
+    TeamArrays team2;
+    mt19937 soa_rng(seed);
+    long long soa_turns = 0;
+    int mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        team1.set_lineup(lineups[2*i]);
+        team2.set_lineup(lineups[2*i+1]);
+        BattleResult result = soaBattle(team1, team2, soa_rng);
+        soa_turns += result.turns;
+        if (result.outcome != class_results[i].outcome || result.turns != class_results[i].turns) {
+            mismatches++;
+        }
+    }
+    chrono::duration<double> soa_time = chrono::steady_clock::now() - start;
+
+    double class_rate = class_turns / class_time.count();
+    double soa_rate = soa_turns / soa_time.count();
+    cout << "SoA benchmark: " << n_battles << " random 4 vs 4 battles (seed " << seed << ")\n";
+    cout << "  class hierarchy:     " << static_cast<long long>(class_rate) << " turns/s\n";
+    cout << "  structure of arrays: " << static_cast<long long>(soa_rate) << " turns/s\n";
+    cout << "  speedup: " << soa_rate / class_rate << "x, mismatched results: " << mismatches << "\n";
+    if (mismatches != 0) {
+        cout << "FAILED: the structure-of-arrays engine disagrees with the class hierarchy\n";
+        return 1;
+    }
+    return 0;
+}
+
+int runKernelBenchmark(int n_battles, uint32_t seed) {
+    // run the same random 4 vs 4 battles through the SoA engine and the matchup kernels
+    // (identically seeded rngs, so every result must match); returns the exit code
+    mt19937 lineup_rng(seed);
+    vector<vector<MonsterType>> lineups;
+    for (int i = 0; i < 2 * n_battles; i++) {
+        lineups.push_back(monsterPicker(4, lineup_rng));
+    }
+
+    TeamArrays team1;
+    TeamArrays team2;
+    vector<BattleResult> soa_results;
+    soa_results.reserve(n_battles);
+    mt19937 soa_rng(seed);
+    long long soa_turns = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        team1.set_lineup(lineups[2*i]);
+        team2.set_lineup(lineups[2*i+1]);
+        soa_results.push_back(soaBattle(team1, team2, soa_rng));
+        soa_turns += soa_results.back().turns;
+    }
+    chrono::duration<double> soa_time = chrono::steady_clock::now() - start;
+
+    mt19937 kernel_rng(seed);
+    long long kernel_turns = 0;
+    int mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        BattleResult result = kernelBattle(lineups[2*i], lineups[2*i+1], kernel_rng);
+        kernel_turns += result.turns;
+        if (result.outcome != soa_results[i].outcome || result.turns != soa_results[i].turns) {
+            mismatches++;
+        }
+    }
+    chrono::duration<double> kernel_time = chrono::steady_clock::now() - start;
+
+    double soa_rate = soa_turns / soa_time.count();
+    double kernel_rate = kernel_turns / kernel_time.count();
+    cout << "Kernel benchmark: " << n_battles << " random 4 vs 4 battles (seed " << seed << ")\n";
+    cout << "  structure of arrays: " << static_cast<long long>(soa_rate) << " turns/s\n";
+    cout << "  matchup kernels:     " << static_cast<long long>(kernel_rate) << " turns/s\n";
+    cout << "  speedup: " << kernel_rate / soa_rate << "x, mismatched results: " << mismatches << "\n";
+    if (mismatches != 0) {
+        cout << "FAILED: the matchup kernels disagree with the structure-of-arrays engine\n";
+        return 1;
+    }
+    return 0;
+}
+
+double laneSpeedup(const MonsterCatalog& catalog, const vector<pair<vector<int>, vector<int>>>& battles, uint32_t seed, 
+    int max_turns, vector<BattleResult>& lane_results, int& mismatches) {
+    // the same battles on the lane engine and one at a time on the flat tables of catalogBattle (the scalar
+    // engine that also takes its stats at run time), lane order with the lane's rng; prints both rates
+    // and returns the speedup of the lanes
+    LaneBattles lanes(catalog.specs(), max_turns);
+    auto start = chrono::steady_clock::now();
+    lane_results = lanes.run(battles, seed);
+    chrono::duration<double> lane_time = chrono::steady_clock::now() - start;
+    long long turns = 0;
+    for (const auto& result : lane_results) {turns += result.turns;}
+
+    int n_battles = battles.size();
+    start = chrono::steady_clock::now();
+    for (int l = 0; l < LANES; l++) {
+        seed_seq seq{seed, static_cast<uint32_t>(l)};
+        mt19937 rng(seq);
+        for (int i = l; i < n_battles; i += LANES) {
+            BattleResult result = catalogBattle(catalog, battles[i].first, battles[i].second, rng, max_turns);
+            mismatches += result.outcome != lane_results[i].outcome || result.turns != lane_results[i].turns;
+        }
+    }
+    chrono::duration<double> table_time = chrono::steady_clock::now() - start;
+    cout << "    flat tables: " << static_cast<long long>(turns / table_time.count()) << " turns/s\n";
+    cout << "    lane engine: " << static_cast<long long>(turns / lane_time.count()) << " turns/s\n";
+    return table_time.count() / lane_time.count();
+}
+
+int runLaneBenchmark(int n_battles, uint32_t seed, const string& path) {
+    // the lane engine against catalogBattle, the scalar engine that also takes its stats at run time:
+    // first the built-in monsters (random 1 to 4 per team, short battles; the matchup kernels, compiled
+    // for these stats, and the Monster classes for reference), then the archetypes of a catalog (random
+    // 8 vs 8 with a turn limit of 10000, long battles when it has attrition archetypes); every result is
+    // checked against catalogBattle, the built-in ones also against the Monster classes (returns the exit code)
+    cout << "Lane benchmark: " << n_battles << " battles per part (seed " << seed << "), " << LANES << " lanes, " << 
+        LANE_BACKEND << "\n";
+    mt19937 lineup_rng(seed);
+    uniform_int_distribution<int> team_size(1, 4);
+    vector<pair<vector<MonsterType>, vector<MonsterType>>> battles;
+    vector<pair<vector<int>, vector<int>>> ids;
+    for (int i = 0; i < n_battles; i++) {
+        vector<MonsterType> lineup1 = monsterPicker(team_size(lineup_rng), lineup_rng);
+        battles.emplace_back(lineup1, monsterPicker(team_size(lineup_rng), lineup_rng));
+        ids.emplace_back(vector<int>(battles[i].first.begin(), battles[i].first.end()), 
+            vector<int>(battles[i].second.begin(), battles[i].second.end()));
+    }
+
+    mt19937 kernel_rng(seed);
+    auto start = chrono::steady_clock::now();
+    long long kernel_turns = 0;
+    for (const auto& b : battles) {kernel_turns += kernelBattle(b.first, b.second, kernel_rng).turns;}
+    chrono::duration<double> kernel_time = chrono::steady_clock::now() - start;
+
+    NullSink sink;
+    NamePool namepool;
+    vector<BattleResult> lane_results;
+    int mismatches = 0;
+    long long class_turns = 0;
+    start = chrono::steady_clock::now();
+    for (int l = 0; l < LANES; l++) {
+        seed_seq seq{seed, static_cast<uint32_t>(l)};
+        mt19937 rng(seq);
+        for (int i = l; i < n_battles; i += LANES) {
+            class_turns += makeBattle({"Red", battles[i].first}, {"Blue", battles[i].second}, namepool, sink, rng).turns;
+        }
+    }
+    chrono::duration<double> class_time = chrono::steady_clock::now() - start;
+
+    cout << "  built-in monsters, 1 to 4 per team:\n";
+    cout << "    Monster classes: " << static_cast<long long>(class_turns / class_time.count()) << " turns/s\n";
+    cout << "    matchup kernels: " << static_cast<long long>(kernel_turns / kernel_time.count()) << " turns/s\n";
+    double builtin_speedup = laneSpeedup(MonsterCatalog::builtin(), ids, seed, MAX_TURNS, lane_results, mismatches);
+    for (int l = 0; l < LANES; l++) {
+        seed_seq seq{seed, static_cast<uint32_t>(l)};
+        mt19937 rng(seq);
+        for (int i = l; i < n_battles; i += LANES) {
+            BattleResult result = makeBattle({"Red", battles[i].first}, {"Blue", battles[i].second}, namepool, sink, rng);
+            mismatches += result.outcome != lane_results[i].outcome || result.turns != lane_results[i].turns;
+        }
+    }
+    cout << "    lanes over flat tables: " << builtin_speedup << "x\n";
+
+    MonsterCatalog catalog = path == "builtin" ? MonsterCatalog::builtin() : MonsterCatalog::load(path);
+    const int catalog_team_size = 8;
+    const int max_turns = 10000;
+    ids.clear();
+    long long catalog_turns = 0;
+    for (int i = 0; i < n_battles; i++) {
+        vector<int> lineup1 = pickArchetypes(catalog_team_size, catalog.size(), lineup_rng);
+        ids.emplace_back(lineup1, pickArchetypes(catalog_team_size, catalog.size(), lineup_rng));
+    }
+    cout << "  catalog " << path << " (" << catalog.size() << " archetypes), " << catalog_team_size << " vs " << 
+        catalog_team_size << ":\n";
+    double catalog_speedup = laneSpeedup(catalog, ids, seed, max_turns, lane_results, mismatches);
+    for (const auto& result : lane_results) {catalog_turns += result.turns;}
+    cout << "    lanes over flat tables: " << catalog_speedup << "x (" << 
+        static_cast<double>(catalog_turns) / max(1, n_battles) << " turns per battle)\n";
+    cout << "  mismatched results: " << mismatches << "\n";
+    if (mismatches != 0) {
+        cout << "FAILED: the lane engine disagrees with the scalar engines\n";
+        return 1;
+    }
+    return 0;
+}
+
+void playRecordedBattles(uint64_t seed, int n_battles, EventSink& sink) {
+    // random 4 vs 4 battles, battle i drawn from CounterRng(seed, i)
+    NamePool namepool;
+    vector<MonsterType> lineup1;
+    vector<MonsterType> lineup2;
+    for (int i = 0; i < n_battles; i++) {
+        CounterRng rng = tournamentRng(seed, i, 4, lineup1, lineup2);
+        makeBattle({"Red", lineup1}, {"Blue", lineup2}, namepool, sink, rng);
+    }
+}
+
+int runRecordBenchmark(int n_battles, uint64_t seed) {
+    // record the same battles as text and as binary; replaying the recording must give the same
+    // text, and starting at a keyframe must give the same text as replaying from the start
+    // (returns the exit code)
+    ostringstream text;
+    {
+        TextSink sink(text);
+        playRecordedBattles(seed, n_battles, sink);
+    }
+    ostringstream binary;
+    ostringstream binary_no_keyframes;
+    {
+        BattleRecorder recorder(binary, 4);
+        playRecordedBattles(seed, n_battles, recorder);
+        BattleRecorder plain_recorder(binary_no_keyframes, numeric_limits<int>::max());
+        playRecordedBattles(seed, n_battles, plain_recorder);
+    }
+
+    auto start = chrono::steady_clock::now();
+    BattleLog log(binary.str());
+    chrono::duration<double> scan_time = chrono::steady_clock::now() - start;
+    BattleLog plain_log(binary_no_keyframes.str());
+
+    ostringstream replayed;
+    start = chrono::steady_clock::now();
+    {
+        TextRenderer renderer(replayed, 1 << 16);
+        for (int i = 0; i < log.n_battles(); i++) {log.render(i, renderer);}
+        renderer.write();
+    }
+    chrono::duration<double> replay_time = chrono::steady_clock::now() - start;
+
+    int seek_mismatches = 0;
+    for (int i = 0; i < log.n_battles(); i++) {
+        int from_turn = log.n_turns(i) / 2 + 1;
+        ostringstream seeked;
+        ostringstream scanned;
+        TextRenderer seek_renderer(seeked, 1 << 16);
+        TextRenderer scan_renderer(scanned, 1 << 16);
+        log.render(i, seek_renderer, from_turn);
+        plain_log.render(i, scan_renderer, from_turn);
+        seek_renderer.write();
+        scan_renderer.write();
+        if (seeked.str() != scanned.str()) {seek_mismatches++;}
+    }
+
+    double text_size = text.str().size();
+    double binary_size = binary.str().size();
+    cout << "Recording benchmark: " << n_battles << " random 4 vs 4 battles (seed " << seed << ")\n";
+    cout << "  text:   " << static_cast<long long>(text_size) << " bytes (" << text_size / n_battles << " per battle)\n";
+    cout << "  binary: " << static_cast<long long>(binary_size) << " bytes (" << binary_size / n_battles << 
+        " per battle, keyframe every 4 turns), " << text_size / binary_size << "x smaller\n";
+    cout << "  scan: " << binary_size / scan_time.count() / (1 << 20) << " MiB/s, replay as text: " << 
+        static_cast<long long>(n_battles / replay_time.count()) << " battles/s\n";
+    bool identical = replayed.str() == text.str();
+    cout << "  replayed text " << (identical ? "identical" : "DIFFERENT") << ", seek mismatches: " << seek_mismatches << "\n";
+    if (!identical || seek_mismatches != 0) {
+        cout << "FAILED: replaying the recording does not give the recorded text\n";
+        return 1;
+    }
+    return 0;
+}
+
+void runRecordMode(int n_battles, const string& path, int keyframe_interval) {
+    ofstream file(path, ios::binary);
+    if (!file) {
+        cout << "Cannot open " << path << "\n";
+        return;
+    }
+    uint64_t seed = rd();
+    BattleRecorder recorder(file, keyframe_interval);
+    playRecordedBattles(seed, n_battles, recorder);
+    recorder.flush();
+    cout << "Recorded " << n_battles << " random 4 vs 4 battles (seed " << seed << ") to " << path << 
+        ": " << recorder.size() << " bytes\n";
+}
+
+void runPlayMode(const string& path, int battle_idx, int from_turn, int to_turn) {
+    // replay a recording as text: every battle, or one battle (optionally only some turns)
+    BattleLog log = BattleLog::load(path);
+    TextRenderer renderer(cout, 1 << 16);
+    for (int i = 0; i < log.n_battles(); i++) {
+        if (battle_idx >= 0 && i != battle_idx) {continue;}
+        renderer.append("\nBattle #" + to_string(i) + " (" + to_string(log.n_turns(i)) + " turns)\n");
+        log.render(i, renderer, from_turn, to_turn);
+    }
+    renderer.write();
+    cout.flush();
+}
+
+void runQueryMode(const string& path, long long min_battles) {
+    // aggregate queries straight from the mapped columns: outcomes, turn-count histogram,
+    // and the lineup pairs with the highest and lowest team1 win rate
+    auto start = chrono::steady_clock::now();
+    ResultStore store(path);
+    long long outcomes[N_OUTCOMES] = {0, 0, 0, 0, 0};
+    vector<long long> turn_histogram;
+    unordered_map<uint64_t, pair<long long, long long>> lineup_wins; // key -> (team1 wins, battles)
+    for (const auto& group : store.groups()) {
+        for (uint32_t i = 0; i < group.n_rows; i++) {
+            outcomes[group.outcome[i] < N_OUTCOMES ? static_cast<int>(group.outcome[i]) : static_cast<int>(unfinished)]++;
+            size_t turns = max(group.turns[i], 0);
+            if (turns >= turn_histogram.size()) {turn_histogram.resize(turns + 1, 0);}
+            turn_histogram[turns]++;
+            auto& wins = lineup_wins[group.lineup_key[i]];
+            wins.first += group.outcome[i] == team1_wins;
+            wins.second++;
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    long long n = store.n_rows();
+    cout << "Result store " << path << ": " << n << " rows in " << store.groups().size() << " groups, scanned in " << 
+        elapsed.count() << " s (" << static_cast<long long>(n / max(elapsed.count(), 1e-9)) << " rows/s)\n";
+    cout << "  team1 wins: " << outcomes[team1_wins] << ", team2 wins: " << outcomes[team2_wins] << ", ties: " << 
+        outcomes[tied] << ", unfinished: " << outcomes[unfinished] << ", stalemates: " << outcomes[stalemate] << "\n";
+    cout << "  turns histogram:\n";
+    for (size_t turns = 0; turns < turn_histogram.size(); turns++) {
+        if (turn_histogram[turns] == 0) {continue;}
+        cout << "    " << turns << ": " << turn_histogram[turns] << " (" << 
+            100.0 * turn_histogram[turns] / n << "%)\n";
+    }
+
+    vector<pair<double, uint64_t>> rates;
+    for (const auto& entry : lineup_wins) {
+        if (entry.second.second >= min_battles) {
+            rates.emplace_back(static_cast<double>(entry.second.first) / entry.second.second, entry.first);
+        }
+    }
+    sort(rates.begin(), rates.end());
+    cout << "  " << rates.size() << " lineup pairs with at least " << min_battles << " battles\n";
+    int n_shown = min(5, static_cast<int>(rates.size()));
+    auto show = [&](const pair<double, uint64_t>& rate) {
+        cout << "    " << lineupCodeToString(rate.second >> 32) << " vs " << lineupCodeToString(rate.second & 0xffffffffu) << 
+            ": team1 wins " << 100 * rate.first << "% of " << lineup_wins[rate.second].second << "\n";
+    };
+    cout << "  highest team1 win rate:\n";
+    for (int i = 0; i < n_shown; i++) {show(rates[rates.size() - 1 - i]);}
+    cout << "  lowest team1 win rate:\n";
+    for (int i = 0; i < n_shown; i++) {show(rates[i]);}
+}
+
+void printDistribution(const OutcomeDistribution& d) {
+    cout << "  team1 wins: " << d.p_team1 << "\n";
+    cout << "  team2 wins: " << d.p_team2 << "\n";
+    cout << "  tie:        " << d.p_tie << "\n";
+    cout << "  unfinished: " << d.p_unfinished << "\n";
+    cout << "  expected turns: " << d.expected_turns << "\n";
+}
+
+void runAnalyzeMode(const vector<MonsterType>& lineup1, const vector<MonsterType>& lineup2) {
+    // exact answer, plus a Monte Carlo estimate from the matchup kernels to compare against
+    BattleAnalyzer analyzer;
+    auto start = chrono::steady_clock::now();
+    OutcomeDistribution exact = analyzer.analyze(lineup1, lineup2);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "Exact outcome (" << analyzer.n_states() << " states, " << elapsed.count() * 1000 << " ms):\n";
+    printDistribution(exact);
+
+    const int n_samples = 100000;
+    mt19937 rng(rd());
+    LineupStats sampled;
+    for (int i = 0; i < n_samples; i++) {
+        sampled.add(kernelBattle(lineup1, lineup2, rng));
+    }
+    cout << "Monte Carlo (" << n_samples << " battles): team1 " << static_cast<double>(sampled.n_team1_wins) / n_samples << 
+        ", team2 " << static_cast<double>(sampled.n_team2_wins) / n_samples << 
+        ", tie " << static_cast<double>(sampled.n_ties) / n_samples << 
+        ", turns " << static_cast<double>(sampled.total_turns) / n_samples << "\n";
+}
+
+void runAnalyzeRandomMode(int n1, int n2) {
+    BattleAnalyzer analyzer;
+    auto start = chrono::steady_clock::now();
+    OutcomeDistribution exact = analyzer.analyze_random(n1, n2);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "Exact outcome of " << n1 << " random vs " << n2 << " random (" << analyzer.n_states() << 
+        " states, " << elapsed.count() * 1000 << " ms):\n";
+    printDistribution(exact);
+}
+
+void runOptimizeMode(const string& pool_text, const string& opponent_text) {
+    // opponents: "random:n" for every monsterPicker(n) lineup, or lineups separated by commas (equally likely)
+    vector<MonsterType> pool = parseLineup(pool_text);
+    vector<vector<MonsterType>> opponents;
+    if (opponent_text.compare(0, 7, "random:") == 0) {
+        opponents = BattleAnalyzer::allLineups(atoi(opponent_text.c_str() + 7));
+    } else {
+        stringstream lineups(opponent_text);
+        string lineup;
+        while (getline(lineups, lineup, ',')) {opponents.push_back(parseLineup(lineup));}
+    }
+    vector<double> weights(opponents.size(), 1.0);
+
+    LineupOptimizer optimizer(opponents, weights);
+    auto start = chrono::steady_clock::now();
+    OutcomeDistribution outcome;
+    vector<MonsterType> best = optimizer.optimize(pool, outcome);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "Best order of " << pool.size() << " monsters against " << opponents.size() << " opponent lineup(s): " << 
+        lineupLetters(best) << " (score " << LineupOptimizer::score(outcome) << ", " << elapsed.count() * 1000 << " ms)\n";
+    printDistribution(outcome);
+    cout << "  search nodes: " << optimizer.n_nodes() << ", pruned branches: " << optimizer.n_pruned() << 
+        ", opponent suffixes: " << optimizer.n_suffixes() << ", memoized fights: " << optimizer.n_fights() << ", memoized bounds: " << optimizer.n_bounds() << "\n";
+
+    // small pools: check against every distinct order with the exact analyzer
+    sort(pool.begin(), pool.end());
+    long long n_orders = 0;
+    vector<MonsterType> order = pool;
+    do {n_orders++;} while (next_permutation(order.begin(), order.end()) && n_orders <= 5000);
+    bool fits_analyzer = pool.size() <= 15;
+    for (auto& lineup : opponents) {fits_analyzer = fits_analyzer && lineup.size() <= 15;}
+    if (n_orders > 5000 || n_orders * static_cast<long long>(opponents.size()) > 200000 || !fits_analyzer) {return;}
+    BattleAnalyzer analyzer;
+    double best_score = -1;
+    vector<MonsterType> brute_best;
+    do {
+        OutcomeDistribution total;
+        for (auto& lineup : opponents) {total.add(analyzer.analyze(order, lineup), 1.0 / opponents.size());}
+        if (LineupOptimizer::score(total) > best_score) {
+            best_score = LineupOptimizer::score(total);
+            brute_best = order;
+        }
+    } while (next_permutation(order.begin(), order.end()));
+    cout << "Every one of the " << n_orders << " distinct orders: best " << lineupLetters(brute_best) << " (score " << 
+        best_score << ")" << (abs(best_score - LineupOptimizer::score(outcome)) < 1e-9 ? ", same score" : ", MISMATCH") << "\n";
+}
+
+void runCatalogMode(const string& path, int n_battles, int team_size, bool fast_forward) {
+    // sweep a catalog without recompiling: every archetype 1 vs 1 and 1 vs 2 against every other,
+    // then random teams of all archetypes; when the catalog starts with the built-in stats, the catalog
+    // engine is first checked against the Monster classes
+    MonsterCatalog catalog = path == "builtin" ? MonsterCatalog::builtin() : MonsterCatalog::load(path);
+    uint64_t seed = rd();
+    int k = catalog.size();
+    int n_threads = max(1u, thread::hardware_concurrency());
+    cout << "Catalog " << path << ": " << k << " archetypes (seed " << seed << ")\n";
+    for (int id = 0; id < k; id++) {
+        const MonsterSpec& spec = catalog.spec(id);
+        cout << "  " << catalog.letter(id) << " " << catalog.name(id) << ": health " << spec.max_health << ", damage " << 
+            spec.damage << ", speed " << spec.speed;
+        if (spec.num_attack != 1) {cout << ", attacks " << spec.num_attack;}
+        if (spec.regen_amount) {cout << ", regen " << spec.regen_amount;}
+        if (spec.block_amount) {cout << ", block " << spec.block_amount;}
+        if (spec.reflect_amount) {cout << ", reflect " << spec.reflect_amount;}
+        cout << "\n";
+    }
+
+    vector<MonsterSpec> builtin_specs = defaultSpecs();
+    bool builtin_prefix = k >= N_MONSTER_TYPES;
+    for (int type = 0; builtin_prefix && type < N_MONSTER_TYPES; type++) {
+        const MonsterSpec& a = catalog.spec(type);
+        const MonsterSpec& b = builtin_specs[type];
+        builtin_prefix = a.max_health == b.max_health && a.damage == b.damage && a.speed == b.speed && 
+            a.num_attack == b.num_attack && a.regen_amount == b.regen_amount && a.block_amount == b.block_amount && 
+            a.reflect_amount == b.reflect_amount;
+    }
+    if (builtin_prefix) {
+        // the same random 4 vs 4 battles through both engines
+        const int n_check = 100000;
+        vector<BattleResult> expected(n_check);
+        NamePool namepool;
+        NullSink null_sink;
+        vector<MonsterType> lineup1, lineup2;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < n_check; i++) {
+            CounterRng rng = tournamentRng(seed, i, 4, lineup1, lineup2);
+            expected[i] = makeBattle({"Red", lineup1}, {"Blue", lineup2}, namepool, null_sink, rng);
+        }
+        chrono::duration<double> class_time = chrono::steady_clock::now() - start;
+        int mismatches = 0;
+        vector<int> ids1, ids2;
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < n_check; i++) {
+            CounterRng rng = tournamentRng(seed, i, 4, lineup1, lineup2);
+            ids1.assign(lineup1.begin(), lineup1.end());
+            ids2.assign(lineup2.begin(), lineup2.end());
+            BattleResult result = catalogBattle(catalog, ids1, ids2, rng);
+            mismatches += result.outcome != expected[i].outcome || result.turns != expected[i].turns || 
+                result.health1 != expected[i].health1 || result.health2 != expected[i].health2 || 
+                result.survivors1 != expected[i].survivors1 || result.survivors2 != expected[i].survivors2;
+        }
+        chrono::duration<double> catalog_time = chrono::steady_clock::now() - start;
+        cout << "Built-in archetypes vs the Monster classes: " << n_check << " random 4 vs 4 battles, " << mismatches << 
+            " mismatches (" << static_cast<long long>(n_check / class_time.count()) << " battles/s with the classes, " << 
+            static_cast<long long>(n_check / catalog_time.count()) << " with the catalog tables)\n";
+    }
+
+    // 1 vs 1 and 1 vs 2 win rates; without a speed tie a matchup has no randomness, so it is played once
+    vector<double> rate1(k * k), rate2(k * k);
+    parallelFor(k * k, n_threads, [&](int cell, int) {
+        int a = cell / k;
+        int b = cell % k;
+        int n = catalog.spec(a).speed != catalog.spec(b).speed ? 1 : n_battles;
+        vector<int> one = {a};
+        vector<int> single = {b};
+        vector<int> pair = {b, b};
+        long long wins1 = 0, wins2 = 0;
+        for (int i = 0; i < n; i++) {
+            CounterRng rng(seed, (static_cast<long long>(cell) * n_battles + i) * 2);
+            wins1 += catalogBattle(catalog, one, single, rng, MAX_TURNS, fast_forward).outcome == team1_wins;
+            rng = CounterRng(seed, (static_cast<long long>(cell) * n_battles + i) * 2 + 1);
+            wins2 += catalogBattle(catalog, one, pair, rng, MAX_TURNS, fast_forward).outcome == team1_wins;
+        }
+        rate1[cell] = static_cast<double>(wins1) / n;
+        rate2[cell] = static_cast<double>(wins2) / n;
+    });
+    for (int table = 0; table < 2; table++) {
+        cout << (table == 0 ? "\nWin % of one (row) vs one (column):\n   " : "\nWin % of one (row) vs two (column):\n   ");
+        for (int b = 0; b < k; b++) {cout << "    " << catalog.letter(b);}
+        cout << "\n";
+        for (int a = 0; a < k; a++) {
+            cout << "  " << catalog.letter(a);
+            for (int b = 0; b < k; b++) {
+                string cell = to_string(static_cast<int>((table == 0 ? rate1 : rate2)[a * k + b] * 100 + 0.5));
+                cout << string(5 - cell.size(), ' ') << cell;
+            }
+            cout << "\n";
+        }
+    }
+    cout << "\nPairs where one defeats one but loses to two (the balancing rule):\n";
+    for (int a = 0; a < k; a++) {
+        for (int b = 0; b < k; b++) {
+            if (a != b && rate1[a * k + b] > 0.5 && rate2[a * k + b] < 0.5) {
+                cout << "  " << catalog.name(a) << " > " << catalog.name(b) << "\n";
+            }
+        }
+    }
+
+    // random teams: every monster of the winning team gets a win, half a win on a tie
+    vector<vector<double>> wins(n_threads, vector<double>(k));
+    vector<vector<long long>> appearances(n_threads, vector<long long>(k));
+    const int chunk = 1000;
+    int n_chunks = (n_battles + chunk - 1) / chunk;
+    auto start = chrono::steady_clock::now();
+    parallelFor(n_chunks, n_threads, [&](int c, int worker) {
+        for (int i = c * chunk; i < min(n_battles, (c + 1) * chunk); i++) {
+            CounterRng rng(seed ^ 0x5EED, i);
+            vector<int> lineup1 = pickArchetypes(team_size, k, rng);
+            vector<int> lineup2 = pickArchetypes(team_size, k, rng);
+            BattleOutcome outcome = catalogBattle(catalog, lineup1, lineup2, rng, MAX_TURNS, fast_forward).outcome;
+            double credit1 = outcome == team1_wins ? 1 : outcome == tied ? 0.5 : 0;
+            double credit2 = outcome == team2_wins ? 1 : outcome == tied ? 0.5 : 0;
+            for (int id : lineup1) {
+                wins[worker][id] += credit1;
+                appearances[worker][id]++;
+            }
+            for (int id : lineup2) {
+                wins[worker][id] += credit2;
+                appearances[worker][id]++;
+            }
+        }
+    });
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    vector<pair<double, int>> ranking;
+    for (int id = 0; id < k; id++) {
+        double total_wins = 0;
+        long long total_appearances = 0;
+        for (int w = 0; w < n_threads; w++) {
+            total_wins += wins[w][id];
+            total_appearances += appearances[w][id];
+        }
+        ranking.push_back({total_appearances ? total_wins / total_appearances : 0, id});
+    }
+    sort(ranking.rbegin(), ranking.rend());
+    cout << "\nWin share in " << n_battles << " random " << team_size << " vs " << team_size << " battles (" << 
+        static_cast<long long>(n_battles / elapsed.count()) << " battles/s):\n";
+    for (auto& entry : ranking) {
+        cout << "  " << catalog.name(entry.second) << ": " << entry.first * 100 << "%\n";
+    }
+}
+
+int runFastForwardBenchmark(const string& path, int n_battles, uint64_t seed) {
+    // the same random battles played turn by turn and with fast-forward: results must match;
+    // first the built-in monsters through the Monster classes (random 4 vs 4), then the archetypes
+    // of a catalog through the flat tables (random 8 vs 8 with a turn limit of 10000, so that
+    // attrition duels are played out instead of being cut at MAX_TURNS); returns the exit code
+    class SummaryCounter: public EventSink {
+        public:
+            long long n_turns = 0; // played one by one
+            long long n_skips = 0;
+            long long n_skipped = 0; // played by skip events
+            void on_event(const BattleEvent& event) override {
+                n_turns += event.type == turn_start_event;
+                n_skips += event.type == skip_event;
+                n_skipped += event.skipped_turns;
+            }
+            bool takes_summaries() const override {return true;}
+    };
+    auto same = [](const BattleResult& a, const BattleResult& b) {
+        return a.outcome == b.outcome && a.turns == b.turns && a.health1 == b.health1 && a.health2 == b.health2 && 
+            a.survivors1 == b.survivors1 && a.survivors2 == b.survivors2;
+    };
+    cout << "Fast-forward benchmark: " << n_battles << " battles per engine (seed " << seed << ")\n";
+
+    vector<BattleResult> expected(n_battles);
+    NamePool namepool;
+    CountingSink stepping_sink; // takes no summaries, so every turn is played
+    SummaryCounter summary_sink;
+    vector<MonsterType> lineup1, lineup2;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        CounterRng rng = tournamentRng(seed, i, 4, lineup1, lineup2);
+        expected[i] = makeBattle({"Red", lineup1}, {"Blue", lineup2}, namepool, stepping_sink, rng);
+    }
+    chrono::duration<double> step_time = chrono::steady_clock::now() - start;
+    int mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        CounterRng rng = tournamentRng(seed, i, 4, lineup1, lineup2);
+        mismatches += !same(makeBattle({"Red", lineup1}, {"Blue", lineup2}, namepool, summary_sink, rng), expected[i]);
+    }
+    chrono::duration<double> skip_time = chrono::steady_clock::now() - start;
+    cout << "Monster classes, built-in stats: " << mismatches << " mismatches; " << 
+        static_cast<long long>(n_battles / step_time.count()) << " battles/s turn by turn, " << 
+        static_cast<long long>(n_battles / skip_time.count()) << " with fast-forward (" << 
+        summary_sink.n_skipped << " of " << stepping_sink.count(turn_start_event) << " turns in " << 
+        summary_sink.n_skips << " skip events)\n";
+
+    MonsterCatalog catalog = path == "builtin" ? MonsterCatalog::builtin() : MonsterCatalog::load(path);
+    const int team_size = 8;
+    const int max_turns = 10000;
+    long long total_turns = 0;
+    int class_mismatches = mismatches;
+    mismatches = 0;
+    chrono::duration<double> times[2] = {};
+    for (int i = 0; i < n_battles; i++) {
+        BattleResult results[2];
+        for (int fast_forward = 0; fast_forward < 2; fast_forward++) {
+            CounterRng rng(seed ^ 0xFA57, i);
+            vector<int> ids1 = pickArchetypes(team_size, catalog.size(), rng);
+            vector<int> ids2 = pickArchetypes(team_size, catalog.size(), rng);
+            start = chrono::steady_clock::now();
+            results[fast_forward] = catalogBattle(catalog, ids1, ids2, rng, max_turns, fast_forward);
+            times[fast_forward] += chrono::steady_clock::now() - start;
+        }
+        mismatches += !same(results[0], results[1]);
+        total_turns += results[0].turns;
+    }
+    cout << "Catalog " << path << " (" << catalog.size() << " archetypes, " << team_size << " vs " << team_size << 
+        ", " << static_cast<double>(total_turns) / n_battles << " turns per battle): " << mismatches << " mismatches; " << 
+        static_cast<long long>(n_battles / times[0].count()) << " battles/s turn by turn, " << 
+        static_cast<long long>(n_battles / times[1].count()) << " with fast-forward\n";
+    if (class_mismatches + mismatches != 0) {
+        cout << "FAILED: fast-forward changes the results\n";
+        return 1;
+    }
+    return 0;
+}
+
+void runLeagueMode(const string& path, const string& lineup_source, int n_games, int n_threads, const string& csv_path) {
+    // lineup_source: a file with one lineup per line (letters), or random:n:team_size (lineup i depends only on
+    // the league seed and i, so a larger n later extends the same league); an existing league at path must be
+    // a prefix of the lineups, and only the pairings of the new ones are played
+    if (n_threads <= 0) {n_threads = max(1u, thread::hardware_concurrency());}
+    bool exists = static_cast<bool>(ifstream(path));
+    League league = exists ? League::load(path) : League(rd(), n_games);
+    vector<vector<MonsterType>> lineups;
+    if (lineup_source.compare(0, 7, "random:") == 0) {
+        size_t colon = lineup_source.find(':', 7);
+        int n = atoi(lineup_source.c_str() + 7);
+        int team_size = colon == string::npos ? 4 : atoi(lineup_source.c_str() + colon + 1);
+        for (int i = 0; i < n; i++) {
+            CounterRng rng(league.league_seed() ^ 0x1EA6, i);
+            lineups.push_back(monsterPicker(team_size, rng));
+        }
+    } else {
+        ifstream file(lineup_source);
+        if (!file) {throw runtime_error("Cannot open " + lineup_source + ".");}
+        string letters;
+        while (file >> letters) {lineups.push_back(parseLineup(letters));}
+    }
+    if (static_cast<int>(lineups.size()) < league.size()) {
+        throw runtime_error("The league in " + path + " already has more teams than " + lineup_source + ".");
+    }
+    for (int i = 0; i < league.size(); i++) {
+        if (lineups[i] != league.team(i).lineup) {
+            throw runtime_error("Lineup " + to_string(i + 1) + " of " + lineup_source + " differs from the league in " + path + ".");
+        }
+    }
+    int n_old = league.n_rated();
+    for (size_t i = league.size(); i < lineups.size(); i++) {league.add(lineups[i]);}
+    cout << "League " << path << ": " << league.size() << " teams, " << league.size() - n_old << " new (seed " << 
+        league.league_seed() << ", " << league.games_per_pair() << " games per pair, " << n_threads << " threads)\n";
+
+    auto start = chrono::steady_clock::now();
+    long long n_battles = league.play(n_threads);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    league.save(path);
+    cout << "  " << n_battles << " battles in " << elapsed.count() << "s (" << 
+        static_cast<long long>(n_battles / max(elapsed.count(), 1e-9)) << " battles/s), saved to " << path << "\n";
+
+    vector<int> ranking(league.size());
+    for (int i = 0; i < league.size(); i++) {ranking[i] = i;}
+    stable_sort(ranking.begin(), ranking.end(), [&](int a, int b) {return league.team(a).rating > league.team(b).rating;});
+    int n_shown = min(league.size(), 20);
+    cout << "Top " << n_shown << " (rating +- 2 deviations, score over all battles):\n";
+    for (int r = 0; r < n_shown; r++) {
+        const LeagueTeam& team = league.team(ranking[r]);
+        cout << "  " << r + 1 << ". " << lineupLetters(team.lineup) << ": " << static_cast<int>(round(team.rating)) << 
+            " +- " << static_cast<int>(round(2 * team.rd)) << ", " << team.score() * 100 << "% (" << team.wins << "-" << 
+            team.losses << "-" << team.ties << ")\n";
+    }
+    if (!csv_path.empty()) {
+        ofstream out(csv_path);
+        if (!out) {throw runtime_error("Cannot open " + csv_path + " for writing.");}
+        out << "rank,lineup,rating,deviation,wins,losses,ties,score\n";
+        for (int r = 0; r < league.size(); r++) {
+            const LeagueTeam& team = league.team(ranking[r]);
+            out << r + 1 << "," << lineupLetters(team.lineup) << "," << team.rating << "," << team.rd << "," << 
+                team.wins << "," << team.losses << "," << team.ties << "," << team.score() << "\n";
+        }
+        cout << "  full ranking written to " << csv_path << "\n";
+    }
+}
+
+void runBalanceMode(int step, int top_k, const string& csv_path) {
+    int n_threads = max(1u, thread::hardware_concurrency());
+    BalanceSolver solver(step, n_threads);
+    cout << "Balance search: step " << step << ", " << solver.n_candidates(goblin) << " goblins x " << 
+        solver.n_candidates(troll) << " trolls x " << solver.n_candidates(orc) << " orcs x 6 speed orders on " << 
+        n_threads << " threads\n";
+
+    ofstream csv;
+    if (!csv_path.empty()) {
+        csv.open(csv_path);
+        if (!csv) {throw runtime_error("Cannot open " + csv_path + " for writing.");}
+        csv << BalanceSolver::csvHeader();
+    }
+    vector<BalanceConfig> best;
+    auto start = chrono::steady_clock::now();
+    long long n_valid = solver.solve(top_k, csv_path.empty() ? nullptr : &csv, best);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "  " << n_valid << " valid configurations found in " << elapsed.count() << "s\n";
+    if (!csv_path.empty()) {cout << "  all valid configurations written to " << csv_path << "\n";}
+
+    // the stats currently in the game, for reference
+    BalanceConfig current;
+    for (int type = 0; type < 3; type++) {current.specs[type] = specOf(monsterPrototype(static_cast<MonsterType>(type)));}
+    cout << "  current stats are " << (verifyBalance(current) ? "balanced" : "NOT balanced") << "\n";
+
+    cout << "Best " << best.size() << " by margin (re-verified with the Monster classes):\n";
+    for (auto& config : best) {
+        cout << "  margin " << config.margin << "%: " << specText(goblin, config.specs[goblin]) << " " << 
+            specText(troll, config.specs[troll]) << " " << specText(orc, config.specs[orc]) << 
+            (verifyBalance(config) ? " verified" : " FAILED VERIFICATION") << "\n";
+    }
+}
+
+int benchCacheWorkload(const vector<pair<vector<MonsterType>, vector<MonsterType>>>& matchups, 
+    int n_battles, uint32_t seed) {
+    // n_battles battles drawn from the given matchups, with and without the cache;
+    // returns the number of cached results that differ from the simulated ones
+    vector<int> schedule;
+    mt19937 pick_rng(seed);
+    uniform_int_distribution<int> pick(0, matchups.size() - 1);
+    for (int i = 0; i < n_battles; i++) {schedule.push_back(pick(pick_rng));}
+
+    // uncached: simulate every battle with the matchup kernels
+    vector<BattleResult> simulated;
+    simulated.reserve(n_battles);
+    mt19937 kernel_rng(seed);
+    auto start = chrono::steady_clock::now();
+    for (int i : schedule) {
+        simulated.push_back(kernelBattle(matchups[i].first, matchups[i].second, kernel_rng));
+    }
+    chrono::duration<double> kernel_time = chrono::steady_clock::now() - start;
+
+    // cached: identical rng seed, and the cache draws only where the simulation would, so results must match
+    BattleService service(4 * matchups.size());
+    mt19937 cache_rng(seed);
+    int mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (int k = 0; k < n_battles; k++) {
+        int i = schedule[k];
+        CachedBattle cached = service.play(matchups[i].first, matchups[i].second, cache_rng);
+        if (cached.result.outcome != simulated[k].outcome || cached.result.turns != simulated[k].turns) {
+            mismatches++;
+        }
+    }
+    chrono::duration<double> cache_time = chrono::steady_clock::now() - start;
+
+    cout << "  matchup kernels: " << static_cast<long long>(n_battles / kernel_time.count()) << " battles/s\n";
+    cout << "  outcome cache:   " << static_cast<long long>(n_battles / cache_time.count()) << " battles/s (" << 
+        service.memory_bytes() / 1024 << " KiB)\n";
+    cout << "  hits " << service.hits << ", misses " << service.misses << ", random (simulated) " << 
+        service.random_plays << ", evictions " << service.evictions << "\n";
+    cout << "  turns answered from the cache: " << service.turns_skipped << ", mismatched results: " << mismatches << "\n";
+    return mismatches;
+}
+
+int runCacheBenchmark(int n_pairs, int n_battles, uint32_t seed) {
+    // a league-like workload: many battles drawn from a fixed set of random 4 vs 4 matchups;
+    // returns the exit code (1 if any cached result differs)
+    mt19937 pick_rng(seed);
+    vector<MonsterSpec> specs = defaultSpecs();
+    vector<pair<vector<MonsterType>, vector<MonsterType>>> matchups;
+    vector<pair<vector<MonsterType>, vector<MonsterType>>> deterministic;
+    for (int i = 0; i < n_pairs; i++) {
+        matchups.emplace_back(monsterPicker(4, pick_rng), monsterPicker(4, pick_rng));
+        BattleState state = initialState(specs.data(), matchups.back().first, matchups.back().second);
+        // stops before the first coin flip, so pick_rng is not drawn from
+        if (!playFrom(specs.data(), matchups.back().first, matchups.back().second, state, pick_rng, MAX_TURNS, false, true)) {
+            deterministic.push_back(matchups.back());
+        }
+    }
+
+    cout << "Cache benchmark: " << n_battles << " battles over " << n_pairs << " random 4 vs 4 matchups (seed " << seed << ")\n";
+    int mismatches = benchCacheWorkload(matchups, n_battles, seed);
+    if (!deterministic.empty()) {
+        cout << "Only the " << deterministic.size() << " matchups without coin flips:\n";
+        mismatches += benchCacheWorkload(deterministic, n_battles, seed);
+    }
+    if (mismatches != 0) {
+        cout << "FAILED: the outcome cache disagrees with the simulation\n";
+        return 1;
+    }
+    return 0;
+}
+
+int runAllocationCheck(int n_battles) {
+    // repeated makeBattle() calls must not allocate once the arena has warmed up;
+    // returns the exit code (1 if any allocation happened)
+#ifndef COUNT_ALLOCS
+    cout << "FAILED: allocations are only counted in a build with -DCOUNT_ALLOCS (make check)\n";
+    return 1;
+#endif
+    mt19937 rng(rd());
+    NullSink sink;
+    vector<pair<string, vector<MonsterType>>> lineups;
+    for (int i = 0; i < 2 * n_battles; i++) {
+        lineups.emplace_back(i % 2 ? "Blue" : "Red", monsterPicker(4, rng));
+    }
+    NamePool namepool;
 
-    auto team1 = make_unique<Team>(lineup1.first, std::move(team1_monsters));
-    auto team2 = make_unique<Team>(lineup2.first, std::move(team2_monsters));
-    battle(std::move(team1), std::move(team2));
+    // warm up: the arena grows to the largest number of monsters of each type a battle needs
+    pair<string, vector<MonsterType>> all_goblins("Red", vector<MonsterType>(4, goblin));
+    pair<string, vector<MonsterType>> all_trolls("Blue", vector<MonsterType>(4, troll));
+    pair<string, vector<MonsterType>> all_orcs("Red", vector<MonsterType>(4, orc));
+    long long before_warmup = n_heap_allocations.load();
+    makeBattle(all_goblins, all_trolls, namepool, sink, rng);
+    makeBattle(all_goblins, all_orcs, namepool, sink, rng);
+    makeBattle(all_trolls, all_orcs, namepool, sink, rng);
+    makeBattle(all_goblins, all_goblins, namepool, sink, rng);
+    makeBattle(all_trolls, all_trolls, namepool, sink, rng);
+    makeBattle(all_orcs, all_orcs, namepool, sink, rng);
+    long long warmup_allocations = n_heap_allocations.load() - before_warmup;
 
+    long long before = n_heap_allocations.load();
+    for (int i = 0; i < n_battles; i++) {
+        makeBattle(lineups[2*i], lineups[2*i+1], namepool, sink, rng);
+    }
+    long long allocations = n_heap_allocations.load() - before;
+
+    cout << "Allocation check: " << warmup_allocations << " allocations during warm-up, " << 
+        allocations << " during " << n_battles << " random 4 vs 4 battles\n";
+    if (allocations != 0) {
+        cout << "FAILED: makeBattle allocates in steady state\n";
+        return 1;
+    }
+    cout << "OK\n";
+    return 0;
+}
+
+int runRenderBenchmark(int n_battles, uint32_t seed) {
+    // render the same random 4 vs 4 battles with both text sinks; the bytes must be identical
+    // (returns the exit code)
+    ostringstream simple_text;
+    ostringstream buffered_text;
+    SimpleTextSink simple_sink(simple_text);
+    TextSink buffered_sink(buffered_text);
+
+    mt19937 simple_rng(seed);
+    NamePool simple_names;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        makeBattle({"Red", monsterPicker(4, simple_rng)}, {"Blue", monsterPicker(4, simple_rng)}, simple_names, simple_sink, simple_rng);
+    }
+    chrono::duration<double> simple_time = chrono::steady_clock::now() - start;
+
+    mt19937 buffered_rng(seed);
+    NamePool buffered_names;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < n_battles; i++) {
+        makeBattle({"Red", monsterPicker(4, buffered_rng)}, {"Blue", monsterPicker(4, buffered_rng)}, buffered_names, buffered_sink, buffered_rng);
+    }
+    buffered_sink.flush();
+    chrono::duration<double> buffered_time = chrono::steady_clock::now() - start;
+
+    bool identical = simple_text.str() == buffered_text.str();
+    cout << "Render benchmark: " << n_battles << " random 4 vs 4 battles (seed " << seed << "), " << 
+        buffered_text.str().size() / 1024 << " KiB of text\n";
+    cout << "  simple text sink:   " << static_cast<long long>(n_battles / simple_time.count()) << " battles/s\n";
+    cout << "  buffered text sink: " << static_cast<long long>(n_battles / buffered_time.count()) << " battles/s\n";
+    cout << "  speedup: " << simple_time.count() / buffered_time.count() << "x, output " << 
+        (identical ? "identical" : "DIFFERENT") << "\n";
+    if (!identical) {
+        cout << "FAILED: the buffered text sink renders different text\n";
+        return 1;
+    }
+    return 0;
+}
+
+int runAsyncBenchmark(int n_battles, uint32_t seed) {
+    // render the same random 4 vs 4 battles on the simulation thread (TextSink) and on a
+    // formatter thread (AsyncTextSink); the bytes must be identical (returns the exit code)
+    ostringstream sync_text;
+    ostringstream async_text;
+
+    mt19937 sync_rng(seed);
+    NamePool sync_names;
+    auto start = chrono::steady_clock::now();
+    {
+        TextSink sink(sync_text);
+        for (int i = 0; i < n_battles; i++) {
+            makeBattle({"Red", monsterPicker(4, sync_rng)}, {"Blue", monsterPicker(4, sync_rng)}, sync_names, sink, sync_rng);
+        }
+    }
+    chrono::duration<double> sync_time = chrono::steady_clock::now() - start;
+
+    mt19937 async_rng(seed);
+    NamePool async_names;
+    start = chrono::steady_clock::now();
+    AsyncTextSink sink(async_text);
+    for (int i = 0; i < n_battles; i++) {
+        makeBattle({"Red", monsterPicker(4, async_rng)}, {"Blue", monsterPicker(4, async_rng)}, async_names, sink, async_rng);
+    }
+    chrono::duration<double> simulation_time = chrono::steady_clock::now() - start;
+    sink.finish();
+    chrono::duration<double> async_time = chrono::steady_clock::now() - start;
+
+    bool identical = sync_text.str() == async_text.str();
+    cout << "Async render benchmark: " << n_battles << " random 4 vs 4 battles (seed " << seed << "), " << 
+        async_text.str().size() / 1024 << " KiB of text\n";
+    cout << "  text sink (simulation renders):   " << static_cast<long long>(n_battles / sync_time.count()) << " battles/s\n";
+    cout << "  async text sink, simulation side: " << static_cast<long long>(n_battles / simulation_time.count()) << " battles/s (" << 
+        sink.full_waits() << " waits on a full ring)\n";
+    cout << "  async text sink, until written:   " << static_cast<long long>(n_battles / async_time.count()) << " battles/s\n";
+    cout << "  output " << (identical ? "identical" : "DIFFERENT") << "\n";
+    if (!identical) {
+        cout << "FAILED: the async text sink renders different text\n";
+        return 1;
+    }
+    return 0;
+}
+
+void runAuditMode(int n_battles, const string& path) {
+    // full verbose log of random 4 vs 4 battles, formatted in the background
+    ofstream file(path, ios::binary);
+    if (!file) {
+        cout << "Cannot open " << path << "\n";
+        return;
+    }
+    mt19937 rng(rd());
+    NamePool namepool;
+    namepool.shuffle_names(rng);
+    int outcomes[N_OUTCOMES] = {0, 0, 0, 0, 0};
+    auto start = chrono::steady_clock::now();
+    AsyncTextSink sink(file);
+    for (int i = 0; i < n_battles; i++) {
+        sink.print("\nBattle #" + to_string(i + 1) + "\n");
+        outcomes[makeBattle({"Red", monsterPicker(4, rng)}, {"Blue", monsterPicker(4, rng)}, namepool, sink, rng).outcome]++;
+    }
+    chrono::duration<double> simulation_time = chrono::steady_clock::now() - start;
+    sink.finish();
+    chrono::duration<double> total_time = chrono::steady_clock::now() - start;
+    cout << "Audit log of " << n_battles << " battles written to " << path << "\n";
+    cout << "  Red wins: " << outcomes[team1_wins] << ", Blue wins: " << outcomes[team2_wins] << 
+        ", ties: " << outcomes[tied] << "\n";
+    cout << "  simulation " << simulation_time.count() << " s, until written " << total_time.count() << " s\n";
+}
+
+void runReplayMode(uint64_t seed, long long battle_idx, int team_size) {
+    // regenerate a single tournament battle from the tournament's seed and the battle's index,
+    // with the full text (the names are not part of the tournament and may differ)
+    vector<MonsterType> lineup1;
+    vector<MonsterType> lineup2;
+    CounterRng rng = tournamentRng(seed, battle_idx, team_size, lineup1, lineup2);
+    NamePool namepool;
+    TextSink sink(cout);
+    sink.print("\nTournament battle #" + to_string(battle_idx) + " (seed " + to_string(seed) + ")\n");
+    makeBattle({"Red", lineup1}, {"Blue", lineup2}, namepool, sink, rng);
+}
+
+void runMassiveMode(int n1, int n2, int max_turns, const string& log_path) {
+    // one battle between two huge random teams, headless or with the full text written to a file
+    mt19937 rng(rd());
+    NamePool namepool;
+    namepool.shuffle_names(rng);
+    pair<string, vector<MonsterType>> lineup1("Red", monsterPicker(n1, rng));
+    pair<string, vector<MonsterType>> lineup2("Blue", monsterPicker(n2, rng));
+
+    NullSink null_sink;
+    ofstream file;
+    unique_ptr<TextSink> text_sink;
+    if (!log_path.empty()) {
+        file.open(log_path, ios::binary);
+        if (!file) {
+            cout << "Cannot open " << log_path << "\n";
+            return;
+        }
+        text_sink = make_unique<TextSink>(file);
+    }
+    EventSink& sink = text_sink ? static_cast<EventSink&>(*text_sink) : null_sink;
+
+    auto start = chrono::steady_clock::now();
+    BattleResult result = makeBattle(lineup1, lineup2, namepool, sink, rng, max_turns);
+    if (text_sink) {text_sink->flush();}
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    const char* outcome_names[N_OUTCOMES] = {"Red wins", "Blue wins", "tied", "stopped by the turn limit", "stalemate"};
+    cout << "Massive battle: " << n1 << " vs " << n2 << " monsters, turn limit " << 
+        (max_turns > 0 ? to_string(max_turns) : string("none")) << "\n";
+    cout << "  " << outcome_names[result.outcome] << " after " << result.turns << " turns\n";
+    cout << "  " << elapsed.count() << " s (" << static_cast<long long>(result.turns / elapsed.count()) << " turns/s)";
+    if (!log_path.empty()) {cout << ", log written to " << log_path;}
+    cout << "\n";
+}
+
+void printTurnLatency(const LatencyHistogram& latency) {
+    cout << "p50 " << latency.percentile(0.5) / 1000.0 << " us, p99 " << latency.percentile(0.99) / 1000.0 << 
+        " us, p99.9 " << latency.percentile(0.999) / 1000.0 << " us, max " << latency.percentile(1.0) / 1000.0 << " us\n";
+}
+
+int runHostBenchmark(int n_matches, int n_threads, int max_active, uint64_t seed) {
+    // the matches of a tournament played interleaved on a BattleHost, with and without the limit on
+    // active matches, checked against battle(); then a share of them again over the loopback server
+    // (returns the exit code)
+    if (n_threads <= 0) {n_threads = max(1u, thread::hardware_concurrency());}
+    vector<BattleResult> expected(n_matches);
+    vector<vector<MonsterType>> lineups1(n_matches), lineups2(n_matches);
+    NamePool namepool;
+    NullSink null_sink;
+    for (int i = 0; i < n_matches; i++) {
+        CounterRng rng = tournamentRng(seed, i, 4, lineups1[i], lineups2[i]);
+        expected[i] = makeBattle({"Red", lineups1[i]}, {"Blue", lineups2[i]}, namepool, null_sink, rng);
+    }
+    auto same = [](const BattleResult& a, const BattleResult& b) {
+        return a.outcome == b.outcome && a.turns == b.turns && a.health1 == b.health1 && a.health2 == b.health2;
+    };
+
+    cout << "Battle host: " << n_matches << " random 4 vs 4 matches on " << n_threads << " threads (seed " << seed << ")\n";
+    int failures = 0;
+    for (int limit : {max_active, n_matches}) {
+        vector<BattleResult> results(n_matches);
+        long long n_bytes = 0;
+        mutex bytes_mutex;
+        auto start = chrono::steady_clock::now();
+        LatencyHistogram latency;
+        {
+            BattleHost host([&](int, long long id, const string& bytes, const BattleResult* result) {
+                if (result) {results[id] = *result;}
+                lock_guard<mutex> lock(bytes_mutex);
+                n_bytes += bytes.size();
+            }, n_threads, limit, seed);
+            for (int i = 0; i < n_matches; i++) {host.submit(0, lineups1[i], lineups2[i]);}
+            host.wait_idle();
+            latency = host.turn_latency();
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        int mismatches = 0;
+        for (int i = 0; i < n_matches; i++) {mismatches += !same(results[i], expected[i]);}
+        failures += mismatches;
+        cout << "  at most " << limit << " active: " << static_cast<long long>(n_matches / elapsed.count()) << " matches/s, " << 
+            static_cast<long long>(latency.count() / elapsed.count()) << " turns/s, " << n_bytes << " bytes recorded, " << 
+            mismatches << " mismatches with battle()\n    turn latency: ";
+        printTurnLatency(latency);
+    }
+
+#ifndef _WIN32
+    // loopback: one client sends every request at once, then reads the stream back
+    int n_remote = min(n_matches, 2000);
+    BattleServer server(0, n_threads, max_active, seed);
+    atomic<bool> stop(false);
+    thread server_thread([&]() {server.run(stop);});
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(server.port());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        cout << "  loopback: cannot connect\nFAILED: no connection to the battle server\n";
+        stop = true;
+        server_thread.join();
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    string requests;
+    for (int i = 0; i < n_remote; i++) {requests += lineupLetters(lineups1[i]) + " " + lineupLetters(lineups2[i]) + "\n";}
+    requests += "STATS\n"; // answered at once, so it comes back before most of the output
+    for (size_t sent = 0; sent < requests.size(); ) {
+        ssize_t n = send(fd, requests.data() + sent, requests.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {break;}
+        sent += n;
+    }
+
+    // matches get ids in request order, starting at 0 on a fresh server
+    string data;
+    size_t pos = 0;
+    char chunk[1 << 14];
+    auto read_line = [&](string& line) {
+        size_t line_end;
+        while ((line_end = data.find('\n', pos)) == string::npos) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {return false;}
+            data.append(chunk, n);
+        }
+        line = data.substr(pos, line_end - pos);
+        pos = line_end + 1;
+        return true;
+    };
+    vector<string> recordings(n_remote);
+    vector<int> remote_turns(n_remote, -1);
+    string line, stats_line;
+    int n_done = 0;
+    long long n_bytes = 0;
+    while (n_done < n_remote && read_line(line)) {
+        istringstream words(line);
+        string kind;
+        long long id;
+        words >> kind >> id;
+        if (kind == "E") {
+            size_t length;
+            words >> length;
+            while (data.size() - pos < length) {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) {break;}
+                data.append(chunk, n);
+            }
+            recordings[id].append(data, pos, length);
+            pos += length;
+            n_bytes += length;
+        } else if (kind == "R") {
+            string outcome;
+            words >> outcome >> remote_turns[id];
+            n_done++;
+        } else if (kind == "S") {
+            stats_line = line;
+        }
+        if (pos > (1 << 20)) {
+            data.erase(0, pos);
+            pos = 0;
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    close(fd);
+    stop = true;
+    server_thread.join();
+
+    int mismatches = 0;
+    for (int i = 0; i < n_remote; i++) {
+        bool ok = remote_turns[i] == expected[i].turns;
+        try {
+            BattleLog log(recordings[i]);
+            ok = ok && log.n_battles() == 1 && log.n_turns(0) == expected[i].turns;
+        } catch (const runtime_error&) {
+            ok = false;
+        }
+        mismatches += !ok;
+    }
+    cout << "  loopback TCP: " << n_done << " of " << n_remote << " matches streamed back in " << elapsed.count() * 1000 << 
+        " ms (" << n_bytes << " bytes), " << mismatches << " mismatches (turns and recordings)\n";
+    if (!stats_line.empty()) {cout << "    " << stats_line << "\n";}
+    failures += mismatches;
+#endif
+    if (failures != 0) {
+        cout << "FAILED: hosted matches disagree with battle()\n";
+        return 1;
+    }
+    return 0;
+}
+
+void runServeMode(int port, int n_threads, int max_active) {
+    // serve until killed, with a line of stats on stderr every 10 s while there is traffic
+#ifdef _WIN32
+    cout << "--serve needs POSIX sockets.\n";
+#else
+    if (n_threads <= 0) {n_threads = max(1u, thread::hardware_concurrency());}
+    uint64_t seed = rd();
+    BattleServer server(port, n_threads, max_active, seed);
+    cerr << "Serving battles on 127.0.0.1:" << server.port() << " (" << n_threads << " threads, at most " << max_active << 
+        " active matches, seed " << seed << ")\n";
+    atomic<bool> stop(false);
+    thread reporter([&]() {
+        string last;
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(10));
+            string stats = server.battle_host().stats();
+            if (stats != last) {cerr << stats << "\n";}
+            last = stats;
+        }
+    });
+    reporter.detach();
+    server.run(stop);
+#endif
+}
+
+// benchmark suite
+// micro-benchmarks of the hot functions and macro-benchmarks of the 7 battles of the game and of
+// large random teams, written as JSON for nightly comparisons (make bench builds ./bench, which runs it)
+
+volatile long long bench_guard = 0; // results go here so the compiler cannot drop the benchmarked code
+
+template <class Body>
+double nsPerCall(long long n_calls, Body body) {
+    // best of 3 runs of body(i) for i in [0, n_calls), in ns per call
+    double best = numeric_limits<double>::max();
+    for (int run = 0; run < 3; run++) {
+        auto start = chrono::steady_clock::now();
+        for (long long i = 0; i < n_calls; i++) {body(i);}
+        chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count() / n_calls);
+    }
+    return best;
+}
+
+struct MacroResult {
+    string name;
+    string sink;
+    long long n_battles;
+    double battles_per_second;
+    double turns_per_battle;
+    double allocations_per_battle;
 };
 
+template <class MakeLineups>
+MacroResult benchScenario(const string& name, EventSink& sink, const string& sink_name, long long n_battles, 
+    MakeLineups make_lineups) {
+    // n_battles battles of make_lineups(rng) after a short warm-up (so the arena has grown already)
+    NamePool namepool;
+    CounterRng rng(1, 0);
+    pair<string, vector<MonsterType>> lineup1("Red", {}), lineup2("Blue", {});
+    for (long long i = 0; i < min(n_battles, 100ll); i++) {
+        make_lineups(rng, lineup1.second, lineup2.second);
+        makeBattle(lineup1, lineup2, namepool, sink, rng, 0);
+    }
+    long long turns = 0;
+    long long allocations = n_heap_allocations.load();
+    auto start = chrono::steady_clock::now();
+    for (long long i = 0; i < n_battles; i++) {
+        rng = CounterRng(1, i + 1);
+        make_lineups(rng, lineup1.second, lineup2.second);
+        turns += makeBattle(lineup1, lineup2, namepool, sink, rng, 0).turns;
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    allocations = n_heap_allocations.load() - allocations;
+    return {name, sink_name, n_battles, n_battles / elapsed.count(), static_cast<double>(turns) / n_battles, 
+        static_cast<double>(allocations) / n_battles};
+}
+
+int runBenchSuite(const string& json_path, double scale) {
+    // scale multiplies the number of iterations (e.g. 0.1 for a quick check)
+    auto count = [scale](long long n) {return max(1ll, static_cast<long long>(n * scale));};
+    vector<pair<string, double>> micro; // (name, ns per call)
+    NullSink null_sink;
+    CounterRng rng(1, 0);
+
+    Goblin gob(0);
+    Goblin other_gob(1);
+    Orc orc_mon(2);
+    Troll tro(3);
+    micro.push_back({"turn_goblin_vs_orc", nsPerCall(count(2000000), [&](long long) {
+        gob.respawn(0);
+        orc_mon.respawn(2);
+        turn(gob, orc_mon, null_sink, rng);
+        bench_guard += gob.health;
+    })});
+    micro.push_back({"turn_goblin_vs_goblin_coin_flip", nsPerCall(count(2000000), [&](long long) {
+        gob.respawn(0);
+        other_gob.respawn(1);
+        turn(gob, other_gob, null_sink, rng);
+        bench_guard += gob.health;
+    })});
+    micro.push_back({"Monster::reduce_health", nsPerCall(count(20000000), [&](long long i) {
+        tro.health = tro.max_health;
+        bench_guard += tro.reduce_health(static_cast<int>(i & 127));
+    })});
+    Monster& defender = orc_mon;
+    micro.push_back({"Orc::on_enemy_attack", nsPerCall(count(10000000), [&](long long) {
+        ActionLog log;
+        orc_mon.health = orc_mon.max_health;
+        gob.health = gob.max_health;
+        defender.on_enemy_attack(gob.damage, &gob, &log);
+        bench_guard += orc_mon.health + gob.health;
+    })});
+
+    // a team of 1024 borrowed goblins, reset every 1024 calls, whose lead dies before every call
+    deque<Goblin> goblins;
+    vector<Monster*> members;
+    for (int i = 0; i < 1024; i++) {
+        goblins.emplace_back(i);
+        members.push_back(&goblins.back());
+    }
+    Team team;
+    micro.push_back({"Team::update_active_monster", nsPerCall(count(10000000), [&](long long i) {
+        int idx = static_cast<int>(i & 1023);
+        if (idx == 0) {
+            for (auto mon : members) {mon->respawn(mon->name_id);}
+            team.reset("Red", members);
+        }
+        members[idx]->is_alive = false;
+        team.update_active_monster();
+        bench_guard += team.is_defeated;
+    })});
+    orc_mon.team_id = internTeamName("Red");
+    micro.push_back({"getMemberText", nsPerCall(count(2000000), [&](long long i) {
+        bench_guard += getMemberText(orc_mon, i & 1).size();
+    })});
+    string member_text = getMemberText(orc_mon);
+    micro.push_back({"getPlainTextLength", nsPerCall(count(5000000), [&](long long) {
+        bench_guard += getPlainTextLength(member_text);
+    })});
+
+    // the 7 battles of the game, headless and with the text rendered (into a discarding stream),
+    // then large random teams headless
+    DiscardBuffer discard;
+    ostream discard_stream(&discard);
+    TextSink text_sink(discard_stream);
+    auto fixed = [](vector<MonsterType> l1, vector<MonsterType> l2) {
+        return [l1, l2](CounterRng&, vector<MonsterType>& lineup1, vector<MonsterType>& lineup2) {
+            lineup1 = l1;
+            lineup2 = l2;
+        };
+    };
+    auto random_teams = [](int n) {
+        return [n](CounterRng& rng, vector<MonsterType>& lineup1, vector<MonsterType>& lineup2) {
+            lineup1 = monsterPicker(n, rng);
+            lineup2 = monsterPicker(n, rng);
+        };
+    };
+    vector<MacroResult> macro;
+    for (int with_text = 0; with_text < 2; with_text++) {
+        EventSink& sink = with_text ? static_cast<EventSink&>(text_sink) : null_sink;
+        string sink_name = with_text ? "text" : "null";
+        long long n = count(with_text ? 100000 : 500000);
+        macro.push_back(benchScenario("battle1_goblin_vs_troll", sink, sink_name, n, fixed({goblin}, {troll})));
+        macro.push_back(benchScenario("battle2_goblin_vs_2_trolls", sink, sink_name, n, fixed({goblin}, {troll, troll})));
+        macro.push_back(benchScenario("battle3_troll_vs_orc", sink, sink_name, n, fixed({troll}, {orc})));
+        macro.push_back(benchScenario("battle4_troll_vs_2_orcs", sink, sink_name, n, fixed({troll}, {orc, orc})));
+        macro.push_back(benchScenario("battle5_orc_vs_goblin", sink, sink_name, n, fixed({orc}, {goblin})));
+        macro.push_back(benchScenario("battle6_orc_vs_2_goblins", sink, sink_name, n, fixed({orc}, {goblin, goblin})));
+        macro.push_back(benchScenario("battle7_random_4_vs_4", sink, sink_name, n, random_teams(4)));
+    }
+    macro.push_back(benchScenario("random_1000_vs_1000", null_sink, "null", count(200), random_teams(1000)));
+    macro.push_back(benchScenario("random_100000_vs_100000", null_sink, "null", count(4), random_teams(100000)));
+
+    ofstream file;
+    if (json_path != "-") {
+        file.open(json_path);
+        if (!file) {
+            cerr << "Cannot open " << json_path << "\n";
+            return 1;
+        }
+    }
+    ostream& out = json_path == "-" ? cout : file;
+#ifdef PROFILE
+    bool profile_build = true;
+#else
+    bool profile_build = false;
+#endif
+#ifdef COUNT_ALLOCS
+    bool count_allocs = true;
+#else
+    bool count_allocs = false; // allocations_per_battle is null
+#endif
+    out << "{\n  \"build\": {\"lane_backend\": \"" << LANE_BACKEND << "\", \"profile\": " << (profile_build ? "true" : "false") << 
+        ", \"count_allocs\": " << (count_allocs ? "true" : "false") << ", \"threads\": " << thread::hardware_concurrency() << "},\n  \"micro\": [";
+    for (size_t i = 0; i < micro.size(); i++) {
+        out << (i ? "," : "") << "\n    {\"name\": \"" << micro[i].first << "\", \"ns_per_call\": " << micro[i].second << "}";
+    }
+    out << "\n  ],\n  \"macro\": [";
+    for (size_t i = 0; i < macro.size(); i++) {
+        const MacroResult& r = macro[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"sink\": \"" << r.sink << "\", \"battles\": " << r.n_battles << 
+            ", \"battles_per_second\": " << r.battles_per_second << ", \"turns_per_battle\": " << r.turns_per_battle << 
+            ", \"allocations_per_battle\": ";
+        if (count_allocs) {out << r.allocations_per_battle;} else {out << "null";}
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return 0;
+}
 
 // main code for running all the battles
-int main() {
+int main(int argc, char* argv[]) {
+    // --profile path (anywhere on the command line): write the profile as JSON at the end of the run
+    vector<char*> args(argv, argv + argc);
+    string profile_path;
+    for (size_t i = 1; i + 1 < args.size(); i++) {
+        if (string(args[i]) == "--profile") {
+            profile_path = args[i + 1];
+            args.erase(args.begin() + i, args.begin() + i + 2);
+            break;
+        }
+    }
+    argc = args.size();
+    args.push_back(nullptr);
+    argv = args.data();
+    ProfileReport profile_report(profile_path);
+
+#ifdef BENCH_SUITE
+    // the ./bench executable (make bench): ./bench [json_path] [scale]
+    return runBenchSuite(argc > 1 ? argv[1] : "-", argc > 2 ? atof(argv[2]) : 1.0);
+#endif
+    if (argc > 1 && string(argv[1]) == "--bench-suite") {
+        return runBenchSuite(argc > 2 ? argv[2] : "-", argc > 3 ? atof(argv[3]) : 1.0);
+    }
+
+    if (argc > 1 && string(argv[1]) == "--bench-sinks") {
+        runSinkBenchmark(argc > 2 ? atoi(argv[2]) : 100000);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-soa") {
+        return runSoaBenchmark(argc > 2 ? atoi(argv[2]) : 100000, 
+            argc > 3 && atoll(argv[3]) > 0 ? strtoull(argv[3], nullptr, 10) : rd());
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-kernels") {
+        return runKernelBenchmark(argc > 2 ? atoi(argv[2]) : 100000, 
+            argc > 3 && atoll(argv[3]) > 0 ? strtoull(argv[3], nullptr, 10) : rd());
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-lanes") {
+        return runLaneBenchmark(argc > 2 ? atoi(argv[2]) : 1000000, 
+            argc > 3 && atoll(argv[3]) > 0 ? strtoull(argv[3], nullptr, 10) : rd(), argc > 4 ? argv[4] : "builtin");
+    }
+    if (argc > 3 && string(argv[1]) == "--analyze") {
+        runAnalyzeMode(parseLineup(argv[2]), parseLineup(argv[3]));
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-fast-forward") {
+        return runFastForwardBenchmark(argc > 2 ? argv[2] : "builtin", argc > 3 ? atoi(argv[3]) : 100000, 
+            argc > 4 && atoll(argv[4]) > 0 ? strtoull(argv[4], nullptr, 10) : rd());
+    }
+    if (argc > 3 && string(argv[1]) == "--league") {
+        runLeagueMode(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 2, argc > 5 ? atoi(argv[5]) : 0, argc > 6 ? argv[6] : "");
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--catalog") {
+        runCatalogMode(argv[2], argc > 3 ? atoi(argv[3]) : 100000, argc > 4 ? atoi(argv[4]) : 4, argc > 5 && atoi(argv[5]));
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--optimize") {
+        runOptimizeMode(argv[2], argv[3]);
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--analyze-random") {
+        runAnalyzeRandomMode(atoi(argv[2]), atoi(argv[3]));
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--balance") {
+        runBalanceMode(argc > 2 ? atoi(argv[2]) : 10, argc > 3 ? atoi(argv[3]) : 10, argc > 4 ? argv[4] : "");
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-cache") {
+        return runCacheBenchmark(argc > 2 ? atoi(argv[2]) : 3000, argc > 3 ? atoi(argv[3]) : 1000000, 
+            argc > 4 && atoll(argv[4]) > 0 ? strtoull(argv[4], nullptr, 10) : rd());
+    }
+    if (argc > 1 && string(argv[1]) == "--check-allocs") {
+        return runAllocationCheck(argc > 2 ? atoi(argv[2]) : 100000);
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-render") {
+        return runRenderBenchmark(argc > 2 ? atoi(argv[2]) : 20000, 
+            argc > 3 && atoll(argv[3]) > 0 ? strtoull(argv[3], nullptr, 10) : rd());
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-async") {
+        return runAsyncBenchmark(argc > 2 ? atoi(argv[2]) : 20000, 
+            argc > 3 && atoll(argv[3]) > 0 ? strtoull(argv[3], nullptr, 10) : rd());
+    }
+    if (argc > 2 && string(argv[1]) == "--audit") {
+        runAuditMode(atoi(argv[2]), argc > 3 ? argv[3] : "audit.log");
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--massive") {
+        runMassiveMode(atoi(argv[2]), atoi(argv[3]), argc > 4 ? atoi(argv[4]) : 0, argc > 5 ? argv[5] : "");
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--tournament") {
+        runTournamentMode(atoll(argv[2]), argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? argv[4] : "", 
+            argc > 5 && atoll(argv[5]) > 0 ? strtoull(argv[5], nullptr, 10) : rd(), argc > 6 ? argv[6] : "");
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-record") {
+        return runRecordBenchmark(argc > 2 ? atoi(argv[2]) : 20000, 
+            argc > 3 && atoll(argv[3]) > 0 ? strtoull(argv[3], nullptr, 10) : rd());
+    }
+    if (argc > 3 && string(argv[1]) == "--record") {
+        runRecordMode(atoi(argv[2]), argv[3], argc > 4 ? atoi(argv[4]) : 16);
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--play") {
+        runPlayMode(argv[2], argc > 3 ? atoi(argv[3]) : -1, argc > 4 ? atoi(argv[4]) : 0, argc > 5 ? atoi(argv[5]) : 0);
+        return 0;
+    }
+    if (argc > 7 && string(argv[1]) == "--job") {
+        string kind = argv[3];
+        if (kind != "random" && kind != "grid") {throw runtime_error("Job battles must be random or grid.");}
+        runJobMode(argv[2], kind == "grid", strtoull(argv[4], nullptr, 10), atoll(argv[5]), atoi(argv[6]), atoi(argv[7]), 
+            argc > 8 ? atoi(argv[8]) : 0, argc > 9 ? atof(argv[9]) : 60);
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--merge-jobs") {
+        runMergeJobsMode(argv[2], vector<string>(argv + 3, argv + argc));
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--query") {
+        runQueryMode(argv[2], argc > 3 ? atoll(argv[3]) : 100);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-host") {
+        return runHostBenchmark(argc > 2 ? atoi(argv[2]) : 20000, argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? atoi(argv[4]) : 1000, 
+            argc > 5 && atoll(argv[5]) > 0 ? strtoull(argv[5], nullptr, 10) : rd());
+    }
+    if (argc > 1 && string(argv[1]) == "--serve") {
+        runServeMode(argc > 2 ? atoi(argv[2]) : 7878, argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? atoi(argv[4]) : 10000);
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--replay") {
+        runReplayMode(strtoull(argv[2], nullptr, 10), atoll(argv[3]), argc > 4 ? atoi(argv[4]) : 4);
+        return 0;
+    }
 
-    vector<string> namepool = getNamePool();
-    shuffle(namepool.begin(), namepool.end(), gen);
+    // every battle draws from CounterRng(seed, battle number), the names from battle number 0,
+    // so the same seed plays exactly the same battles
+    uint64_t seed = argc > 2 && string(argv[1]) == "--seed" ? strtoull(argv[2], nullptr, 10) : rd();
+    cerr << "seed " << seed << " (play the same battles again with --seed " << seed << ")\n";
+    CounterRng rng(seed, 0);
+    NamePool namepool;
+    namepool.shuffle_names(rng);
+    TextSink sink(cout);
 
     int battle_idx = 1;
 
-    cout << "\n=======================================================================================================================\n";
+    sink.print("\n=======================================================================================================================\n");
 
 
     // battle 1: One goblin vs one troll.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", {goblin}}, {"Blue", {troll}}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", {goblin}}, {"Blue", {troll}}, namepool, sink, rng);
     battle_idx++;
 
     // battle 2: One goblin vs two trolls.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", {goblin}}, {"Blue", {troll, troll}}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", {goblin}}, {"Blue", {troll, troll}}, namepool, sink, rng);
     battle_idx++;
 
     // battle 3: One troll vs one orc.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", {troll}}, {"Blue", {orc}}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", {troll}}, {"Blue", {orc}}, namepool, sink, rng);
     battle_idx++;
 
     // battle 4: One troll vs two orc.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", {troll}}, {"Blue", {orc, orc}}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", {troll}}, {"Blue", {orc, orc}}, namepool, sink, rng);
     battle_idx++;
 
     // battle 5: One orc vs one goblin.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", {orc}}, {"Blue", {goblin}}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", {orc}}, {"Blue", {goblin}}, namepool, sink, rng);
     battle_idx++;
 
     // battle 6: One orc vs two goblin.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", {orc}}, {"Blue", {goblin, goblin}}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", {orc}}, {"Blue", {goblin, goblin}}, namepool, sink, rng);
     battle_idx++;
 
     // battle 7: 4 random monsters vs 4 random monsters.
-    cout << "\nBattle #" << battle_idx << "\n";
-    makeBattle({"Red", monsterPicker(4)}, {"Blue", monsterPicker(4)}, namepool);
+    sink.print("\nBattle #" + to_string(battle_idx) + "\n");
+    rng = CounterRng(seed, battle_idx);
+    makeBattle({"Red", monsterPicker(4, rng)}, {"Blue", monsterPicker(4, rng)}, namepool, sink, rng);
     battle_idx++;
 
     return 0;